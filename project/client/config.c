@@ -0,0 +1,532 @@
+/*
+ *  Configuration for thermd
+ *
+ *  The file is "key = value" lines, '#' or ';' starts a comment, and
+ *  "[zone name]" starts a zone section. Values are typed:
+ *  int       decimal
+ *  number    decimal, fractions allowed
+ *  duration  seconds, or with a ms/s/m/h/d suffix ("500ms", "5m")
+ *  size      bytes, or with a k/M/G suffix (1024 based)
+ *  bool      1/0, yes/no, true/false, on/off
+ *  path      absolute path
+ *  string    anything up to the field size
+ *  Unknown keys are warned about and skipped, a value that doesn't
+ *  parse or is out of range rejects the whole file.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <float.h>
+#include <syslog.h>
+#include "config.h"
+#include "endpoint.h"
+#include "filter.h"
+#include "sampler.h"
+#include "tz.h"
+
+#define STATUSFILENAME "/tmp/status"
+
+#define CONFIG_STRING	0
+#define CONFIG_PATH	1
+#define CONFIG_INT	2
+#define CONFIG_NUMBER	3
+#define CONFIG_DURATION	4
+#define CONFIG_SIZE	5
+#define CONFIG_BOOL	6
+#define CONFIG_ENUM	7
+
+typedef struct {
+	const char *name;
+	int value;
+}config_enum_t;
+
+typedef struct {
+	const char *key;
+	uint8_t type;
+	/* where the value goes, in thermd_config_t or zone_config_t */
+	size_t offset;
+	size_t size;
+	/* applied before the file is read, NULL leaves the field zeroed */
+	const char *def;
+	/* allowed range, for strings the minimum length */
+	double min;
+	double max;
+	/* names for CONFIG_ENUM, ending with a NULL name */
+	const config_enum_t *names;
+}config_key_t;
+
+static const config_enum_t control_names[] = {
+	{ "bangbang",	CONTROL_BANGBANG },
+	{ "hysteresis",	CONTROL_HYSTERESIS },
+	{ "pid",	CONTROL_PID },
+	{ NULL, 0 },
+};
+
+static const config_enum_t filter_names[] = {
+	{ "none",	FILTER_NONE },
+	{ "mean",	FILTER_MEAN },
+	{ "average",	FILTER_MEAN },
+	{ "median",	FILTER_MEDIAN },
+	{ "ema",	FILTER_EMA },
+	{ NULL, 0 },
+};
+
+static const config_enum_t power_names[] = {
+	{ "normal",	POWER_NORMAL },
+	{ "low",	POWER_LOW },
+	{ NULL, 0 },
+};
+
+static const config_enum_t report_names[] = {
+	{ "always",	REPORT_ALWAYS },
+	{ "change",	REPORT_CHANGE },
+	{ NULL, 0 },
+};
+
+static const config_enum_t http_client_names[] = {
+	{ "curl",	HTTP_CLIENT_CURL },
+	{ "builtin",	HTTP_CLIENT_BUILTIN },
+	{ NULL, 0 },
+};
+
+static const config_enum_t unit_names[] = {
+	{ "C",	0 },
+	{ "F",	1 },
+	{ NULL, 0 },
+};
+
+#define KEY(key, type, field, def, min, max) \
+	{ key, type, offsetof(thermd_config_t, field), sizeof(((thermd_config_t *) 0)->field), def, min, max, NULL }
+#define ENUM(key, field, def, names) \
+	{ key, CONFIG_ENUM, offsetof(thermd_config_t, field), sizeof(((thermd_config_t *) 0)->field), def, 0, 0, names }
+#define ZONE_KEY(key, type, field, min, max) \
+	{ key, type, offsetof(zone_config_t, field), sizeof(((zone_config_t *) 0)->field), NULL, min, max, NULL }
+#define ZONE_ENUM(key, field, names) \
+	{ key, CONFIG_ENUM, offsetof(zone_config_t, field), sizeof(((zone_config_t *) 0)->field), NULL, 0, 0, names }
+
+static const config_key_t keys[] = {
+	KEY("endpoint",		CONFIG_STRING,	endpoint,	"18.234.11.129:9000", 1, 0),
+	KEY("logfile",		CONFIG_PATH,	logfile,	"/var/log/thermd.log", 1, 0),
+	KEY("timezone",		CONFIG_STRING,	timezone,	NULL, 0, 0),
+	KEY("connect_timeout",	CONFIG_DURATION, connect_timeout, "5", 0.001, 3600),
+	KEY("request_timeout",	CONFIG_DURATION, request_timeout, "10", 0.001, 3600),
+	KEY("max_response",	CONFIG_SIZE,	max_response,	"64k", 1024, 1 << 30),
+	KEY("tls_ca",		CONFIG_PATH,	tls_ca,		NULL, 0, 0),
+	KEY("tls_verify",	CONFIG_BOOL,	tls_verify,	"yes", 0, 0),
+	KEY("dns_ttl",		CONFIG_DURATION, dns_ttl,	"60", 0, 86400),
+	KEY("compress_threshold", CONFIG_SIZE,	compress_threshold, "0", 0, 1 << 20),
+	ENUM("http_client",	http_client,	"curl",		http_client_names),
+	/* sensor */
+	KEY("sensor",		CONFIG_STRING,	sensor,		"file:/tmp/temp", 1, 0),
+	ENUM("sensor_units",	sensor_fahrenheit, "C",		unit_names),
+	KEY("sample_rate",	CONFIG_INT,	sample_rate,	"10", 1, SAMPLER_MAX_RATE),
+	ENUM("filter",		filter_type,	"mean",		filter_names),
+	KEY("filter_window",	CONFIG_INT,	filter_window,	"10", 1, FILTER_MAX_WINDOW),
+	KEY("filter_alpha",	CONFIG_NUMBER,	filter_alpha,	NULL, 0, 1),
+	/* control */
+	ENUM("control",		control.type,	"bangbang",	control_names),
+	KEY("hysteresis",	CONFIG_NUMBER,	control.hysteresis, "0.5", 0, 100),
+	KEY("kp",		CONFIG_NUMBER,	control.kp,	NULL, -DBL_MAX, DBL_MAX),
+	KEY("ki",		CONFIG_NUMBER,	control.ki,	NULL, -DBL_MAX, DBL_MAX),
+	KEY("kd",		CONFIG_NUMBER,	control.kd,	NULL, -DBL_MAX, DBL_MAX),
+	KEY("pid_window",	CONFIG_DURATION, control.pid_window, "300", 1, 86400),
+	KEY("min_on",		CONFIG_DURATION, control.min_on, NULL, 0, 86400),
+	KEY("min_off",		CONFIG_DURATION, control.min_off, NULL, 0, 86400),
+	/* loop periods */
+	KEY("control_period",	CONFIG_DURATION, control_period, "1", 0.001, 3600),
+	KEY("telemetry_period",	CONFIG_DURATION, telemetry_period, "1", 0.001, 86400),
+	KEY("poll_min",		CONFIG_DURATION, poll_min,	"1", 0.001, 86400),
+	KEY("poll_max",		CONFIG_DURATION, poll_max,	"30", 0.001, 86400),
+	KEY("poll_window",	CONFIG_DURATION, poll_window,	"300", 0, 604800),
+	ENUM("report",		report,		"always",	report_names),
+	KEY("report_delta",	CONFIG_NUMBER,	report_delta,	"0.2", 0, 100),
+	KEY("report_heartbeat",	CONFIG_DURATION, report_heartbeat, "300", 0.001, 86400),
+	ENUM("power",		power,		"normal",	power_names),
+	KEY("idle_max",		CONFIG_DURATION, idle_max,	"300", 0.001, 86400),
+	KEY("timer_slack",	CONFIG_DURATION, timer_slack,	"50ms", 0, 60),
+	/* status */
+	KEY("status",		CONFIG_STRING,	status,		NULL, 0, 0),
+	KEY("status_fsync",	CONFIG_BOOL,	status_fsync,	"0", 0, 0),
+	KEY("status_heartbeat",	CONFIG_DURATION, status_heartbeat, "60", 0.001, 86400),
+	/* local interfaces */
+	KEY("telemetry_shm",	CONFIG_PATH,	telemetry_shm,	NULL, 0, 0),
+	KEY("control_socket",	CONFIG_PATH,	control_socket,	NULL, 0, 0),
+	KEY("metrics_file",	CONFIG_PATH,	metrics_file,	NULL, 0, 0),
+	KEY("metrics_period",	CONFIG_DURATION, metrics_period, "10", 0.001, 86400),
+	/* gateway mode */
+	KEY("gateway_devices",	CONFIG_INT,	gateway.devices, "1000", 1, 10000000),
+	KEY("gateway_threads",	CONFIG_INT,	gateway.threads, "4", 1, 256),
+	KEY("gateway_period",	CONFIG_INT,	gateway.period_ms, "1000", 1, 86400000),
+	KEY("gateway_duration",	CONFIG_INT,	gateway.duration, NULL, 0, 31536000),
+	KEY("gateway_concurrency", CONFIG_INT,	gateway.concurrency, "64", 1, 100000),
+};
+
+static const config_key_t zone_keys[] = {
+	ZONE_KEY("sensor",	CONFIG_STRING,	sensor,	1, 0),
+	ZONE_ENUM("sensor_units", fahrenheit,	unit_names),
+	ZONE_KEY("status",	CONFIG_STRING,	status,	1, 0),
+	ZONE_KEY("url",		CONFIG_STRING,	url,	1, 0),
+};
+
+#define NKEYS(table) (sizeof(table) / sizeof(table[0]))
+
+/**
+ * Logs a config problem, and prints it too when there's a terminal to print to
+ */
+static void report(FILE *errors, int priority, const char *path, uint32_t lineno, const char *fmt, ...){
+	char where[16] = "";
+	char msg[256];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(msg, sizeof(msg), fmt, ap);
+	va_end(ap);
+	/* line 0 is the file as a whole */
+	if (lineno > 0){
+		snprintf(where, sizeof(where), ":%u", lineno);
+	}
+	syslog(priority, "%s%s: %s\n", path, where, msg);
+	if (errors != NULL){
+		fprintf(errors, "%s%s: %s\n", path, where, msg);
+	}
+}
+
+static char *trim(char *s){
+	char *end;
+
+	while (isspace((unsigned char) *s)){
+		s++;
+	}
+	end = s + strlen(s);
+	while (end > s && isspace((unsigned char) end[-1])){
+		*--end = '\0';
+	}
+	return s;
+}
+
+/**
+ * Parses a number with an optional unit suffix, units is a list of
+ * suffix/multiplier pairs, a bare number is multiplied by 1
+ */
+static bool parse_units(const char *value, const char **units, const double *scales, double *out){
+	char *end;
+	double v = strtod(value, &end);
+	uint32_t i;
+
+	if (end == value){
+		return false;
+	}
+	while (isspace((unsigned char) *end)){
+		end++;
+	}
+	if (*end == '\0'){
+		*out = v;
+		return true;
+	}
+	for (i = 0; units[i] != NULL; i++){
+		if (!strcmp(end, units[i])){
+			*out = v * scales[i];
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool parse_duration(const char *value, double *out){
+	static const char *units[] = { "ms", "s", "m", "h", "d", NULL };
+	static const double scales[] = { 0.001, 1, 60, 3600, 86400 };
+	return parse_units(value, units, scales, out);
+}
+
+static bool parse_size(const char *value, double *out){
+	static const char *units[] = { "k", "K", "M", "G", NULL };
+	static const double scales[] = { 1024, 1024, 1024 * 1024, 1024 * 1024 * 1024 };
+	return parse_units(value, units, scales, out) && *out == (double)(uint64_t) *out;
+}
+
+static bool parse_bool(const char *value, bool *out){
+	static const char *yes[] = { "1", "yes", "true", "on" };
+	static const char *no[] = { "0", "no", "false", "off" };
+	uint32_t i;
+
+	for (i = 0; i < 4; i++){
+		if (!strcasecmp(value, yes[i])){
+			*out = true;
+			return true;
+		}
+		if (!strcasecmp(value, no[i])){
+			*out = false;
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * Parses value as key's type into base + key->offset, returns an error
+ * message or NULL
+ */
+static const char *set_value(const config_key_t *key, void *base, const char *value){
+	char *field = (char *) base + key->offset;
+	const config_enum_t *e;
+	double v;
+	char *end;
+	bool b;
+
+	switch (key->type){
+		case CONFIG_PATH:
+			if (*value != '\0' && *value != '/'){
+				return "expected an absolute path";
+			}
+			/* fall through */
+		case CONFIG_STRING:
+			if (strlen(value) >= key->size){
+				return "value too long";
+			}
+			if (strlen(value) < key->min){
+				return "value can't be empty";
+			}
+			strcpy(field, value);
+			return NULL;
+
+		case CONFIG_BOOL:
+			if (!parse_bool(value, &b)){
+				return "expected yes or no";
+			}
+			*(bool *) field = b;
+			return NULL;
+
+		case CONFIG_ENUM:
+			for (e = key->names; e->name != NULL; e++){
+				if (!strcasecmp(value, e->name)){
+					*(uint8_t *) field = e->value;
+					return NULL;
+				}
+			}
+			return "unknown value";
+
+		case CONFIG_INT:
+			if (key->size != sizeof(uint32_t)){
+				return "bad key type";
+			}
+			v = strtod(value, &end);
+			if (end == value || *end != '\0' || v != (double)(int64_t) v){
+				return "expected a whole number";
+			}
+			break;
+
+		case CONFIG_NUMBER:
+			v = strtod(value, &end);
+			if (end == value || *end != '\0'){
+				return "expected a number";
+			}
+			break;
+
+		case CONFIG_DURATION:
+			if (!parse_duration(value, &v)){
+				return "expected a duration like 30, 500ms or 5m";
+			}
+			break;
+
+		case CONFIG_SIZE:
+			if (!parse_size(value, &v)){
+				return "expected a size like 4096 or 64k";
+			}
+			break;
+
+		default:
+			return "bad key type";
+	}
+
+	if (v < key->min || v > key->max){
+		return "out of range";
+	}
+	switch (key->type){
+		case CONFIG_INT:
+			*(uint32_t *) field = (uint32_t) v;
+			break;
+		case CONFIG_SIZE:
+			*(size_t *) field = (size_t) v;
+			break;
+		default:
+			*(double *) field = v;
+	}
+	return NULL;
+}
+
+static const config_key_t *find_key(const config_key_t *table, size_t count, const char *name){
+	size_t i;
+	for (i = 0; i < count; i++){
+		if (!strcmp(table[i].key, name)){
+			return &table[i];
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Starts a new zone from a "[zone name]" (or "[name]") section header
+ */
+static zone_config_t *add_zone(thermd_config_t *cfg, const char *header){
+	zone_config_t *zones;
+	zone_config_t *zone;
+	size_t len;
+
+	header++;
+	if (!strncmp(header, "zone ", strlen("zone "))){
+		header += strlen("zone ");
+	}
+	len = strcspn(header, "]");
+	if (len == 0 || len >= ZONE_NAME_SIZE){
+		return NULL;
+	}
+
+	zones = realloc(cfg->zones, (cfg->nzones + 1) * sizeof(zone_config_t));
+	if (zones == NULL){
+		return NULL;
+	}
+	cfg->zones = zones;
+	zone = &zones[cfg->nzones++];
+	memset(zone, 0, sizeof(*zone));
+	memcpy(zone->name, header, len);
+	snprintf(zone->status, ZONE_PATH_SIZE, "%s.%s", STATUSFILENAME, zone->name);
+	/* top level sensor_units is the default for every zone */
+	zone->fahrenheit = cfg->sensor_fahrenheit;
+	return zone;
+}
+
+/**
+ * Checks that only make sense across keys
+ */
+static const char *validate(const thermd_config_t *cfg){
+	endpoint_pool_t pool;
+
+	if (endpoint_pool_init(&pool, cfg->endpoint) != ENDPOINT_OK){
+		return "endpoint needs 1 to 8 comma separated urls";
+	}
+	if (cfg->poll_max < cfg->poll_min){
+		return "poll_max is less than poll_min";
+	}
+	if (cfg->control.type == CONTROL_PID && cfg->control.kp == 0 && cfg->control.ki == 0 && cfg->control.kd == 0){
+		return "control=pid needs kp, ki or kd";
+	}
+	if (tz_check(cfg->timezone) != TZ_OK){
+		return "timezone is neither a zone under /usr/share/zoneinfo nor a POSIX TZ string";
+	}
+	return NULL;
+}
+
+/**
+ * Reads the config file into a new config, NULL if it can't be used
+ * Problems are logged, and printed to errors too unless it's NULL
+ * Each "[zone name]" section adds a zone with its own sensor, status and
+ * url keys, without any sections there is one zone built from the top level keys
+ */
+thermd_config_t *config_load(const char *configfile, FILE *errors){
+	FILE *fp = fopen(configfile, "r");
+	thermd_config_t *cfg;
+	const config_key_t *key;
+	const char *err;
+	char *line = NULL;
+	char *name, *value, *equals;
+	size_t len = 0;
+	uint32_t lineno = 0;
+	zone_config_t *zone = NULL;
+	bool ok = true;
+	uint32_t i;
+
+	if (fp == NULL){
+		report(errors, LOG_ERR, configfile, 0, "can't open");
+		return NULL;
+	}
+	cfg = calloc(1, sizeof(*cfg));
+	if (cfg == NULL){
+		fclose(fp);
+		return NULL;
+	}
+	for (i = 0; i < NKEYS(keys); i++){
+		if (keys[i].def != NULL){
+			set_value(&keys[i], cfg, keys[i].def);
+		}
+	}
+
+	while (getline(&line, &len, fp) != -1){
+		lineno++;
+		name = trim(line);
+		if (*name == '\0' || *name == '#' || *name == ';'){
+			continue;
+		}
+		if (*name == '['){
+			zone = add_zone(cfg, name);
+			if (zone == NULL){
+				report(errors, LOG_ERR, configfile, lineno, "bad zone section %s", name);
+				ok = false;
+				break;
+			}
+			continue;
+		}
+
+		equals = strchr(name, '=');
+		if (equals == NULL){
+			report(errors, LOG_WARNING, configfile, lineno, "ignoring \"%s\", expected key = value", name);
+			continue;
+		}
+		*equals = '\0';
+		value = trim(equals + 1);
+		name = trim(name);
+
+		/* zone keys override the top level ones inside a section */
+		if (zone != NULL && (key = find_key(zone_keys, NKEYS(zone_keys), name)) != NULL){
+			err = set_value(key, zone, value);
+		}
+		else if ((key = find_key(keys, NKEYS(keys), name)) != NULL){
+			err = set_value(key, cfg, value);
+		}
+		else{
+			report(errors, LOG_WARNING, configfile, lineno, "unknown key %s", name);
+			continue;
+		}
+		if (err != NULL){
+			report(errors, LOG_ERR, configfile, lineno, "%s = %s: %s", name, value, err);
+			ok = false;
+		}
+	}
+	free(line);
+	fclose(fp);
+
+	if (ok && (err = validate(cfg)) != NULL){
+		report(errors, LOG_ERR, configfile, 0, "%s", err);
+		ok = false;
+	}
+	if (!ok){
+		config_free(cfg);
+		return NULL;
+	}
+
+	/* No sections, the original single zone */
+	if (cfg->nzones == 0){
+		zone = add_zone(cfg, "[" DEFAULT_ZONE_NAME "]");
+		if (zone == NULL){
+			config_free(cfg);
+			return NULL;
+		}
+		strncpy(zone->status, strlen(cfg->status) ? cfg->status : STATUSFILENAME, ZONE_PATH_SIZE - 1);
+	}
+	for (i = 0; i < cfg->nzones; i++){
+		if (strlen(cfg->zones[i].sensor) == 0){
+			strncpy(cfg->zones[i].sensor, cfg->sensor, ZONE_PATH_SIZE - 1);
+		}
+	}
+	return cfg;
+}
+
+void config_free(thermd_config_t *cfg){
+	if (cfg != NULL){
+		free(cfg->zones);
+		free(cfg);
+	}
+}
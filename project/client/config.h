@@ -0,0 +1,110 @@
+/*
+ *  Configuration for thermd
+ *
+ *  The config file is parsed into a thermd_config_t that nothing
+ *  modifies afterwards. Every key is described once in a table in
+ *  config.c with its type, default and allowed range. A reload parses a fresh one and the control
+ *  loop swaps it in between ticks, so a tick never sees half of an
+ *  old config and half of a new one.
+ */
+
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "control.h"
+#include "gateway.h"
+#include "zone.h"
+
+#define CONFIG_OK	0
+#define CONFIG_ERR	1
+
+#define CONFIG_VALUE_SIZE 100
+/* comma separated lists */
+#define CONFIG_LIST_SIZE 512
+
+#define POWER_NORMAL	0
+/* tick only when something is due, see README.txt */
+#define POWER_LOW	1
+
+#define REPORT_ALWAYS	0
+/* post a zone only when it moved, flipped or went quiet too long */
+#define REPORT_CHANGE	1
+
+#define HTTP_CLIENT_CURL	0
+/* http.c for plain http://, see README.txt */
+#define HTTP_CLIENT_BUILTIN	1
+
+typedef struct {
+	char name[ZONE_NAME_SIZE];
+	char sensor[ZONE_PATH_SIZE];
+	bool fahrenheit;
+	char status[ZONE_PATH_SIZE];
+	/* empty uses the endpoint pool */
+	char url[ZONE_PATH_SIZE];
+}zone_config_t;
+
+typedef struct {
+	/* one or more servers, see endpoint.h */
+	char endpoint[CONFIG_LIST_SIZE];
+	char logfile[CONFIG_VALUE_SIZE];
+	char timezone[CONFIG_VALUE_SIZE];
+	/* HTTP limits, seconds and bytes */
+	double connect_timeout;
+	double request_timeout;
+	size_t max_response;
+	/* https:// endpoints */
+	char tls_ca[CONFIG_VALUE_SIZE];
+	bool tls_verify;
+	/* gzip POST bodies at least this long, 0 is off */
+	size_t compress_threshold;
+	uint8_t http_client;
+	/* seconds a resolved host name is reused */
+	double dns_ttl;
+	/* sensor */
+	char sensor[CONFIG_VALUE_SIZE];
+	bool sensor_fahrenheit;
+	uint32_t sample_rate;
+	uint8_t filter_type;
+	uint32_t filter_window;
+	double filter_alpha;
+	/* control */
+	control_params_t control;
+	/* loop periods, seconds */
+	double control_period;
+	double telemetry_period;
+	double poll_min;
+	double poll_max;
+	double poll_window;
+	uint8_t power;
+	/* report=change, degrees and seconds */
+	uint8_t report;
+	double report_delta;
+	double report_heartbeat;
+	/* longest low power sleep, and the timer slack the kernel may add */
+	double idle_max;
+	double timer_slack;
+	/* status */
+	char status[CONFIG_VALUE_SIZE];
+	bool status_fsync;
+	double status_heartbeat;
+	/* local interfaces, empty is off */
+	char telemetry_shm[CONFIG_VALUE_SIZE];
+	char control_socket[CONFIG_VALUE_SIZE];
+	char metrics_file[CONFIG_VALUE_SIZE];
+	double metrics_period;
+	/* gateway mode, url/tz/parse are filled in when it runs */
+	gateway_params_t gateway;
+	/* at least one, a "default" zone when the file has no sections */
+	zone_config_t *zones;
+	uint32_t nzones;
+}thermd_config_t;
+
+/* Function prototypes */
+thermd_config_t *config_load(const char *path, FILE *errors);
+void config_free(thermd_config_t *cfg);
+
+#endif
@@ -0,0 +1,222 @@
+/*
+ *  Heater control engine for thermd
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "control.h"
+
+#define REPLAY_LINE_SIZE 256
+
+void control_init(control_t *c, const control_params_t *params){
+	memset(c, 0, sizeof(*c));
+	control_set_params(c, params);
+}
+
+/**
+ *  Swaps in new tuning on a running controller, the relay state and
+ *  its timers carry over so min_on/min_off still hold across the change
+ */
+void control_set_params(control_t *c, const control_params_t *params){
+	c->p = *params;
+	if (c->p.pid_window <= 0){
+		c->p.pid_window = 60;
+	}
+}
+
+/**
+ *  Plain comparison, equal temperatures keep the current state
+ */
+static bool bangbang(control_t *c, double setpoint, double temp){
+	if (setpoint < temp){
+		return false;
+	}
+	if (setpoint > temp){
+		return true;
+	}
+	return c->on;
+}
+
+/**
+ *  Turns on below setpoint - hysteresis, off above setpoint + hysteresis
+ */
+static bool hysteresis(control_t *c, double setpoint, double temp){
+	if (temp < setpoint - c->p.hysteresis){
+		return true;
+	}
+	if (temp > setpoint + c->p.hysteresis){
+		return false;
+	}
+	return c->on;
+}
+
+/**
+ *  PID on the error gives a duty cycle, which is applied by time
+ *  proportioning over pid_window seconds since the relay is on/off only
+ */
+static bool pid(control_t *c, double now, double setpoint, double temp){
+	double error = setpoint - temp;
+	double dt = c->started ? now - c->last_time : 0;
+	double derivative = 0;
+	double out;
+
+	c->integral += error * dt;
+	if (dt > 0){
+		derivative = (error - c->prev_error) / dt;
+	}
+	out = c->p.kp * error + c->p.ki * c->integral + c->p.kd * derivative;
+
+	/* anti windup, don't integrate further into saturation */
+	if ((out > 1 && error > 0) || (out < 0 && error < 0)){
+		c->integral -= error * dt;
+	}
+	if (out > 1){
+		out = 1;
+	}
+	if (out < 0){
+		out = 0;
+	}
+
+	c->duty = out;
+	c->prev_error = error;
+	c->last_time = now;
+
+	/* the on time is latched per window so noise can't chop it up */
+	if (!c->started || now - c->window_start >= c->p.pid_window){
+		c->window_start = now;
+		c->window_on = c->duty * c->p.pid_window;
+	}
+	return now - c->window_start < c->window_on;
+}
+
+/**
+ *  Runs one control decision, returns true if the heater should be on
+ */
+bool control_update(control_t *c, double now, double setpoint, double temp){
+	bool want;
+
+	switch (c->p.type){
+		case CONTROL_HYSTERESIS:
+			want = hysteresis(c, setpoint, temp);
+			break;
+		case CONTROL_PID:
+			want = pid(c, now, setpoint, temp);
+			break;
+		case CONTROL_BANGBANG:
+		default:
+			want = bangbang(c, setpoint, temp);
+			break;
+	}
+
+	if (!c->started){
+		c->started = true;
+		c->on = want;
+		c->changed_at = now;
+		c->cycles += want;
+		return c->on;
+	}
+
+	if (want != c->on){
+		/* respect the minimum on/off times to protect the relay */
+		if (c->on && now - c->changed_at < c->p.min_on){
+			return c->on;
+		}
+		if (!c->on && now - c->changed_at < c->p.min_off){
+			return c->on;
+		}
+		c->on = want;
+		c->changed_at = now;
+		c->cycles += want;
+	}
+	return c->on;
+}
+
+/**
+ *  How far the temperature has to move before the decision can flip,
+ *  0 when it may flip on the next update, which PID always may
+ */
+double control_margin(const control_t *c, double setpoint, double temp){
+	double margin;
+
+	switch (c->p.type){
+		case CONTROL_HYSTERESIS:
+			margin = c->on ? setpoint + c->p.hysteresis - temp : temp - (setpoint - c->p.hysteresis);
+			break;
+		case CONTROL_PID:
+			return 0;
+		case CONTROL_BANGBANG:
+		default:
+			margin = c->on ? setpoint - temp : temp - setpoint;
+			break;
+	}
+	return margin > 0 ? margin : 0;
+}
+
+/**
+ *  Replays a recorded trace through the controller and reports how it behaved
+ *  Trace lines are "seconds,temperature[,setpoint]", the setpoint carries
+ *  over from the previous line when omitted. Anything else is skipped.
+ *  The temperatures are played back whatever the heater does, so only the
+ *  cycles and on time say anything about the controller. How far the
+ *  trace strays from the setpoint is printed apart from them, as a
+ *  property of the recording.
+ */
+int control_replay(const control_params_t *params, FILE *trace, FILE *out){
+	char line[REPLAY_LINE_SIZE];
+	control_t c;
+	double t, temp, set = 0;
+	double first = 0, last = 0, on_time = 0;
+	double overshoot = 0, undershoot = 0;
+	bool have_set = false, on = false;
+	uint64_t ticks = 0;
+	int fields;
+
+	control_init(&c, params);
+	while (fgets(line, sizeof(line), trace) != NULL){
+		fields = sscanf(line, "%lf,%lf,%lf", &t, &temp, &set);
+		if (fields < 2){
+			continue;
+		}
+		if (fields == 3){
+			have_set = true;
+		}
+		if (!have_set){
+			fprintf(out, "trace has no setpoint before t=%.0f\n", t);
+			return CONTROL_ERR;
+		}
+
+		if (ticks == 0){
+			first = t;
+		}
+		else if (on){
+			on_time += t - last;
+		}
+		last = t;
+
+		on = control_update(&c, t, set, temp);
+		ticks++;
+
+		if (temp - set > overshoot){
+			overshoot = temp - set;
+		}
+		if (set - temp > undershoot){
+			undershoot = set - temp;
+		}
+	}
+
+	if (ticks == 0){
+		fprintf(out, "trace is empty\n");
+		return CONTROL_ERR;
+	}
+
+	fprintf(out, "ticks: %llu\n", (unsigned long long) ticks);
+	fprintf(out, "duration: %.0f s\n", last - first);
+	fprintf(out, "controller cycles: %llu\n", (unsigned long long) c.cycles);
+	if (last > first){
+		fprintf(out, "controller cycles per hour: %.2f\n", c.cycles * 3600.0 / (last - first));
+		fprintf(out, "controller heater on: %.1f%%\n", 100.0 * on_time / (last - first));
+	}
+	fprintf(out, "trace max above setpoint: %.2f\n", overshoot);
+	fprintf(out, "trace max below setpoint: %.2f\n", undershoot);
+	return CONTROL_OK;
+}
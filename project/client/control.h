@@ -0,0 +1,61 @@
+/*
+ *  Heater control engine for thermd
+ *
+ *  Decides the heater state from the setpoint and the filtered
+ *  temperature. Time is passed in by the caller (seconds, any epoch),
+ *  which keeps every controller deterministic for replay.
+ */
+
+#ifndef CONTROL_H
+#define CONTROL_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define CONTROL_OK	0
+#define CONTROL_ERR	1
+
+#define CONTROL_BANGBANG	0
+#define CONTROL_HYSTERESIS	1
+#define CONTROL_PID		2
+
+typedef struct {
+	uint8_t type;
+	/* half width of the deadband around the setpoint, in degrees */
+	double hysteresis;
+	/* PID gains, output is a 0..1 duty cycle */
+	double kp;
+	double ki;
+	double kd;
+	/* time proportioning window for the PID duty cycle, seconds */
+	double pid_window;
+	/* relay protection, seconds */
+	double min_on;
+	double min_off;
+}control_params_t;
+
+typedef struct {
+	control_params_t p;
+	bool on;
+	bool started;
+	double changed_at;
+	/* PID state */
+	double integral;
+	double prev_error;
+	double last_time;
+	double window_start;
+	double duty;
+	double window_on;
+	/* number of off to on transitions */
+	uint64_t cycles;
+}control_t;
+
+/* Function prototypes */
+void control_init(control_t *c, const control_params_t *params);
+void control_set_params(control_t *c, const control_params_t *params);
+bool control_update(control_t *c, double now, double setpoint, double temp);
+double control_margin(const control_t *c, double setpoint, double temp);
+int control_replay(const control_params_t *params, FILE *trace, FILE *out);
+
+#endif
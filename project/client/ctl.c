@@ -0,0 +1,533 @@
+/*
+ *  Local control socket for thermd
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include "cJSON.h"
+#include "ctl.h"
+#include "metrics.h"
+
+#define CTL_LINE_SIZE 256
+#define CTL_MAX_EVENTS 32
+
+typedef struct {
+	int fd;
+	/* partial request line */
+	char in[CTL_LINE_SIZE];
+	size_t in_len;
+	/* responses not yet written */
+	char *out;
+	size_t out_len;
+	size_t out_sent;
+	size_t out_size;
+}ctl_client_t;
+
+/**
+ *  Appends len bytes to the client's output
+ */
+static int append_raw(ctl_client_t *c, const char *data, size_t len){
+	size_t size;
+	char *out;
+
+	if (c->out_len + len + 1 > c->out_size){
+		size = c->out_size ? c->out_size : 1024;
+		while (size < c->out_len + len + 1){
+			size *= 2;
+		}
+		out = realloc(c->out, size);
+		if (out == NULL){
+			return CTL_ERR;
+		}
+		c->out = out;
+		c->out_size = size;
+	}
+	memcpy(c->out + c->out_len, data, len);
+	c->out_len += len;
+	return CTL_OK;
+}
+
+/**
+ *  Appends a response line to the client's output
+ */
+static int append(ctl_client_t *c, const char *line){
+	if (append_raw(c, line, strlen(line)) != CTL_OK){
+		return CTL_ERR;
+	}
+	return append_raw(c, "\n", 1);
+}
+
+static int append_json(ctl_client_t *c, cJSON *root){
+	char *line = cJSON_PrintUnformatted(root);
+	int ret = line ? append(c, line) : CTL_ERR;
+	free(line);
+	cJSON_Delete(root);
+	return ret;
+}
+
+static int append_error(ctl_client_t *c, const char *msg){
+	cJSON *root = cJSON_CreateObject();
+	cJSON_AddStringToObject(root, "error", msg);
+	return append_json(c, root);
+}
+
+static int append_ok(ctl_client_t *c){
+	cJSON *root = cJSON_CreateObject();
+	cJSON_AddBoolToObject(root, "ok", 1);
+	return append_json(c, root);
+}
+
+/**
+ *  Takes a consistent copy of the latest tick
+ */
+static const thermd_telemetry_t *snapshot(ctl_t *ctl){
+	thermd_telemetry_read(ctl->snapshot, ctl->copy, ctl->nzones);
+	return ctl->copy;
+}
+
+static int cmd_state(ctl_t *ctl, ctl_client_t *c){
+	const thermd_telemetry_t *snap = snapshot(ctl);
+	const thermd_zone_snapshot_t *z;
+	cJSON *root = cJSON_CreateObject();
+	cJSON *zones = cJSON_CreateArray();
+	cJSON *item;
+	uint32_t i;
+
+	cJSON_AddNumberToObject(root, "timestamp", snap->timestamp);
+	for (i = 0; i < ctl->nzones; i++){
+		z = &snap->zones[i];
+		item = cJSON_CreateObject();
+		cJSON_AddStringToObject(item, "zone", z->name);
+		cJSON_AddBoolToObject(item, "valid", z->valid);
+		cJSON_AddNumberToObject(item, "temp", z->temp);
+		cJSON_AddNumberToObject(item, "setpoint", z->setpoint);
+		cJSON_AddStringToObject(item, "status", z->heater_on ? "ON" : "OFF");
+		cJSON_AddBoolToObject(item, "override", (z->flags & THERMD_ZONE_OVERRIDE) != 0);
+		cJSON_AddNumberToObject(item, "schedule_version", z->schedule_version);
+		cJSON_AddItemToArray(zones, item);
+	}
+	cJSON_AddItemToObject(root, "zones", zones);
+	return append_json(c, root);
+}
+
+static int cmd_stats(ctl_t *ctl, ctl_client_t *c){
+	const thermd_telemetry_t *snap = snapshot(ctl);
+	const thermd_health_t *h = &snap->health;
+	cJSON *root = cJSON_CreateObject();
+	cJSON *zones = cJSON_CreateArray();
+	cJSON *item;
+	uint32_t i;
+
+	cJSON_AddNumberToObject(root, "ticks", h->ticks);
+	cJSON_AddNumberToObject(root, "overruns", h->overruns);
+	cJSON_AddNumberToObject(root, "jitter_max_ms", h->jitter_max_ms);
+	cJSON_AddNumberToObject(root, "polls", h->polls);
+	cJSON_AddNumberToObject(root, "poll_failures", h->poll_failures);
+	cJSON_AddNumberToObject(root, "posts", h->posts);
+	cJSON_AddNumberToObject(root, "post_failures", h->post_failures);
+	cJSON_AddNumberToObject(root, "ctl_clients", ctl->clients);
+	cJSON_AddNumberToObject(root, "ctl_requests", ctl->requests);
+	cJSON_AddNumberToObject(root, "ctl_errors", ctl->errors);
+	for (i = 0; i < ctl->nzones; i++){
+		item = cJSON_CreateObject();
+		cJSON_AddStringToObject(item, "zone", snap->zones[i].name);
+		cJSON_AddNumberToObject(item, "sensor_samples", snap->zones[i].sensor_samples);
+		cJSON_AddNumberToObject(item, "sensor_errors", snap->zones[i].sensor_errors);
+		cJSON_AddNumberToObject(item, "heater_cycles", snap->zones[i].heater_cycles);
+		cJSON_AddItemToArray(zones, item);
+	}
+	cJSON_AddItemToObject(root, "zones", zones);
+	return append_json(c, root);
+}
+
+/**
+ *  The Prometheus text dump, the one reply that isn't a JSON line,
+ *  ends with a "# EOF" line
+ */
+static int cmd_metrics(ctl_t *ctl, ctl_client_t *c){
+	char *text = NULL;
+	size_t len = 0;
+	FILE *fp = open_memstream(&text, &len);
+	int ret;
+
+	if (fp == NULL){
+		return append_error(c, "out of memory");
+	}
+	metrics_write(fp);
+	fprintf(fp, "# EOF\n");
+	fclose(fp);
+	ret = append_raw(c, text, len);
+	free(text);
+	return ret;
+}
+
+/**
+ *  Hands a command to the control loop, fails if the loop is behind
+ */
+static bool enqueue(ctl_t *ctl, const ctl_command_t *cmd){
+	uint64_t one = 1;
+	bool ok = false;
+	pthread_mutex_lock(&ctl->lock);
+	if (ctl->count < CTL_QUEUE_SIZE){
+		ctl->queue[(ctl->head + ctl->count) % CTL_QUEUE_SIZE] = *cmd;
+		ctl->count++;
+		ok = true;
+	}
+	pthread_mutex_unlock(&ctl->lock);
+	if (ok && ctl->wake_fd >= 0 && write(ctl->wake_fd, &one, sizeof(one)) < 0){
+		/* the loop still finds it on its next tick */
+	}
+	return ok;
+}
+
+static bool known_zone(ctl_t *ctl, const char *name){
+	uint32_t i;
+	for (i = 0; i < ctl->nzones; i++){
+		if (!strcmp(ctl->snapshot->zones[i].name, name)){
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ *  override [zone] <temp>|off [seconds]
+ */
+static int cmd_override(ctl_t *ctl, ctl_client_t *c, char *args){
+	ctl_command_t cmd;
+	char *tok[3];
+	char *save = NULL;
+	char *end;
+	int n = 0, i = 0;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.type = CTL_OVERRIDE;
+	while (n < 3 && (tok[n] = strtok_r(n ? NULL : args, " \t", &save)) != NULL){
+		n++;
+	}
+	if (n == 0){
+		return append_error(c, "usage: override [zone] <temp>|off [seconds]");
+	}
+
+	/* a leading word that isn't a temperature names the zone */
+	strtod(tok[0], &end);
+	if (strcmp(tok[0], "off") && *end != '\0'){
+		if (!known_zone(ctl, tok[0])){
+			return append_error(c, "unknown zone");
+		}
+		strncpy(cmd.zone, tok[0], THERMD_ZONE_NAME_SIZE - 1);
+		i++;
+	}
+	if (i >= n){
+		return append_error(c, "missing setpoint");
+	}
+
+	if (!strcmp(tok[i], "off")){
+		cmd.clear = true;
+	}
+	else{
+		cmd.temp = strtod(tok[i], &end);
+		if (*end != '\0'){
+			return append_error(c, "bad setpoint");
+		}
+		if (i + 1 < n){
+			cmd.duration = strtod(tok[i + 1], &end);
+			if (*end != '\0' || cmd.duration < 0){
+				return append_error(c, "bad duration");
+			}
+		}
+	}
+
+	if (!enqueue(ctl, &cmd)){
+		return append_error(c, "busy");
+	}
+	return append_ok(c);
+}
+
+static int cmd_simple(ctl_t *ctl, ctl_client_t *c, uint8_t type){
+	ctl_command_t cmd;
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.type = type;
+	if (!enqueue(ctl, &cmd)){
+		return append_error(c, "busy");
+	}
+	return append_ok(c);
+}
+
+/**
+ *  Runs one request line
+ */
+static int handle_line(ctl_t *ctl, ctl_client_t *c, char *line){
+	char *args;
+
+	line[strcspn(line, "\r")] = '\0';
+	args = line + strcspn(line, " \t");
+	if (*args != '\0'){
+		*args++ = '\0';
+	}
+	if (*line == '\0'){
+		return CTL_OK;
+	}
+	ctl->requests++;
+
+	if (!strcmp(line, "state")){
+		return cmd_state(ctl, c);
+	}
+	if (!strcmp(line, "stats")){
+		return cmd_stats(ctl, c);
+	}
+	if (!strcmp(line, "metrics")){
+		return cmd_metrics(ctl, c);
+	}
+	if (!strcmp(line, "override")){
+		return cmd_override(ctl, c, args);
+	}
+	if (!strcmp(line, "reload")){
+		return cmd_simple(ctl, c, CTL_RELOAD);
+	}
+	if (!strcmp(line, "flush")){
+		return cmd_simple(ctl, c, CTL_FLUSH);
+	}
+	ctl->errors++;
+	return append_error(c, "unknown command");
+}
+
+static void close_client(ctl_t *ctl, ctl_client_t *c){
+	epoll_ctl(ctl->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	free(c->out);
+	free(c);
+	ctl->clients--;
+}
+
+/**
+ *  Writes as much pending output as the socket takes, waiting for
+ *  EPOLLOUT instead of more requests while anything is left
+ */
+static int flush_client(ctl_t *ctl, ctl_client_t *c){
+	struct epoll_event ev;
+	ssize_t n;
+
+	while (c->out_sent < c->out_len){
+		n = send(c->fd, c->out + c->out_sent, c->out_len - c->out_sent, MSG_NOSIGNAL);
+		if (n < 0){
+			if (errno == EINTR){
+				continue;
+			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK){
+				return CTL_ERR;
+			}
+			break;
+		}
+		c->out_sent += n;
+	}
+
+	ev.data.ptr = c;
+	if (c->out_sent < c->out_len){
+		ev.events = EPOLLOUT;
+	}
+	else{
+		c->out_len = c->out_sent = 0;
+		ev.events = EPOLLIN;
+	}
+	epoll_ctl(ctl->epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+	return CTL_OK;
+}
+
+/**
+ *  Reads what's available and answers every complete line
+ */
+static int read_client(ctl_t *ctl, ctl_client_t *c){
+	char *nl;
+	size_t used;
+	ssize_t n;
+
+	while (1){
+		n = recv(c->fd, c->in + c->in_len, sizeof(c->in) - 1 - c->in_len, 0);
+		if (n == 0){
+			return CTL_ERR;
+		}
+		if (n < 0){
+			if (errno == EINTR){
+				continue;
+			}
+			return errno == EAGAIN || errno == EWOULDBLOCK ? CTL_OK : CTL_ERR;
+		}
+		c->in_len += n;
+		c->in[c->in_len] = '\0';
+
+		while ((nl = strchr(c->in, '\n')) != NULL){
+			*nl = '\0';
+			if (handle_line(ctl, c, c->in) != CTL_OK){
+				return CTL_ERR;
+			}
+			used = nl + 1 - c->in;
+			memmove(c->in, nl + 1, c->in_len - used + 1);
+			c->in_len -= used;
+		}
+		if (c->in_len == sizeof(c->in) - 1){
+			/* no line this long is valid */
+			ctl->errors++;
+			append_error(c, "line too long");
+			return CTL_ERR;
+		}
+	}
+}
+
+static void accept_clients(ctl_t *ctl){
+	struct epoll_event ev;
+	ctl_client_t *c;
+	int fd;
+
+	while ((fd = accept4(ctl->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0){
+		if (ctl->clients >= CTL_MAX_CLIENTS || (c = calloc(1, sizeof(*c))) == NULL){
+			close(fd);
+			ctl->errors++;
+			continue;
+		}
+		c->fd = fd;
+		ev.events = EPOLLIN;
+		ev.data.ptr = c;
+		if (epoll_ctl(ctl->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0){
+			close(fd);
+			free(c);
+			continue;
+		}
+		ctl->clients++;
+		ctl->connections++;
+	}
+}
+
+static void *ctl_thread(void *arg){
+	ctl_t *ctl = arg;
+	struct epoll_event events[CTL_MAX_EVENTS];
+	ctl_client_t *c;
+	int n, i;
+
+	while (1){
+		n = epoll_wait(ctl->epoll_fd, events, CTL_MAX_EVENTS, -1);
+		for (i = 0; i < n; i++){
+			if (events[i].data.ptr == NULL){
+				accept_clients(ctl);
+				continue;
+			}
+			c = events[i].data.ptr;
+			if (events[i].events & (EPOLLERR | EPOLLHUP) && !(events[i].events & EPOLLIN)){
+				close_client(ctl, c);
+				continue;
+			}
+			if (events[i].events & EPOLLIN && read_client(ctl, c) != CTL_OK){
+				/* send what was answered before the hang up */
+				flush_client(ctl, c);
+				close_client(ctl, c);
+				continue;
+			}
+			if (flush_client(ctl, c) != CTL_OK){
+				close_client(ctl, c);
+			}
+		}
+	}
+	return NULL;
+}
+
+/**
+ *  Binds the socket at path, replacing a stale one, and starts serving
+ *  it from a new thread, snapshot must stay mapped for the life of thermd
+ */
+int ctl_start(ctl_t *ctl, const char *path, const thermd_telemetry_t *snapshot, int wake_fd){
+	struct sockaddr_un addr;
+	struct epoll_event ev;
+	mode_t mask;
+	int bound;
+
+	memset(ctl, 0, sizeof(*ctl));
+	strncpy(ctl->path, path, CTL_PATH_SIZE - 1);
+	ctl->snapshot = snapshot;
+	ctl->wake_fd = wake_fd;
+	ctl->nzones = snapshot->nzones;
+	ctl->copy = malloc(THERMD_TELEMETRY_SIZE(ctl->nzones));
+	if (ctl->copy == NULL){
+		return CTL_ERR;
+	}
+	pthread_mutex_init(&ctl->lock, NULL);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, ctl->path, sizeof(addr.sun_path) - 1);
+	unlink(ctl->path);
+
+	ctl->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (ctl->listen_fd < 0){
+		syslog(LOG_ERR, "Couldn't listen on %s: %s\n", ctl->path, strerror(errno));
+		return CTL_ERR;
+	}
+	/* owner and group only, anyone in the group can override the setpoint.
+	 * The daemon's umask leaves it world writable, so the socket is made
+	 * 0660 by bind() itself rather than chmod()ed after others could connect */
+	mask = umask(S_IXUSR | S_IXGRP | S_IRWXO);
+	bound = bind(ctl->listen_fd, (struct sockaddr *) &addr, sizeof(addr));
+	umask(mask);
+	if (bound < 0 || listen(ctl->listen_fd, SOMAXCONN) < 0){
+		syslog(LOG_ERR, "Couldn't listen on %s: %s\n", ctl->path, strerror(errno));
+		close(ctl->listen_fd);
+		return CTL_ERR;
+	}
+	if (chmod(ctl->path, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP) < 0){
+		syslog(LOG_ERR, "Couldn't set permissions on %s: %s\n", ctl->path, strerror(errno));
+		close(ctl->listen_fd);
+		unlink(ctl->path);
+		return CTL_ERR;
+	}
+
+	ctl->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (ctl->epoll_fd < 0){
+		return CTL_ERR;
+	}
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(ctl->epoll_fd, EPOLL_CTL_ADD, ctl->listen_fd, &ev) < 0){
+		return CTL_ERR;
+	}
+
+	if (pthread_create(&ctl->thread, NULL, ctl_thread, ctl) != 0){
+		syslog(LOG_ERR, "Couldn't start control socket thread\n");
+		return CTL_ERR;
+	}
+	pthread_detach(ctl->thread);
+	return CTL_OK;
+}
+
+/**
+ *  Takes the next queued command, never waits on the socket thread,
+ *  returns false when there's nothing to do
+ */
+bool ctl_next(ctl_t *ctl, ctl_command_t *cmd){
+	bool found = false;
+
+	/* not started, or nothing queued */
+	if (ctl->copy == NULL || __atomic_load_n(&ctl->count, __ATOMIC_RELAXED) == 0){
+		return false;
+	}
+	if (pthread_mutex_trylock(&ctl->lock) != 0){
+		/* the socket thread is queueing, catch it next tick */
+		return false;
+	}
+	if (ctl->count > 0){
+		*cmd = ctl->queue[ctl->head];
+		ctl->head = (ctl->head + 1) % CTL_QUEUE_SIZE;
+		ctl->count--;
+		found = true;
+	}
+	pthread_mutex_unlock(&ctl->lock);
+	return found;
+}
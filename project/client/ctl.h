@@ -0,0 +1,76 @@
+/*
+ *  Local control socket for thermd
+ *
+ *  A Unix domain stream socket served by its own epoll thread. Clients
+ *  send one command per line and get one line of JSON back:
+ *  state                         every zone's latest reading
+ *  stats                         loop, server and socket counters
+ *  metrics                       stage latencies in Prometheus text
+ *  override [zone] <temp> [secs] hold a setpoint, for secs if given
+ *  override [zone] off           back to the schedule
+ *  reload                        re-read the config file
+ *  flush                         post telemetry now
+ *
+ *  Queries are answered from the telemetry snapshot (see telemetry.h)
+ *  and commands are queued for the control loop, which picks them up
+ *  with ctl_next() without ever blocking on the socket thread.
+ */
+
+#ifndef CTL_H
+#define CTL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "thermd_shm.h"
+
+#define CTL_OK	0
+#define CTL_ERR	1
+
+#define CTL_OVERRIDE	0
+#define CTL_RELOAD	1
+#define CTL_FLUSH	2
+
+#define CTL_PATH_SIZE 108
+#define CTL_MAX_CLIENTS 256
+#define CTL_QUEUE_SIZE 16
+
+typedef struct {
+	uint8_t type;
+	/* override target, empty for every zone */
+	char zone[THERMD_ZONE_NAME_SIZE];
+	/* override setpoint, cleared when clear is set */
+	bool clear;
+	double temp;
+	/* seconds, 0 holds until cleared */
+	double duration;
+}ctl_command_t;
+
+typedef struct {
+	char path[CTL_PATH_SIZE];
+	int listen_fd;
+	int epoll_fd;
+	pthread_t thread;
+	/* published by the control loop every tick */
+	const thermd_telemetry_t *snapshot;
+	thermd_telemetry_t *copy;
+	/* written after queueing a command so a sleeping loop wakes, -1 for none */
+	int wake_fd;
+	uint32_t nzones;
+	/* commands waiting for the control loop */
+	pthread_mutex_t lock;
+	ctl_command_t queue[CTL_QUEUE_SIZE];
+	uint32_t head;
+	uint32_t count;
+	/* stats */
+	uint32_t clients;
+	uint64_t connections;
+	uint64_t requests;
+	uint64_t errors;
+}ctl_t;
+
+/* Function prototypes */
+int ctl_start(ctl_t *ctl, const char *path, const thermd_telemetry_t *snapshot, int wake_fd);
+bool ctl_next(ctl_t *ctl, ctl_command_t *cmd);
+
+#endif
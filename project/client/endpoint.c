@@ -0,0 +1,142 @@
+/*
+ *  Server endpoint pool for thermd
+ */
+
+#include <string.h>
+#include <float.h>
+#include "endpoint.h"
+
+/* weight of the newest sample in the rtt and health averages */
+#define ENDPOINT_ALPHA 0.3
+/* health never weighs a score by more than 1 / this */
+#define ENDPOINT_MIN_HEALTH 0.05
+/* backoff after consecutive failures, doubling from min up to max seconds */
+#define ENDPOINT_BACKOFF_MIN 1.0
+#define ENDPOINT_BACKOFF_MAX 60.0
+/* an endpoint idle this long is measured again with one request, one
+ * that keeps failing those probes waits twice as long each time up to max */
+#define ENDPOINT_PROBE_SECS 60.0
+#define ENDPOINT_PROBE_MAX 3600.0
+
+/**
+ *  Fills the pool from "host:port,https://other,..." in order of
+ *  preference, fails on an empty list, too many entries or a long url
+ */
+int endpoint_pool_init(endpoint_pool_t *pool, const char *spec){
+	const char *p = spec;
+	const char *end;
+	size_t len;
+
+	memset(pool, 0, sizeof(*pool));
+	while (*p != '\0'){
+		while (*p == ' ' || *p == ','){
+			p++;
+		}
+		if (*p == '\0'){
+			break;
+		}
+		end = p;
+		while (*end != '\0' && *end != ',' && *end != ' '){
+			end++;
+		}
+		len = end - p;
+		if (pool->count == ENDPOINT_MAX || len >= ENDPOINT_URL_SIZE){
+			return ENDPOINT_ERR;
+		}
+		memcpy(pool->list[pool->count].url, p, len);
+		pool->list[pool->count].health = 1;
+		pool->count++;
+		p = end;
+	}
+	return pool->count > 0 ? ENDPOINT_OK : ENDPOINT_ERR;
+}
+
+/**
+ *  How long e can sit idle before it is probed. A dead server costs up
+ *  to connect_timeout of the tick for every probe, so each failure in a
+ *  row doubles the wait.
+ */
+static double probe_after(const endpoint_t *e){
+	double wait = ENDPOINT_PROBE_SECS;
+	uint32_t n;
+
+	for (n = 0; n < e->failures && wait < ENDPOINT_PROBE_MAX; n++){
+		wait *= 2;
+	}
+	return wait > ENDPOINT_PROBE_MAX ? ENDPOINT_PROBE_MAX : wait;
+}
+
+/**
+ *  Lower is better, unmeasured and stale endpoints score 0 so they get
+ *  tried, ties go to the one listed first
+ */
+static double score(const endpoint_t *e, double now){
+	double health = e->health < ENDPOINT_MIN_HEALTH ? ENDPOINT_MIN_HEALTH : e->health;
+
+	if ((e->rtt == 0 && e->failures == 0) || now - e->last_used > probe_after(e)){
+		return 0;
+	}
+	/* failing and never answered, anything that has goes first */
+	if (e->rtt == 0){
+		return DBL_MAX;
+	}
+	return e->rtt / health;
+}
+
+/**
+ *  Picks the endpoint for the next request, skipping the ones whose bit
+ *  is set in tried. Endpoints in backoff are only used when every other
+ *  one was tried, the one coming out of backoff soonest first.
+ *  Returns -1 when nothing is left to try.
+ */
+int endpoint_pick(const endpoint_pool_t *pool, double now, uint32_t tried){
+	const endpoint_t *e;
+	int best = -1, down = -1;
+	double best_score = 0, s;
+	uint32_t i;
+
+	for (i = 0; i < pool->count; i++){
+		if (tried & (1u << i)){
+			continue;
+		}
+		e = &pool->list[i];
+		if (e->down_until > now){
+			if (down < 0 || e->down_until < pool->list[down].down_until){
+				down = i;
+			}
+			continue;
+		}
+		s = score(e, now);
+		if (best < 0 || s < best_score){
+			best = i;
+			best_score = s;
+		}
+	}
+	return best >= 0 ? best : down;
+}
+
+/**
+ *  Folds the outcome of a request into the endpoint's averages, rtt in seconds
+ */
+void endpoint_report(endpoint_pool_t *pool, int i, bool ok, double rtt, double now){
+	endpoint_t *e = &pool->list[i];
+	double backoff = ENDPOINT_BACKOFF_MIN;
+	uint32_t n;
+
+	e->requests++;
+	e->last_used = now;
+	if (ok){
+		e->rtt = e->rtt == 0 ? rtt : e->rtt + ENDPOINT_ALPHA * (rtt - e->rtt);
+		e->health += ENDPOINT_ALPHA * (1 - e->health);
+		e->failures = 0;
+		e->down_until = 0;
+		return;
+	}
+	e->errors++;
+	e->health -= ENDPOINT_ALPHA * e->health;
+	e->failures++;
+	for (n = 1; n < e->failures && backoff < ENDPOINT_BACKOFF_MAX; n++){
+		backoff *= 2;
+	}
+	e->down_until = now + (backoff > ENDPOINT_BACKOFF_MAX ? ENDPOINT_BACKOFF_MAX : backoff);
+}
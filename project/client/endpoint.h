@@ -0,0 +1,49 @@
+/*
+ *  Server endpoint pool for thermd
+ *
+ *  endpoint= takes a comma separated list of servers. Each request goes
+ *  to the one with the lowest round trip time EWMA weighted by its
+ *  success rate EWMA, a failing one is skipped with exponential backoff
+ *  and the caller moves on to the next best within the same tick. An
+ *  endpoint that hasn't been used for a while gets one request to
+ *  re-measure it, so a recovered primary wins its traffic back.
+ */
+
+#ifndef ENDPOINT_H
+#define ENDPOINT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define ENDPOINT_OK	0
+#define ENDPOINT_ERR	1
+
+#define ENDPOINT_MAX 8
+#define ENDPOINT_URL_SIZE 100
+
+typedef struct {
+	char url[ENDPOINT_URL_SIZE];
+	/* EWMA seconds, 0 until measured */
+	double rtt;
+	/* EWMA of answered requests, 1 answers everything */
+	double health;
+	/* failures in a row, and skipped until down_until after them */
+	uint32_t failures;
+	double down_until;
+	/* seconds on CLOCK_MONOTONIC */
+	double last_used;
+	uint64_t requests;
+	uint64_t errors;
+}endpoint_t;
+
+typedef struct {
+	endpoint_t list[ENDPOINT_MAX];
+	uint32_t count;
+}endpoint_pool_t;
+
+/* Function prototypes */
+int endpoint_pool_init(endpoint_pool_t *pool, const char *spec);
+int endpoint_pick(const endpoint_pool_t *pool, double now, uint32_t tried);
+void endpoint_report(endpoint_pool_t *pool, int i, bool ok, double rtt, double now);
+
+#endif
@@ -0,0 +1,110 @@
+/*
+ *  Sample filtering for thermd
+ */
+
+#include <string.h>
+#include "filter.h"
+
+/**
+ *  Sets up a filter, window is clamped to FILTER_MAX_WINDOW
+ *  alpha is only used by the EMA filter, 0 < alpha <= 1
+ */
+void filter_init(filter_t *f, uint8_t type, uint32_t window, double alpha){
+	memset(f, 0, sizeof(*f));
+	f->type = type;
+	if (window == 0){
+		window = 1;
+	}
+	if (window > FILTER_MAX_WINDOW){
+		window = FILTER_MAX_WINDOW;
+	}
+	f->window = window;
+	if (alpha <= 0 || alpha > 1){
+		alpha = 2.0 / (window + 1);
+	}
+	f->alpha = alpha;
+}
+
+static void recompute_sum(filter_t *f){
+	uint32_t i;
+	f->sum = 0;
+	for (i = 0; i < f->count; i++){
+		f->sum += f->samples[i];
+	}
+}
+
+/**
+ *  Adds a sample to the ring buffer and updates the running state
+ */
+void filter_push(filter_t *f, double sample){
+	if (f->count == f->window){
+		/* buffer full, the oldest sample drops out of the sum */
+		f->sum -= f->samples[f->head];
+	}
+	else{
+		f->count++;
+	}
+	f->samples[f->head] = sample;
+	f->sum += sample;
+	f->head = (f->head + 1) % f->window;
+	if (f->head == 0){
+		/* re-sum once per lap so rounding error can't build up */
+		recompute_sum(f);
+	}
+
+	if (f->count == 1){
+		f->ema = sample;
+	}
+	else{
+		f->ema += f->alpha * (sample - f->ema);
+	}
+}
+
+/**
+ *  Median of the window, insertion sort on a copy is fine for a
+ *  window of at most FILTER_MAX_WINDOW taken once per control tick
+ */
+static double median(const filter_t *f){
+	double sorted[FILTER_MAX_WINDOW];
+	double tmp;
+	int32_t i, j;
+
+	for (i = 0; i < (int32_t) f->count; i++){
+		tmp = f->samples[i];
+		for (j = i - 1; j >= 0 && sorted[j] > tmp; j--){
+			sorted[j + 1] = sorted[j];
+		}
+		sorted[j + 1] = tmp;
+	}
+	if (f->count % 2){
+		return sorted[f->count / 2];
+	}
+	return (sorted[f->count / 2 - 1] + sorted[f->count / 2]) / 2.0;
+}
+
+/**
+ *  Gets the current filtered value, FILTER_EMPTY until the first sample
+ */
+int filter_value(const filter_t *f, double *value){
+	if (f->count == 0){
+		return FILTER_EMPTY;
+	}
+
+	switch (f->type){
+		case FILTER_MEAN:
+			*value = f->sum / f->count;
+			break;
+		case FILTER_MEDIAN:
+			*value = median(f);
+			break;
+		case FILTER_EMA:
+			*value = f->ema;
+			break;
+		case FILTER_NONE:
+		default:
+			/* latest sample */
+			*value = f->samples[(f->head + f->window - 1) % f->window];
+			break;
+	}
+	return FILTER_OK;
+}
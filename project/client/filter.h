@@ -0,0 +1,43 @@
+/*
+ *  Sample filtering for thermd
+ *
+ *  Samples are pushed into a fixed ring buffer at the acquisition rate,
+ *  the control loop then takes one filtered (decimated) value per tick.
+ */
+
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define FILTER_OK	0
+#define FILTER_EMPTY	1
+
+#define FILTER_NONE	0
+#define FILTER_MEAN	1
+#define FILTER_MEDIAN	2
+#define FILTER_EMA	3
+
+#define FILTER_MAX_WINDOW 128
+
+typedef struct {
+	uint8_t type;
+	/* ring buffer of the last window samples */
+	double samples[FILTER_MAX_WINDOW];
+	uint32_t window;
+	uint32_t head;
+	uint32_t count;
+	/* running sum so the mean is O(1) */
+	double sum;
+	/* exponential moving average state */
+	double alpha;
+	double ema;
+}filter_t;
+
+/* Function prototypes */
+void filter_init(filter_t *f, uint8_t type, uint32_t window, double alpha);
+void filter_push(filter_t *f, double sample);
+int filter_value(const filter_t *f, double *value);
+
+#endif
@@ -0,0 +1,568 @@
+/*
+ *  Gateway mode for thermd
+ *
+ *  One reactor thread owns the timer wheel and the curl multi handle.
+ *  A device tick is: wheel expiry -> GET schedule -> worker (parse,
+ *  compile, simulate, control, build report) -> POST report -> reschedule.
+ *  Request slots (an easy handle plus buffers) are pooled, so memory
+ *  in flight is bounded by the concurrency and not the device count.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include "gateway.h"
+#include "net.h"
+
+#ifdef THERMD_NO_CURL
+
+/**
+ *  Gateway mode runs on a curl multi handle, which the tiny build doesn't have
+ */
+int gateway_run(const gateway_params_t *params, FILE *out){
+	fprintf(out, "gateway mode needs the curl build\n");
+	return GATEWAY_ERR;
+}
+
+void gateway_stop(void){
+}
+
+#else
+
+#include <curl/curl.h>
+
+/* Timer wheel with 1ms slots, longer timeouts just stay in their slot for extra laps */
+#define WHEEL_SLOTS 4096
+
+/* Tick latency histogram, 1ms buckets, the last bucket catches everything slower */
+#define HIST_BUCKETS 10001
+
+#define GATEWAY_MAX_SETPOINTS 256
+#define GATEWAY_BODY_SIZE 128
+#define GATEWAY_REPORT_MS 5000
+
+/* Simulated room, first order heat loss to ambient plus a constant heater gain */
+#define SIM_AMBIENT 50.0
+#define SIM_LOSS 0.0005
+#define SIM_HEAT 0.02
+
+#define STAGE_GET 0
+#define STAGE_POST 1
+
+typedef struct device {
+	uint32_t id;
+	/* when the current tick was due, ms since start */
+	uint64_t deadline;
+	struct device *next;
+	control_t control;
+	schedule_t schedule;
+	double temp;
+	double last_sim;
+}device_t;
+
+typedef struct slot {
+	CURL *easy;
+	net_buffer_t response;
+	char body[GATEWAY_BODY_SIZE];
+	device_t *dev;
+	uint8_t stage;
+	bool failed;
+	struct slot *next;
+}slot_t;
+
+/* A FIFO of slots handed between the reactor and the workers */
+typedef struct {
+	slot_t *head;
+	slot_t *tail;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+}slot_queue_t;
+
+typedef struct {
+	const gateway_params_t *p;
+	uint64_t start_ns;
+	CURLM *multi;
+	device_t *devices;
+	slot_t *slots;
+	slot_t *free_slots;
+	/* timer wheel */
+	device_t *wheel[WHEEL_SLOTS];
+	uint64_t wheel_now;
+	/* devices due but waiting for a free slot */
+	device_t *ready_head;
+	device_t *ready_tail;
+	/* reactor -> workers and back */
+	slot_queue_t work;
+	slot_queue_t done;
+	int wake_pipe[2];
+	pthread_t *workers;
+	/* stats, reactor only */
+	uint64_t ticks;
+	uint64_t failures;
+	uint64_t overruns;
+	uint64_t requests;
+	uint32_t hist[HIST_BUCKETS];
+}gateway_t;
+
+static volatile sig_atomic_t stopping;
+
+static uint64_t monotonic_ns(void){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static uint64_t now_ms(gateway_t *g){
+	return (monotonic_ns() - g->start_ns) / 1000000ULL;
+}
+
+/**
+ *  Stops a running gateway, safe to call from a signal handler
+ */
+void gateway_stop(void){
+	stopping = 1;
+}
+
+static void queue_init(slot_queue_t *q){
+	q->head = q->tail = NULL;
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->cond, NULL);
+}
+
+static void queue_push(slot_queue_t *q, slot_t *slot){
+	pthread_mutex_lock(&q->lock);
+	slot->next = NULL;
+	if (q->tail != NULL){
+		q->tail->next = slot;
+	}
+	else{
+		q->head = slot;
+	}
+	q->tail = slot;
+	pthread_cond_signal(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+}
+
+/**
+ *  Takes the whole queue at once, so the lock is held once per batch
+ */
+static slot_t *queue_take_all(slot_queue_t *q){
+	slot_t *head;
+	pthread_mutex_lock(&q->lock);
+	head = q->head;
+	q->head = q->tail = NULL;
+	pthread_mutex_unlock(&q->lock);
+	return head;
+}
+
+/**
+ *  Puts a device on the wheel at its deadline, or straight on the ready
+ *  list if the wheel has already gone past it
+ */
+static void wheel_add(gateway_t *g, device_t *dev){
+	uint32_t idx;
+
+	dev->next = NULL;
+	if (dev->deadline <= g->wheel_now){
+		if (g->ready_tail != NULL){
+			g->ready_tail->next = dev;
+		}
+		else{
+			g->ready_head = dev;
+		}
+		g->ready_tail = dev;
+		return;
+	}
+	idx = dev->deadline % WHEEL_SLOTS;
+	dev->next = g->wheel[idx];
+	g->wheel[idx] = dev;
+}
+
+/**
+ *  Moves every device due by now onto the ready list
+ *  A slot can hold devices due on later laps, those stay put
+ */
+static void wheel_advance(gateway_t *g, uint64_t now){
+	device_t **link;
+	device_t *dev;
+	uint32_t steps = 0;
+
+	while (g->wheel_now < now && steps <= WHEEL_SLOTS){
+		g->wheel_now++;
+		steps++;
+		link = &g->wheel[g->wheel_now % WHEEL_SLOTS];
+		while (*link != NULL){
+			dev = *link;
+			if (dev->deadline <= now){
+				*link = dev->next;
+				dev->next = NULL;
+				if (g->ready_tail != NULL){
+					g->ready_tail->next = dev;
+				}
+				else{
+					g->ready_head = dev;
+				}
+				g->ready_tail = dev;
+			}
+			else{
+				link = &dev->next;
+			}
+		}
+	}
+	/* a full lap has seen every slot, skip the rest of the gap */
+	g->wheel_now = now;
+}
+
+static size_t gateway_write(void *ptr, size_t size, size_t nmemb, void *userdata){
+	net_buffer_t *buf = userdata;
+	size_t n = size * nmemb;
+	size_t want;
+	char *data;
+
+	if (buf->len + n + 1 > buf->size){
+		want = buf->size ? buf->size * 2 : 1024;
+		while (want < buf->len + n + 1){
+			want *= 2;
+		}
+		data = realloc(buf->data, want);
+		if (data == NULL){
+			return 0;
+		}
+		buf->data = data;
+		buf->size = want;
+	}
+	memcpy(buf->data + buf->len, ptr, n);
+	buf->len += n;
+	buf->data[buf->len] = '\0';
+	return n;
+}
+
+static void start_request(gateway_t *g, slot_t *slot, uint8_t stage){
+	CURL *easy = slot->easy;
+
+	curl_easy_reset(easy);
+	curl_easy_setopt(easy, CURLOPT_URL, g->p->url);
+	curl_easy_setopt(easy, CURLOPT_NOSIGNAL, 1L);
+	curl_easy_setopt(easy, CURLOPT_PRIVATE, slot);
+	curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, gateway_write);
+	curl_easy_setopt(easy, CURLOPT_WRITEDATA, &slot->response);
+	/* a request may not take longer than a few periods */
+	curl_easy_setopt(easy, CURLOPT_TIMEOUT_MS, (long) g->p->period_ms * 5);
+	if (stage == STAGE_POST){
+		curl_easy_setopt(easy, CURLOPT_POSTFIELDS, slot->body);
+	}
+	slot->stage = stage;
+	slot->response.len = 0;
+	curl_multi_add_handle(g->multi, easy);
+	g->requests++;
+}
+
+/**
+ *  Ends a device's tick, records its latency and schedules the next one
+ */
+static void finish_tick(gateway_t *g, slot_t *slot, bool ok){
+	device_t *dev = slot->dev;
+	uint64_t now = now_ms(g);
+	uint64_t latency = now - dev->deadline;
+
+	g->ticks++;
+	if (!ok){
+		g->failures++;
+	}
+	g->hist[latency < HIST_BUCKETS ? latency : HIST_BUCKETS - 1]++;
+
+	dev->deadline += g->p->period_ms;
+	if (dev->deadline <= now){
+		/* missed the next deadline, start again from now rather than bursting */
+		g->overruns++;
+		dev->deadline = now + 1;
+	}
+	wheel_add(g, dev);
+
+	slot->dev = NULL;
+	slot->next = g->free_slots;
+	g->free_slots = slot;
+}
+
+/**
+ *  The CPU part of a tick, runs on a worker
+ *  Every device simulates its own room between ticks
+ */
+static void process_device(gateway_t *g, slot_t *slot, setpoint_t *points, tz_t *tz){
+	device_t *dev = slot->dev;
+	double now = dev->deadline / 1000.0;
+	double dt = now - dev->last_sim;
+	double setpoint;
+	uint32_t secs;
+	uint16_t count;
+	uint8_t wday;
+	bool on;
+
+	count = slot->response.len ? g->p->parse(slot->response.data, points) : 0;
+	if (count > 0){
+		schedule_compile(&dev->schedule, points, count);
+	}
+
+	tz_local(tz, time(NULL), &wday, &secs);
+	setpoint = schedule_lookup(&dev->schedule, wday, secs);
+
+	dev->temp += dt * ((dev->control.on ? SIM_HEAT : 0) - SIM_LOSS * (dev->temp - SIM_AMBIENT));
+	dev->last_sim = now;
+
+	on = control_update(&dev->control, now, setpoint, dev->temp);
+	snprintf(slot->body, GATEWAY_BODY_SIZE,
+		"{\"device\":%u,\"current_temp\":\"%0.2lf\",\"status\":\"%s\"}",
+		dev->id, dev->temp, on ? "ON" : "OFF");
+}
+
+static void *worker_thread(void *arg){
+	gateway_t *g = arg;
+	setpoint_t *points = malloc(GATEWAY_MAX_SETPOINTS * sizeof(setpoint_t));
+	/* tz_local updates its cache, so each worker keeps its own copy */
+	tz_t tz = g->p->tz;
+	slot_t *slot;
+	char wake = 1;
+
+	if (points == NULL){
+		return NULL;
+	}
+	while (1){
+		pthread_mutex_lock(&g->work.lock);
+		while (g->work.head == NULL && !stopping){
+			pthread_cond_wait(&g->work.cond, &g->work.lock);
+		}
+		if (g->work.head == NULL){
+			pthread_mutex_unlock(&g->work.lock);
+			break;
+		}
+		slot = g->work.head;
+		g->work.head = slot->next;
+		if (g->work.head == NULL){
+			g->work.tail = NULL;
+		}
+		pthread_mutex_unlock(&g->work.lock);
+
+		process_device(g, slot, points, &tz);
+		queue_push(&g->done, slot);
+		if (write(g->wake_pipe[1], &wake, 1) < 0 && errno != EAGAIN){
+			break;
+		}
+	}
+	free(points);
+	return NULL;
+}
+
+/**
+ *  Handles finished transfers, a finished GET goes to the workers and a
+ *  finished POST ends the tick
+ */
+static void read_transfers(gateway_t *g){
+	CURLMsg *msg;
+	slot_t *slot;
+	long code = 0;
+	int left;
+
+	while ((msg = curl_multi_info_read(g->multi, &left)) != NULL){
+		if (msg->msg != CURLMSG_DONE){
+			continue;
+		}
+		curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **) &slot);
+		curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &code);
+		slot->failed = msg->data.result != CURLE_OK || code >= 400;
+		curl_multi_remove_handle(g->multi, msg->easy_handle);
+
+		if (slot->stage == STAGE_GET && !slot->failed){
+			queue_push(&g->work, slot);
+		}
+		else{
+			finish_tick(g, slot, !slot->failed);
+		}
+	}
+}
+
+static double percentile(const gateway_t *g, double pct){
+	uint64_t target = (uint64_t)(g->ticks * pct / 100.0);
+	uint64_t seen = 0;
+	uint32_t i;
+	for (i = 0; i < HIST_BUCKETS; i++){
+		seen += g->hist[i];
+		if (seen > target){
+			return i;
+		}
+	}
+	return HIST_BUCKETS - 1;
+}
+
+static void report(gateway_t *g, FILE *out, double elapsed, bool final){
+	fprintf(out, "%s%.1fs ticks %llu (%.0f/s) failures %llu overruns %llu p50 %.0fms p99 %.0fms\n",
+		final ? "total " : "", elapsed,
+		(unsigned long long) g->ticks, elapsed > 0 ? g->ticks / elapsed : 0,
+		(unsigned long long) g->failures, (unsigned long long) g->overruns,
+		percentile(g, 50), percentile(g, 99));
+	fflush(out);
+}
+
+static int setup(gateway_t *g, const gateway_params_t *p){
+	uint32_t i;
+
+	memset(g, 0, sizeof(*g));
+	g->p = p;
+	g->wake_pipe[0] = g->wake_pipe[1] = -1;
+	queue_init(&g->work);
+	queue_init(&g->done);
+	if (pipe(g->wake_pipe) < 0){
+		return GATEWAY_ERR;
+	}
+	fcntl(g->wake_pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(g->wake_pipe[1], F_SETFL, O_NONBLOCK);
+
+	g->multi = curl_multi_init();
+	g->devices = calloc(p->devices, sizeof(device_t));
+	g->slots = calloc(p->concurrency, sizeof(slot_t));
+	g->workers = calloc(p->threads, sizeof(pthread_t));
+	if (g->multi == NULL || g->devices == NULL || g->slots == NULL || g->workers == NULL){
+		return GATEWAY_ERR;
+	}
+	curl_multi_setopt(g->multi, CURLMOPT_MAX_TOTAL_CONNECTIONS, (long) p->concurrency);
+
+	for (i = 0; i < p->concurrency; i++){
+		g->slots[i].easy = curl_easy_init();
+		if (g->slots[i].easy == NULL){
+			return GATEWAY_ERR;
+		}
+		g->slots[i].next = g->free_slots;
+		g->free_slots = &g->slots[i];
+	}
+
+	/* spread the first ticks over one period so the load is even */
+	for (i = 0; i < p->devices; i++){
+		g->devices[i].id = i;
+		g->devices[i].temp = SIM_AMBIENT + 15 + (i % 10);
+		g->devices[i].deadline = 1 + (uint64_t) i * p->period_ms / p->devices;
+		control_init(&g->devices[i].control, &p->control);
+		wheel_add(g, &g->devices[i]);
+	}
+
+	g->start_ns = monotonic_ns();
+	for (i = 0; i < p->threads; i++){
+		if (pthread_create(&g->workers[i], NULL, worker_thread, g) != 0){
+			return GATEWAY_ERR;
+		}
+	}
+	return GATEWAY_OK;
+}
+
+static void teardown(gateway_t *g){
+	uint32_t i;
+
+	stopping = 1;
+	pthread_mutex_lock(&g->work.lock);
+	pthread_cond_broadcast(&g->work.cond);
+	pthread_mutex_unlock(&g->work.lock);
+	for (i = 0; g->workers != NULL && i < g->p->threads; i++){
+		if (g->workers[i]){
+			pthread_join(g->workers[i], NULL);
+		}
+	}
+	for (i = 0; g->slots != NULL && i < g->p->concurrency; i++){
+		if (g->slots[i].easy != NULL){
+			curl_multi_remove_handle(g->multi, g->slots[i].easy);
+			curl_easy_cleanup(g->slots[i].easy);
+		}
+		net_buffer_free(&g->slots[i].response);
+	}
+	for (i = 0; g->devices != NULL && i < g->p->devices; i++){
+		schedule_free(&g->devices[i].schedule);
+	}
+	if (g->multi != NULL){
+		curl_multi_cleanup(g->multi);
+	}
+	free(g->devices);
+	free(g->slots);
+	free(g->workers);
+	if (g->wake_pipe[0] >= 0){
+		close(g->wake_pipe[0]);
+		close(g->wake_pipe[1]);
+	}
+}
+
+/**
+ *  Runs the gateway until the duration is up or gateway_stop() is called,
+ *  printing progress every few seconds and a summary at the end
+ */
+int gateway_run(const gateway_params_t *params, FILE *out){
+	static gateway_t g;
+	struct curl_waitfd waitfd;
+	uint64_t now, last_report = 0;
+	slot_t *slot, *next;
+	device_t *dev;
+	char drain[64];
+	int running;
+
+	if (params->devices == 0 || params->concurrency == 0 || params->threads == 0 || params->period_ms == 0){
+		fprintf(out, "gateway needs devices, threads, concurrency and a period\n");
+		return GATEWAY_ERR;
+	}
+	stopping = 0;
+	if (setup(&g, params) != GATEWAY_OK){
+		fprintf(out, "couldn't set up gateway\n");
+		teardown(&g);
+		return GATEWAY_ERR;
+	}
+	fprintf(out, "gateway: %u devices, %u ms period, %u workers, %u in flight\n",
+		params->devices, params->period_ms, params->threads, params->concurrency);
+
+	waitfd.fd = g.wake_pipe[0];
+	waitfd.events = CURL_WAIT_POLLIN;
+
+	while (!stopping){
+		now = now_ms(&g);
+		if (params->duration && now >= params->duration * 1000ULL){
+			break;
+		}
+
+		wheel_advance(&g, now);
+		while (g.ready_head != NULL && g.free_slots != NULL){
+			dev = g.ready_head;
+			g.ready_head = dev->next;
+			if (g.ready_head == NULL){
+				g.ready_tail = NULL;
+			}
+			slot = g.free_slots;
+			g.free_slots = slot->next;
+			slot->dev = dev;
+			start_request(&g, slot, STAGE_GET);
+		}
+
+		curl_multi_perform(g.multi, &running);
+		read_transfers(&g);
+
+		/* reports built by the workers go straight out as POSTs */
+		for (slot = queue_take_all(&g.done); slot != NULL; slot = next){
+			next = slot->next;
+			start_request(&g, slot, STAGE_POST);
+		}
+
+		if (now - last_report >= GATEWAY_REPORT_MS){
+			report(&g, out, now / 1000.0, false);
+			last_report = now;
+		}
+
+		/* the wheel has 1ms resolution, so never sleep longer than that */
+		curl_multi_wait(g.multi, &waitfd, 1, 1, NULL);
+		while (read(g.wake_pipe[0], drain, sizeof(drain)) > 0);
+	}
+
+	report(&g, out, now_ms(&g) / 1000.0, true);
+	fprintf(out, "requests %llu\n", (unsigned long long) g.requests);
+	teardown(&g);
+	return GATEWAY_OK;
+}
+
+#endif
@@ -0,0 +1,46 @@
+/*
+ *  Gateway mode for thermd
+ *
+ *  Drives thousands of logical thermostats from one process, either to
+ *  load test the server or to aggregate devices behind one gateway.
+ *  Per-device ticks are scheduled on a timer wheel, all HTTP goes
+ *  through one curl multi handle and the CPU work (parse, schedule,
+ *  control) runs on a worker pool.
+ */
+
+#ifndef GATEWAY_H
+#define GATEWAY_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "control.h"
+#include "schedule.h"
+#include "tz.h"
+
+#define GATEWAY_OK	0
+#define GATEWAY_ERR	1
+
+typedef struct {
+	/* number of logical thermostats */
+	uint32_t devices;
+	/* worker threads for parse/control */
+	uint32_t threads;
+	/* per-device tick period */
+	uint32_t period_ms;
+	/* seconds to run, 0 runs until SIGINT/SIGTERM */
+	uint32_t duration;
+	/* most HTTP requests in flight at once */
+	uint32_t concurrency;
+	/* GET schedules from and POST reports to this url */
+	const char *url;
+	control_params_t control;
+	tz_t tz;
+	/* turns a schedule response into setpoints, see parse_JSON() */
+	uint16_t (*parse)(const char *json, setpoint_t *points);
+}gateway_params_t;
+
+/* Function prototypes */
+int gateway_run(const gateway_params_t *params, FILE *out);
+void gateway_stop(void);
+
+#endif
@@ -0,0 +1,696 @@
+/*
+ *  Built-in HTTP client for thermd
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "http.h"
+#include "metrics.h"
+
+/* request line and headers, the url is bounded well below this */
+#define HTTP_HEAD_SIZE	1024
+
+/* seconds, 0 waits as long as it takes */
+static double connect_timeout;
+static double timeout;
+/* caps a kept response body, 0 for no cap */
+static size_t max_response;
+static http_conn_t conn = { .fd = -1 };
+static char tx[HTTP_HEAD_SIZE];
+/* write-behind requests that failed since http_take_failures() */
+static uint32_t failures;
+
+static const char *errors[] = {
+	"ok",
+	"bad url",
+	"couldn't connect",
+	"connection error",
+	"timed out",
+	"bad response",
+	"server returned an error",
+	"response too large",
+	"connection closed",
+};
+
+static double monotonic_seconds(void){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/**
+ *  Splits [http://]host[:port][/path], https and other schemes are refused
+ */
+int http_parse_url(const char *url, http_url_t *u){
+	const char *host = url, *end, *colon;
+	size_t len;
+
+	if (!strncasecmp(url, "http://", strlen("http://"))){
+		host = url + strlen("http://");
+	}
+	else if (strstr(url, "://") != NULL){
+		return HTTP_URL_ERR;
+	}
+	end = strchr(host, '/');
+	if (end == NULL){
+		end = host + strlen(host);
+	}
+	len = end - host;
+	if (len == 0 || len >= sizeof(u->authority)){
+		return HTTP_URL_ERR;
+	}
+	memcpy(u->authority, host, len);
+	u->authority[len] = '\0';
+
+	colon = memchr(host, ':', len);
+	if (colon == NULL){
+		colon = end;
+		strcpy(u->port, "80");
+	}
+	else if (end - colon - 1 == 0 || end - colon - 1 >= HTTP_PORT_SIZE){
+		return HTTP_URL_ERR;
+	}
+	else{
+		memcpy(u->port, colon + 1, end - colon - 1);
+		u->port[end - colon - 1] = '\0';
+	}
+	if (colon - host == 0 || colon - host >= HTTP_HOST_SIZE){
+		return HTTP_URL_ERR;
+	}
+	memcpy(u->host, host, colon - host);
+	u->host[colon - host] = '\0';
+	u->path = *end == '/' ? end : "/";
+	return HTTP_OK;
+}
+
+/**
+ *  Bounds every request like net_set_limits(), timeouts in seconds
+ */
+void http_set_limits(double connect, double total, size_t max){
+	connect_timeout = connect;
+	timeout = total;
+	max_response = max;
+}
+
+/**
+ *  Waits for events on fd until deadline (0 for no deadline), false on
+ *  a timeout or poll error
+ */
+static bool wait_fd(int fd, short events, double deadline){
+	struct pollfd p;
+	double left;
+	int n;
+
+	p.fd = fd;
+	p.events = events;
+	while (1){
+		left = deadline > 0 ? deadline - monotonic_seconds() : -1;
+		if (deadline > 0 && left <= 0){
+			errno = ETIMEDOUT;
+			return false;
+		}
+		n = poll(&p, 1, left < 0 ? -1 : (int)(left * 1000) + 1);
+		if (n > 0){
+			return true;
+		}
+		if (n < 0 && errno != EINTR){
+			return false;
+		}
+	}
+}
+
+/**
+ *  True if a response byte (or the server closing) is already waiting
+ */
+static bool readable_now(void){
+	struct pollfd p;
+
+	if (conn.pos < conn.len){
+		return true;
+	}
+	p.fd = conn.fd;
+	p.events = POLLIN;
+	return poll(&p, 1, 0) > 0;
+}
+
+/**
+ *  Fills in ai for a dotted quad host and numeric port without going
+ *  through getaddrinfo(), which in a static glibc build loads the NSS
+ *  libraries at runtime even for a literal address
+ */
+static bool numeric_host(const http_url_t *u, struct addrinfo *ai, struct sockaddr_in *sin){
+	char *end;
+	unsigned long port = strtoul(u->port, &end, 10);
+
+	memset(sin, 0, sizeof(*sin));
+	if (end == u->port || *end != '\0' || port > 65535 || inet_pton(AF_INET, u->host, &sin->sin_addr) != 1){
+		return false;
+	}
+	sin->sin_family = AF_INET;
+	sin->sin_port = htons(port);
+	memset(ai, 0, sizeof(*ai));
+	ai->ai_family = AF_INET;
+	ai->ai_socktype = SOCK_STREAM;
+	ai->ai_addr = (struct sockaddr *) sin;
+	ai->ai_addrlen = sizeof(*sin);
+	return true;
+}
+
+/**
+ *  Non-blocking connect to the first address that answers before deadline
+ */
+static int connect_to(const http_url_t *u, double deadline){
+	struct addrinfo hints, numeric, *res = NULL, *ai;
+	struct sockaddr_in sin;
+	socklen_t len = sizeof(int);
+	int fd = -1, err, one = 1;
+
+	if (numeric_host(u, &numeric, &sin)){
+		ai = &numeric;
+	}
+	else{
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		if (getaddrinfo(u->host, u->port, &hints, &res) != 0){
+			return -1;
+		}
+		ai = res;
+	}
+	for (; ai != NULL; ai = ai->ai_next){
+		fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+		if (fd < 0){
+			continue;
+		}
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0){
+			break;
+		}
+		if (errno == EINPROGRESS && wait_fd(fd, POLLOUT, deadline) &&
+		    getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err == 0){
+			break;
+		}
+		close(fd);
+		fd = -1;
+	}
+	if (res != NULL){
+		freeaddrinfo(res);
+	}
+	if (fd >= 0){
+		/* a pipelined request mustn't wait for the ack of the one before */
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	}
+	return fd;
+}
+
+/**
+ *  Drops the connection, write-behind responses that never came are failures
+ */
+static void conn_close(void){
+	if (conn.fd >= 0){
+		close(conn.fd);
+	}
+	if (conn.pending > 0){
+		syslog(LOG_INFO, "Lost the response to %u request(s) when the connection closed\n", conn.pending);
+		metrics_count(METRIC_FAILURES, conn.pending);
+		failures += conn.pending;
+	}
+	conn.fd = -1;
+	conn.pending = 0;
+	conn.served = 0;
+	conn.closing = false;
+	conn.pos = 0;
+	conn.len = 0;
+}
+
+/**
+ *  Reads more into rx, keeping what hasn't been consumed
+ */
+static int fill(double deadline){
+	ssize_t n;
+
+	if (conn.pos > 0){
+		memmove(conn.rx, conn.rx + conn.pos, conn.len - conn.pos);
+		conn.len -= conn.pos;
+		conn.pos = 0;
+	}
+	if (conn.len == HTTP_RX_SIZE){
+		/* a header or chunk size line longer than the buffer */
+		return HTTP_PROTOCOL_ERR;
+	}
+	while (1){
+		if (!wait_fd(conn.fd, POLLIN, deadline)){
+			return errno == ETIMEDOUT ? HTTP_TIMEOUT : HTTP_IO_ERR;
+		}
+		n = recv(conn.fd, conn.rx + conn.len, HTTP_RX_SIZE - conn.len, 0);
+		if (n > 0){
+			conn.len += n;
+			conn.seen += n;
+			metrics_count(METRIC_WIRE_BYTES_IN, n);
+			return HTTP_OK;
+		}
+		if (n == 0){
+			return HTTP_CLOSED;
+		}
+		if (errno != EAGAIN && errno != EINTR){
+			return HTTP_IO_ERR;
+		}
+	}
+}
+
+/**
+ *  Finds the end of the next CRLF terminated line from pos, reading more
+ *  as needed, and returns its length
+ */
+static int next_line(double deadline, size_t *line_len){
+	char *end;
+	int ret;
+
+	while ((end = memmem(conn.rx + conn.pos, conn.len - conn.pos, "\r\n", 2)) == NULL){
+		if ((ret = fill(deadline)) != HTTP_OK){
+			return ret;
+		}
+	}
+	*line_len = end - (conn.rx + conn.pos);
+	return HTTP_OK;
+}
+
+/**
+ *  Moves n body bytes (or everything up to the close, for until_close)
+ *  from the connection into response, NULL discards them
+ */
+static int read_body(uint64_t n, bool until_close, net_buffer_t *response, double deadline){
+	size_t take;
+	int ret;
+
+	while (n > 0){
+		if (conn.pos == conn.len){
+			ret = fill(deadline);
+			if (ret == HTTP_CLOSED && until_close){
+				return HTTP_OK;
+			}
+			if (ret != HTTP_OK){
+				return ret;
+			}
+		}
+		take = conn.len - conn.pos;
+		if (take > n){
+			take = n;
+		}
+		if (response != NULL){
+			if (max_response > 0 && response->len + take > max_response){
+				return HTTP_TOO_LARGE;
+			}
+			if (net_buffer_append(response, conn.rx + conn.pos, take) != NET_OK){
+				return HTTP_IO_ERR;
+			}
+		}
+		metrics_count(METRIC_BYTES_IN, take);
+		conn.pos += take;
+		n -= take;
+	}
+	return HTTP_OK;
+}
+
+/**
+ *  Reads chunk size lines and chunks up to the last one and its trailers
+ */
+static int read_chunked(net_buffer_t *response, double deadline){
+	size_t line;
+	uint64_t size;
+	char *end;
+	int ret;
+
+	while (1){
+		if ((ret = next_line(deadline, &line)) != HTTP_OK){
+			return ret;
+		}
+		size = strtoull(conn.rx + conn.pos, &end, 16);
+		if (end == conn.rx + conn.pos){
+			return HTTP_PROTOCOL_ERR;
+		}
+		conn.pos += line + 2;
+		if (size == 0){
+			break;
+		}
+		if ((ret = read_body(size, false, response, deadline)) != HTTP_OK){
+			return ret;
+		}
+		/* the CRLF after the chunk data */
+		if ((ret = next_line(deadline, &line)) != HTTP_OK){
+			return ret;
+		}
+		if (line != 0){
+			return HTTP_PROTOCOL_ERR;
+		}
+		conn.pos += 2;
+	}
+	/* trailers, ended by an empty line */
+	do{
+		if ((ret = next_line(deadline, &line)) != HTTP_OK){
+			return ret;
+		}
+		conn.pos += line + 2;
+	}while (line != 0);
+	return HTTP_OK;
+}
+
+/**
+ *  Finds a header's value in a NUL terminated header block, NULL if absent
+ */
+static const char *header(const char *head, const char *name){
+	const char *line = strstr(head, "\r\n");
+	size_t len = strlen(name);
+
+	while (line != NULL && line[2] != '\0'){
+		line += 2;
+		if (!strncasecmp(line, name, len) && line[len] == ':'){
+			line += len + 1;
+			while (*line == ' ' || *line == '\t'){
+				line++;
+			}
+			return line;
+		}
+		line = strstr(line, "\r\n");
+	}
+	return NULL;
+}
+
+/**
+ *  Reads the next response off the connection, the body goes to
+ *  response (NULL discards it). A 4xx or 5xx status fails it like
+ *  curl's CURLOPT_FAILONERROR, after its body is read so the
+ *  connection stays usable. head_request is set for the reply to a
+ *  HEAD, which has no body whatever its headers say.
+ */
+static int read_response(net_buffer_t *response, bool head_request, double deadline){
+	const char *value;
+	char *head, *end;
+	uint64_t length = 0;
+	bool chunked, sized;
+	int status, minor, ret;
+
+	conn.seen = conn.len - conn.pos;
+	do{
+		while ((end = memmem(conn.rx + conn.pos, conn.len - conn.pos, "\r\n\r\n", 4)) == NULL){
+			if ((ret = fill(deadline)) != HTTP_OK){
+				return ret;
+			}
+		}
+		head = conn.rx + conn.pos;
+		/* cut the head off after its last header line so header() stops there */
+		end[2] = '\0';
+		conn.pos = end + 4 - conn.rx;
+
+		if (sscanf(head, "HTTP/1.%d %d", &minor, &status) != 2){
+			return HTTP_PROTOCOL_ERR;
+		}
+		/* 1xx are interim, headers only, the real response follows */
+	}while (status >= 100 && status < 200);
+	value = header(head, "Connection");
+	/* 1.0 servers close unless they say otherwise, 1.1 ones the other way round */
+	conn.closing = minor == 0 ? value == NULL || strncasecmp(value, "keep-alive", strlen("keep-alive")) :
+		value != NULL && !strncasecmp(value, "close", strlen("close"));
+	value = header(head, "Transfer-Encoding");
+	chunked = value != NULL && strcasestr(value, "chunked") != NULL;
+	value = header(head, "Content-Length");
+	sized = !chunked && value != NULL;
+	if (sized){
+		length = strtoull(value, NULL, 10);
+	}
+
+	if (response != NULL){
+		response->len = 0;
+		if (response->data != NULL){
+			response->data[0] = '\0';
+		}
+	}
+	if (status >= 400){
+		/* the error page is nobody's schedule */
+		response = NULL;
+	}
+	if (head_request || status == 204 || status == 304){
+		/* never a body (RFC 7230 3.3.3), even with a Content-Length */
+		ret = HTTP_OK;
+	}
+	else if (chunked){
+		ret = read_chunked(response, deadline);
+	}
+	else if (sized){
+		ret = read_body(length, false, response, deadline);
+	}
+	else{
+		/* neither, the body runs to the close (RFC 7230 3.3.3 rule 7)
+		 * whatever the Connection header said */
+		conn.closing = true;
+		ret = read_body(UINT64_MAX, true, response, deadline);
+	}
+	if (ret != HTTP_OK){
+		return ret;
+	}
+	conn.served++;
+	return status >= 400 ? HTTP_STATUS_ERR : HTTP_OK;
+}
+
+/**
+ *  Reads every write-behind response still owed on the connection
+ */
+static int drain(double deadline){
+	int ret;
+
+	while (conn.pending > 0){
+		/* write-behind only carries POST, PUT and DELETE, never a HEAD */
+		ret = read_response(NULL, false, deadline);
+		if (ret != HTTP_OK && ret != HTTP_STATUS_ERR){
+			return ret;
+		}
+		conn.pending--;
+		if (ret == HTTP_STATUS_ERR){
+			syslog(LOG_INFO, "Server refused a sent request\n");
+			metrics_count(METRIC_FAILURES, 1);
+			failures++;
+		}
+		if (conn.closing){
+			return conn.pending > 0 ? HTTP_CLOSED : HTTP_OK;
+		}
+	}
+	return HTTP_OK;
+}
+
+/**
+ *  Makes sure the connection goes to u's server and looks alive, a
+ *  connection to another server is drained and closed first
+ */
+static int connect_for(const http_url_t *u, double connect_deadline, double deadline){
+	if (conn.fd >= 0 && (strcmp(conn.url.host, u->host) || strcmp(conn.url.port, u->port))){
+		drain(deadline);
+		conn_close();
+	}
+	if (conn.fd >= 0 && conn.pending == 0 && (conn.closing || readable_now())){
+		/* the server closed it, or sent something nobody asked for */
+		conn_close();
+	}
+	if (conn.fd < 0){
+		conn.fd = connect_to(u, connect_deadline);
+		if (conn.fd < 0){
+			return HTTP_CONNECT_ERR;
+		}
+		conn.url = *u;
+	}
+	return HTTP_OK;
+}
+
+/**
+ *  Writes the request head and body in one go
+ */
+static int write_request(const http_url_t *u, const char *method, const char *body, double deadline){
+	size_t len = body != NULL ? strlen(body) : 0;
+	struct iovec iov[2];
+	struct msghdr msg;
+	ssize_t n;
+	int head;
+
+	head = snprintf(tx, sizeof(tx), "%s %s HTTP/1.1\r\nHost: %s\r\nUser-Agent: thermd\r\nAccept: */*\r\n",
+		method, u->path, u->authority);
+	if (body != NULL && head > 0 && (size_t) head < sizeof(tx)){
+		/* what curl sends for CURLOPT_POSTFIELDS, so the server sees no difference */
+		head += snprintf(tx + head, sizeof(tx) - head,
+			"Content-Type: application/x-www-form-urlencoded\r\nContent-Length: %zu\r\n", len);
+	}
+	if (head < 0 || (size_t) head + 2 >= sizeof(tx)){
+		return HTTP_URL_ERR;
+	}
+	memcpy(tx + head, "\r\n", 3);
+	head += 2;
+
+	iov[0].iov_base = tx;
+	iov[0].iov_len = head;
+	iov[1].iov_base = (void *) body;
+	iov[1].iov_len = len;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = len > 0 ? 2 : 1;
+	while (msg.msg_iovlen > 0){
+		if (!wait_fd(conn.fd, POLLOUT, deadline)){
+			return errno == ETIMEDOUT ? HTTP_TIMEOUT : HTTP_IO_ERR;
+		}
+		n = sendmsg(conn.fd, &msg, MSG_NOSIGNAL);
+		if (n < 0){
+			if (errno == EAGAIN || errno == EINTR){
+				continue;
+			}
+			return HTTP_IO_ERR;
+		}
+		/* step over whatever went out */
+		while (msg.msg_iovlen > 0 && (size_t) n >= msg.msg_iov->iov_len){
+			n -= msg.msg_iov->iov_len;
+			msg.msg_iov++;
+			msg.msg_iovlen--;
+		}
+		if (msg.msg_iovlen > 0){
+			msg.msg_iov->iov_base = (char *) msg.msg_iov->iov_base + n;
+			msg.msg_iov->iov_len -= n;
+		}
+	}
+	return HTTP_OK;
+}
+
+/**
+ *  Sends a request and reads its reply on the kept-alive connection,
+ *  reading any write-behind replies ahead of it on the way. A request
+ *  that finds the connection closed before any of its reply arrived is
+ *  sent once more on a new one, that's the server's keep-alive timeout
+ *  and not a failure.
+ *  @params
+ *  url: [http://]host[:port][/path]
+ *  method: "GET", "POST", ...
+ *  body: sent with Content-Length, NULL for none
+ *  response: gets the body, NULL to discard it
+ */
+int http_request(const char *url, const char *method, const char *body, net_buffer_t *response){
+	double start = monotonic_seconds();
+	double deadline = timeout > 0 ? start + timeout : 0;
+	double connect_deadline = connect_timeout > 0 ? start + connect_timeout : 0;
+	http_url_t u;
+	bool reused;
+	int ret = HTTP_OK, attempt;
+
+	if (http_parse_url(url, &u) != HTTP_OK){
+		return HTTP_URL_ERR;
+	}
+	if (deadline > 0 && (connect_deadline == 0 || deadline < connect_deadline)){
+		connect_deadline = deadline;
+	}
+
+	for (attempt = 0; attempt < 2; attempt++){
+		if ((ret = connect_for(&u, connect_deadline, deadline)) != HTTP_OK){
+			return ret;
+		}
+		reused = conn.served > 0 || conn.pending > 0;
+		conn.seen = 0;
+		ret = write_request(&u, method, body, deadline);
+		if (ret == HTTP_OK){
+			ret = drain(deadline);
+		}
+		if (ret == HTTP_OK){
+			ret = read_response(response, !strcmp(method, "HEAD"), deadline);
+		}
+		if (ret == HTTP_OK || ret == HTTP_STATUS_ERR || ret == HTTP_TOO_LARGE){
+			if (reused){
+				metrics_count(METRIC_CONNECTIONS_REUSED, 1);
+			}
+			if (ret == HTTP_TOO_LARGE || conn.closing){
+				/* the rest of a too large body isn't worth reading */
+				conn_close();
+			}
+			return ret;
+		}
+		conn_close();
+		if (!reused || conn.seen > 0){
+			return ret;
+		}
+	}
+	return ret;
+}
+
+/**
+ *  Writes a request without waiting for the reply, which is read with
+ *  the next request on the connection. A reply that turns out to be an
+ *  error is logged and counted in http_take_failures().
+ */
+int http_send(const char *url, const char *method, const char *body){
+	double start = monotonic_seconds();
+	double deadline = timeout > 0 ? start + timeout : 0;
+	double connect_deadline = connect_timeout > 0 ? start + connect_timeout : 0;
+	http_url_t u;
+	bool reused;
+	int ret = HTTP_OK, attempt;
+
+	if (http_parse_url(url, &u) != HTTP_OK){
+		return HTTP_URL_ERR;
+	}
+	if (deadline > 0 && (connect_deadline == 0 || deadline < connect_deadline)){
+		connect_deadline = deadline;
+	}
+
+	for (attempt = 0; attempt < 2; attempt++){
+		/* replies already here cost nothing to read, and a full queue has to wait */
+		if (conn.fd >= 0 && (conn.pending == HTTP_MAX_PENDING || (conn.pending > 0 && readable_now()))){
+			if (drain(deadline) != HTTP_OK){
+				conn_close();
+			}
+		}
+		if ((ret = connect_for(&u, connect_deadline, deadline)) != HTTP_OK){
+			return ret;
+		}
+		reused = conn.served > 0 || conn.pending > 0;
+		ret = write_request(&u, method, body, deadline);
+		if (ret == HTTP_OK){
+			if (reused){
+				metrics_count(METRIC_CONNECTIONS_REUSED, 1);
+			}
+			conn.pending++;
+			return HTTP_OK;
+		}
+		conn_close();
+		if (!reused){
+			return ret;
+		}
+	}
+	return ret;
+}
+
+/**
+ *  Write-behind requests that failed since the last call
+ */
+uint32_t http_take_failures(void){
+	uint32_t n = failures;
+
+	failures = 0;
+	return n;
+}
+
+const char *http_strerror(int err){
+	if (err < 0 || err >= (int)(sizeof(errors) / sizeof(errors[0]))){
+		return "unknown error";
+	}
+	return errors[err];
+}
+
+void http_cleanup(void){
+	conn_close();
+}
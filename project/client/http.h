@@ -0,0 +1,80 @@
+/*
+ *  Built-in HTTP client for thermd
+ *
+ *  A small blocking HTTP/1.1 client for plain http:// endpoints, used
+ *  with http_client=builtin and always by the tiny build (make
+ *  thermd-tiny, see README.txt). It keeps one connection open to the
+ *  current server, decodes chunked and Content-Length responses and
+ *  works out of fixed buffers, so a steady stream of requests doesn't
+ *  touch the heap beyond the caller's response buffer.
+ *
+ *  http_send() writes a request whose answer nobody waits for (the
+ *  status post) and leaves its response to be read after the next
+ *  request goes out, so the post and the next poll share the wire
+ *  instead of each costing the loop a round trip.
+ *
+ *  No TLS, redirects, proxies or content encodings: a url without a
+ *  scheme is http, like curl treats it, and anything else is refused.
+ */
+
+#ifndef HTTP_H
+#define HTTP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "net.h"
+
+#define HTTP_OK			0
+#define HTTP_URL_ERR		1
+#define HTTP_CONNECT_ERR	2
+#define HTTP_IO_ERR		3
+#define HTTP_TIMEOUT		4
+#define HTTP_PROTOCOL_ERR	5
+#define HTTP_STATUS_ERR		6
+#define HTTP_TOO_LARGE		7
+#define HTTP_CLOSED		8
+
+#define HTTP_HOST_SIZE	128
+#define HTTP_PORT_SIZE	8
+/* received bytes not yet consumed, bounds the response headers */
+#define HTTP_RX_SIZE	8192
+/* write-behind requests whose responses may be outstanding at once */
+#define HTTP_MAX_PENDING 4
+
+typedef struct {
+	char host[HTTP_HOST_SIZE];
+	char port[HTTP_PORT_SIZE];
+	/* "host" or "host:port" as the url had it, for the Host header */
+	char authority[HTTP_HOST_SIZE + HTTP_PORT_SIZE];
+	/* points into the url, "/" when it had no path */
+	const char *path;
+}http_url_t;
+
+/* the one kept-alive connection */
+typedef struct {
+	int fd;
+	http_url_t url;
+	/* write-behind responses still to be read, in order */
+	uint32_t pending;
+	/* responses read on this connection */
+	uint64_t served;
+	/* the server will close after the response being read */
+	bool closing;
+	/* bytes of the current response seen, 0 means it never started */
+	size_t seen;
+	char rx[HTTP_RX_SIZE];
+	size_t pos;
+	size_t len;
+}http_conn_t;
+
+/* Function prototypes */
+int http_parse_url(const char *url, http_url_t *u);
+void http_set_limits(double connect_timeout, double timeout, size_t max_response);
+int http_request(const char *url, const char *method, const char *body, net_buffer_t *response);
+int http_send(const char *url, const char *method, const char *body);
+uint32_t http_take_failures(void);
+const char *http_strerror(int err);
+void http_cleanup(void);
+
+#endif
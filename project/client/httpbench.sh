@@ -0,0 +1,165 @@
+#!/bin/bash
+#
+#  Benchmark of thermd's two http clients
+#
+#  Runs ./thermd with http_client=curl and then =builtin against the
+#  local mockserver at a fast tick and prints, per client: stage
+#  latencies from the metrics file (get, post and the whole tick, p50
+#  and p99 in ms), heap allocations and CPU per request once warmed up,
+#  RSS, and how many connections the server saw.
+#
+#  ./httpbench.sh
+#  SECS=30 LATENCY=5 PORT=19101 ./httpbench.sh
+#
+#  LATENCY adds that many ms to every response, which is where writing
+#  the post without waiting for its response shows. Allocations are
+#  every malloc, calloc and realloc in the process, counted by a small
+#  preloaded library built here, so libcurl's own are included.
+#
+
+SECS=${SECS:-10}
+WARMUP=${WARMUP:-2}
+PORT=${PORT:-19101}
+LATENCY=${LATENCY:-0}
+DIR=$(cd "$(dirname "$0")" && pwd)
+WORK=$(mktemp -d /tmp/thermd-bench.XXXXXX)
+
+cleanup(){
+	[ -n "$MOCK_PID" ] && kill "$MOCK_PID" 2>/dev/null
+	[ -n "$THERMD_PID" ] && kill "$THERMD_PID" 2>/dev/null
+	rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+# counts allocations into a file mapped from $ALLOC_COUNT
+cat > "$WORK/allocs.c" <<'EOF'
+#include <stdlib.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static uint64_t unmapped;
+static uint64_t *count = &unmapped;
+
+__attribute__((constructor)) static void map_count(void){
+	const char *path = getenv("ALLOC_COUNT");
+	int fd = path != NULL ? open(path, O_RDWR | O_CREAT, 0644) : -1;
+	void *p;
+
+	if (fd < 0 || ftruncate(fd, sizeof(uint64_t)) != 0){
+		return;
+	}
+	p = mmap(NULL, sizeof(uint64_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p != MAP_FAILED){
+		count = p;
+	}
+}
+
+void *malloc(size_t size){
+	__atomic_add_fetch(count, 1, __ATOMIC_RELAXED);
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size){
+	__atomic_add_fetch(count, 1, __ATOMIC_RELAXED);
+	return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size){
+	__atomic_add_fetch(count, 1, __ATOMIC_RELAXED);
+	return __libc_realloc(ptr, size);
+}
+EOF
+if ! gcc -O2 -shared -fPIC -o "$WORK/allocs.so" "$WORK/allocs.c"; then
+	echo "couldn't build the allocation counter"
+	exit 1
+fi
+
+printf '68\n69\n70\n71\n72\n71\n70\n69\n' > "$WORK/trace"
+
+# value of a metric line, $2 is the name with its labels
+metric(){
+	awk -v name="$2" '$1 == name { print $2 }' "$1"
+}
+
+# stage quantile in ms
+quantile(){
+	metric "$1" "thermd_stage_quantile_seconds{stage=\"$2\",quantile=\"$3\"}" | awk '{ printf "%.3f", $1 * 1000 }'
+}
+
+# ns of CPU used by every thread of $1
+cpu_ns(){
+	cat /proc/$1/task/*/schedstat | awk '{ sum += $1 } END { printf "%d", sum }'
+}
+
+allocs(){
+	od -An -t u8 "$WORK/allocs" | tr -d ' '
+}
+
+# the server's counter, each call is one more request and connection
+server(){
+	curl -s "127.0.0.1:$PORT/stats" | sed "s/.*\"$1\":\([0-9]*\).*/\1/"
+}
+
+printf "%-8s %8s %8s %8s %8s %8s %8s %8s %9s %9s %7s %6s\n" client \
+	"get p50" "get p99" "post p50" "post p99" "tick p50" "tick p99" req/s "allocs/r" "cpu us/r" "RSS kB" conns
+for client in curl builtin; do
+	cat > "$WORK/thermd.conf" <<EOF
+endpoint=127.0.0.1:$PORT
+logfile=$WORK/thermd.log
+sensor=fake:$WORK/trace
+timezone=UTC
+control_period=0.05
+telemetry_period=0.05
+poll_min=0.05
+poll_max=0.05
+status=$WORK/status
+metrics_file=$WORK/metrics
+metrics_period=1
+http_client=$client
+EOF
+	# a fresh server for each, so its counters are this client's
+	"$DIR/mockserver" -p "$PORT" -l "$LATENCY" -i 3600 > /dev/null &
+	MOCK_PID=$!
+	sleep 0.3
+
+	rm -f "$WORK/metrics" "$WORK/allocs"
+	LD_PRELOAD="$WORK/allocs.so" ALLOC_COUNT="$WORK/allocs" "$DIR/thermd" -f -c "$WORK/thermd.conf" 2>/dev/null &
+	THERMD_PID=$!
+	sleep "$WARMUP"
+	a0=$(allocs)
+	c0=$(cpu_ns $THERMD_PID)
+	r0=$(server requests)
+	sleep "$SECS"
+	a1=$(allocs)
+	c1=$(cpu_ns $THERMD_PID)
+	r1=$(server requests)
+	rss=$(awk '$1 == "VmRSS:" { print $2 }' /proc/$THERMD_PID/status)
+	# the metrics file is rewritten every second
+	sleep 1.2
+	kill "$THERMD_PID"
+	wait "$THERMD_PID" 2>/dev/null
+	THERMD_PID=
+	# less the three /stats requests' own
+	conns=$(($(server connections) - 3))
+	kill "$MOCK_PID"
+	wait "$MOCK_PID" 2>/dev/null
+	MOCK_PID=
+
+	# r1 counts the /stats request that asked for it
+	requests=$((r1 - r0 - 1))
+	printf "%-8s %8s %8s %8s %8s %8s %8s %8.1f %9.2f %9.1f %7s %6d\n" "$client" \
+		"$(quantile "$WORK/metrics" get 0.5)" "$(quantile "$WORK/metrics" get 0.99)" \
+		"$(quantile "$WORK/metrics" post 0.5)" "$(quantile "$WORK/metrics" post 0.99)" \
+		"$(quantile "$WORK/metrics" tick 0.5)" "$(quantile "$WORK/metrics" tick 0.99)" \
+		"$(echo "$requests $SECS" | awk '{ print $1 / $2 }')" \
+		"$(echo "$a0 $a1 $requests" | awk '{ print ($2 - $1) / $3 }')" \
+		"$(echo "$c0 $c1 $requests" | awk '{ print ($2 - $1) / 1000 / $3 }')" \
+		"$rss" "$conns"
+done
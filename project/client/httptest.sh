@@ -0,0 +1,93 @@
+#!/bin/bash
+#
+#  Built-in http client check for thermd
+#
+#  Runs ./thermd with http_client=builtin against ./mockserver in a few
+#  modes and checks every request went through on one connection:
+#
+#  - plain Content-Length responses
+#  - chunked responses (-c)
+#  - posts answered with a bare 204 and no Content-Length (-n), which
+#    must not be read as a body running to the close
+#
+#  ./httptest.sh
+#  SECS=5 PORT=19103 ./httptest.sh
+#
+#  Exits 1 if a check fails.
+#
+
+SECS=${SECS:-3}
+PORT=${PORT:-19103}
+DIR=$(cd "$(dirname "$0")" && pwd)
+WORK=$(mktemp -d /tmp/thermd-http.XXXXXX)
+FAILED=0
+
+cleanup(){
+	[ -n "$MOCK_PID" ] && kill "$MOCK_PID" 2>/dev/null
+	[ -n "$THERMD_PID" ] && kill "$THERMD_PID" 2>/dev/null
+	rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+printf '68\n69\n70\n71\n72\n71\n70\n69\n' > "$WORK/trace"
+# a short request_timeout still makes a hung response cost whole ticks
+cat > "$WORK/thermd.conf" <<EOF
+endpoint=127.0.0.1:$PORT
+http_client=builtin
+request_timeout=1
+logfile=$WORK/thermd.log
+sensor=fake:$WORK/trace
+timezone=UTC
+control_period=0.1
+telemetry_period=0.1
+poll_min=0.1
+poll_max=0.1
+status=$WORK/status
+metrics_file=$WORK/metrics
+metrics_period=0.5
+EOF
+
+metric(){
+	awk -v name="$1" '$1 == name { print $2 }' "$WORK/metrics"
+}
+
+server(){
+	curl -s "127.0.0.1:$PORT/stats" | sed "s/.*\"$1\":\([0-9]*\).*/\1/"
+}
+
+# runs thermd for SECS against a mockserver started with $@
+run(){
+	local name=$1
+	shift
+	"$DIR/mockserver" -p "$PORT" -i 3600 "$@" > /dev/null &
+	MOCK_PID=$!
+	sleep 0.3
+	rm -f "$WORK/metrics"
+	"$DIR/thermd" -f -c "$WORK/thermd.conf" 2>/dev/null &
+	THERMD_PID=$!
+	sleep "$SECS"
+	kill "$THERMD_PID"
+	wait "$THERMD_PID" 2>/dev/null
+	THERMD_PID=
+	requests=$(metric thermd_requests_total)
+	failures=$(metric thermd_request_failures_total)
+	# less the /stats request's own
+	connections=$(($(server connections) - 1))
+	kill "$MOCK_PID"
+	wait "$MOCK_PID" 2>/dev/null
+	MOCK_PID=
+
+	# a tick every 0.1 s makes a GET and a POST
+	if [ "${requests:-0}" -ge $((SECS * 10)) ] && [ "$failures" -eq 0 ] && [ "$connections" -eq 1 ]; then
+		echo "ok   $name: $requests requests, $failures failed, $connections connection(s)"
+	else
+		echo "FAIL $name: $requests requests, $failures failed, $connections connection(s)"
+		FAILED=1
+	fi
+}
+
+run "content-length"
+run "chunked" -c
+run "bare 204 posts" -n
+
+exit $FAILED
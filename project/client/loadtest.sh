@@ -0,0 +1,96 @@
+#!/bin/bash
+#
+#  End to end load test for thermd against the local mockserver
+#
+#  Builds both, then runs thermd through a set of server scenarios (clean,
+#  slow, erroring, dropping connections, dead primary) and prints
+#  requests/sec, bytes on the wire per tick and tick latency for each.
+#
+#  ./loadtest.sh [seconds per scenario] [control period]
+#
+
+SECS=${1:-20}
+PERIOD=${2:-0.1}
+PORT=${PORT:-19000}
+DEAD_PORT=$((PORT + 1))
+DIR=$(cd "$(dirname "$0")" && pwd)
+WORK=$(mktemp -d /tmp/thermd-loadtest.XXXXXX)
+
+make -C "$DIR" thermd mockserver >/dev/null || exit 1
+
+cleanup(){
+	[ -n "$MOCK_PID" ] && kill "$MOCK_PID" 2>/dev/null
+	[ -n "$THERMD_PID" ] && kill "$THERMD_PID" 2>/dev/null
+	rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+printf '68\n69\n70\n71\n72\n71\n70\n69\n' > "$WORK/trace"
+
+# metric NAME [LABELS] from the last metrics dump, 0 if missing
+metric(){
+	awk -v name="$1" -v labels="$2" '
+		$1 == name || $1 == name "{" labels "}" { value = $2 }
+		END { print value == "" ? 0 : value }' "$WORK/thermd.prom"
+}
+
+# run NAME ENDPOINT MOCKSERVER_ARGS...
+run(){
+	local name=$1 endpoint=$2
+	shift 2
+
+	"$DIR/mockserver" -p "$PORT" -i "$SECS" "$@" > "$WORK/mock.out" &
+	MOCK_PID=$!
+	sleep 0.3
+
+	cat > "$WORK/thermd.conf" <<-EOF
+	endpoint=$endpoint
+	logfile=$WORK/thermd.log
+	sensor=fake:$WORK/trace
+	timezone=UTC
+	control_period=$PERIOD
+	telemetry_period=$PERIOD
+	poll_min=$PERIOD
+	poll_max=$PERIOD
+	connect_timeout=1
+	request_timeout=2
+	status=$WORK/status
+	metrics_file=$WORK/thermd.prom
+	metrics_period=1
+	EOF
+	rm -f "$WORK/thermd.prom"
+	"$DIR/thermd" -c "$WORK/thermd.conf" || exit 1
+	sleep 0.3
+	THERMD_PID=$(pgrep -n -f "thermd -c $WORK/thermd.conf")
+	sleep "$SECS"
+	kill "$THERMD_PID"
+	THERMD_PID=
+	sleep 0.5
+	kill "$MOCK_PID"
+	MOCK_PID=
+
+	local ticks requests failures failovers wire
+	ticks=$(metric thermd_stage_seconds_count 'stage="tick"')
+	requests=$(metric thermd_requests_total)
+	failures=$(metric thermd_request_failures_total)
+	failovers=$(metric thermd_failovers_total)
+	wire=$(( $(metric thermd_wire_bytes_in_total) + $(metric thermd_wire_bytes_out_total) ))
+	awk -v name="$name" -v secs="$SECS" -v ticks="$ticks" -v requests="$requests" \
+	    -v failures="$failures" -v failovers="$failovers" -v wire="$wire" \
+	    -v p50="$(metric thermd_stage_quantile_seconds 'stage="tick",quantile="0.5"')" \
+	    -v p99="$(metric thermd_stage_quantile_seconds 'stage="tick",quantile="0.99"')" \
+	    -v tmax="$(metric thermd_stage_quantile_seconds 'stage="tick",quantile="1"')" \
+	    'BEGIN {
+		printf "%-10s %7d %8.1f %8d %9d %10.1f %9.2f %9.2f %9.2f\n", name, ticks,
+			requests / secs, failures, failovers, ticks ? wire / ticks : 0,
+			p50 * 1000, p99 * 1000, tmax * 1000
+	    }'
+}
+
+printf "%-10s %7s %8s %8s %9s %10s %9s %9s %9s\n" \
+	scenario ticks req/s failures failovers bytes/tick "p50 ms" "p99 ms" "max ms"
+run clean    "127.0.0.1:$PORT"
+run slow     "127.0.0.1:$PORT" -l 50 -j 150
+run errors   "127.0.0.1:$PORT" -e 20
+run drops    "127.0.0.1:$PORT" -d 10
+run failover "127.0.0.1:$DEAD_PORT, 127.0.0.1:$PORT"
@@ -10,7 +10,6 @@
 #include <syslog.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <curl/curl.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdint.h>
@@ -19,7 +18,26 @@
 #include <time.h>
 #include <errno.h>
 #include <signal.h>
+#include <sys/signalfd.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
 #include "cJSON.h"
+#include "sensor.h"
+#include "sampler.h"
+#include "control.h"
+#include "schedule.h"
+#include "tz.h"
+#include "zone.h"
+#include "net.h"
+#include "gateway.h"
+#include "ticker.h"
+#include "telemetry.h"
+#include "ctl.h"
+#include "metrics.h"
+#include "config.h"
+#include "endpoint.h"
+#include "replay.h"
+#include "notify.h"
 
 #define OK	0
 #define INIT_ERR 1
@@ -29,25 +47,25 @@
 #define ERR_FORK 5
 #define ERR_SETSID 6
 #define ERR_CHDIR 7
+/* written without waiting, the response is checked with a later request */
+#define REQ_SENT 8
 
 #define ERROR_FORMAT "Error: %s"
 
 #define DAEMON_NAME "thermd"
 
-#define BUFFER_SIZE 100
+/* Largest schedule accepted from the server */
+#define MAX_SETPOINTS 256
+#define SETPOINT_KEY_SIZE 16
 
-#define POST 0
-#define GET 1
-#define PUT 2
-#define DEL 3
+/* Log loop timing stats every this many seconds */
+#define STATS_LOG_PERIOD 3600
 
-#define NUM_SETPOINTS 3
-
-#define TMPFILENAME "/tmp/temp"
-#define STATUSFILENAME "/tmp/status"
-
-#define DEFAULT_ENDPOINT "18.234.11.129:9000"
-#define DEFAULT_LOGFILE "/var/log/thermd.log"
+/* Smoothing for each zone's rate of change, per tick */
+#define RATE_ALPHA 0.3
+/* Slowest drift low power mode assumes, degrees per second, so a flat
+ * reading can't put it to sleep for idle_max right before it moves */
+#define RATE_MIN 0.002
 
 typedef struct{
 	uint8_t hh;
@@ -56,41 +74,77 @@ typedef struct{
 }my_time_t;
 
 typedef struct {
-	my_time_t times[NUM_SETPOINTS];
-	my_time_t currenttime;
-	double temps[NUM_SETPOINTS];
+	tz_t tz;
+	zone_t *zones;
+	uint32_t nzones;
 }config_t;
 
 
 /* Function prototypes */
 void show_help(void);
-void read_configs(const char *);
-double read_temp_from_file(void);
-void parse_JSON(char *strJson, size_t nmemb);
-void update_current_TOD(void);
-double determine_set_point(void);
-void update_server(double read_temp, const char *status);
-void write_status_to_file(const char *status);
-int send_request(const char *URL, int8_t METHOD, const char *msg);
-bool string_starts_with(const char *string, const char *prefix);
+uint16_t parse_JSON(const char *strJson, setpoint_t *points);
+double determine_set_point(zone_t *zone);
+bool update_server(zone_t *zones, uint32_t count, double now);
+int send_request(const char *URL, int8_t METHOD, const char *msg, net_buffer_t *response);
 void string_to_time(char *timestr, my_time_t *t);
 
 static void _signal_handler(const int signal);
 static void _loop(void);
+static void start_zone(zone_t *zone);
+static bool fetch_schedules(net_buffer_t *response);
+static double next_poll_interval(double current, bool changed);
+static uint64_t next_wakeup(uint64_t now_ns, uint64_t next_poll, uint64_t next_post, uint64_t next_metrics, uint64_t next_watchdog);
+static void zone_tick(zone_t *zone, FILE *logFP);
+static void run_command(const ctl_command_t *cmd, uint64_t *next_post);
+static void reload_configs(void);
+static int simulate(const char *tracefile);
+static int replay(const char *tracefile);
+static int run_gateway(uint32_t devices);
+static void load_zones(void);
+static bool hup_pending(void);
+static int pool_request(int8_t method, const char *body, net_buffer_t *response);
+static void _gateway_signal_handler(const int signal);
+
+
+static void *counting_malloc(size_t size){
+	metrics_count(METRIC_ALLOCATIONS, 1);
+	return malloc(size);
+}
 
-
-char HTTP_ENDPOINT[BUFFER_SIZE];
-char LOGFILE[BUFFER_SIZE];
-
+static cJSON_Hooks json_hooks = { counting_malloc, free };
 
 config_t configs;
+ticker_t ticker;
+telemetry_t telemetry;
+thermd_health_t health;
+ctl_t ctl;
+/* swapped whole on a reload, only the control loop reads it */
+const thermd_config_t *cfg;
+/* kept for reloads */
+const char *config_path;
+/* SIGHUP arrives here instead of in a handler */
+int hup_fd = -1;
+/* servers from endpoint=, with their health and latency */
+endpoint_pool_t endpoints;
+/* set while --replay runs the loop on virtual time */
+replay_t *replaying;
 
 int main(uint32_t argc, char **argv){
 	uint32_t i;
+	sigset_t mask;
 
 
 	/* The configuration filename */
 	char *configfilename = "/etc/thermd/thermd.conf";
+	/* Recorded trace to replay through the controller instead of running */
+	char *tracefilename = NULL;
+	/* Scripted sensors and server to run the whole loop against on virtual time */
+	char *replayfilename = NULL;
+	/* Drive many simulated thermostats in the foreground instead of running */
+	bool gateway = false;
+	/* Stay attached for a service manager instead of forking, see README.txt */
+	bool foreground = false;
+	uint32_t gateway_devices = 0;
 
 
 	/* Parse command line arguments */
@@ -115,44 +169,98 @@ int main(uint32_t argc, char **argv){
 			}	
 			configfilename = argv[i];
 		}
+		else if (!strcmp(arg, "--simulate") || !strcmp(arg, "-s")){
+			i++;
+			if (i >= argc){
+				printf("no trace file argument specified\n");
+				return CLI_ERR;
+			}
+			tracefilename = argv[i];
+		}
+		else if (!strcmp(arg, "--replay") || !strcmp(arg, "-r")){
+			i++;
+			if (i >= argc){
+				printf("no replay file argument specified\n");
+				return CLI_ERR;
+			}
+			replayfilename = argv[i];
+		}
+		else if (!strcmp(arg, "--foreground") || !strcmp(arg, "-f")){
+			foreground = true;
+		}
+		else if (!strcmp(arg, "--gateway") || !strcmp(arg, "-g")){
+			gateway = true;
+			/* optional device count */
+			if (i + 1 < argc && atoi(argv[i + 1]) > 0){
+				gateway_devices = atoi(argv[++i]);
+			}
+		}
+	}
+
+	config_path = configfilename;
+	cfg = config_load(configfilename, stderr);
+	if (cfg == NULL){
+		printf("Error reading config file \"%s\"\n", configfilename);
+		return INIT_ERR;
 	}
 
-	read_configs(configfilename);
+	/* config_load already checked the list */
+	endpoint_pool_init(&endpoints, cfg->endpoint);
+
+	/* count cJSON's allocations with the rest */
+	cJSON_InitHooks(&json_hooks);
+
+	if (tracefilename != NULL){
+		return simulate(tracefilename);
+	}
+	if (gateway){
+		return run_gateway(gateway_devices);
+	}
+	if (replayfilename != NULL){
+		return replay(replayfilename);
+	}
+	load_zones();
 	//printf("%s\n", HTTP_ENDPOINT);
 	//printf("%s\n", LOGFILE);
 
-	/* Open log files */
-	openlog(DAEMON_NAME, LOG_PID | LOG_NDELAY | LOG_NOWAIT, LOG_DAEMON);
+	/* Open log files, in the foreground they go to stderr too */
+	openlog(DAEMON_NAME, LOG_PID | LOG_NDELAY | LOG_NOWAIT | (foreground ? LOG_PERROR : 0), LOG_DAEMON);
 
 	/* Writes to /var/log/syslog on x86 */
 	syslog(LOG_INFO, "started thermd!");
+
+	/* Load the zone rules once, time of day is arithmetic from here on */
+	tz_init(&configs.tz, cfg->timezone);
 	
 
-	/* We fork to prevent taking over init or syslog */
-	pid_t pid = fork();
+	/* We fork to prevent taking over init or syslog, under a service
+	 * manager that tracks the process itself it stays in the foreground */
+	if (!foreground){
+		pid_t pid = fork();
 	
-	/* Negative PID means an error */
-	if (pid < 0){
-		syslog(LOG_ERR, ERROR_FORMAT, strerror(errno));
-		return ERR_FORK;
-	}
+		/* Negative PID means an error */
+		if (pid < 0){
+			syslog(LOG_ERR, ERROR_FORMAT, strerror(errno));
+			return ERR_FORK;
+		}
 	
-	/* Parent */
-	if (pid > 0){
-		return OK;
-	}
+		/* Parent */
+		if (pid > 0){
+			return OK;
+		}
 
-	/* check session, and be the leader */	
-	if (setsid() < -1){
-		syslog(LOG_ERR, ERROR_FORMAT, strerror(errno));
-		return ERR_SETSID;
-	}		
+		/* check session, and be the leader */	
+		if (setsid() < -1){
+			syslog(LOG_ERR, ERROR_FORMAT, strerror(errno));
+			return ERR_SETSID;
+		}		
 		
 
-	/* Close file pointers */
-	close (STDIN_FILENO);
-	close (STDOUT_FILENO);
-	close (STDERR_FILENO);
+		/* Close file pointers */
+		close (STDIN_FILENO);
+		close (STDOUT_FILENO);
+		close (STDERR_FILENO);
+	}
 
 
 	/* Set the UMASK first, give us read/write and everyone else read permissions */
@@ -166,7 +274,21 @@ int main(uint32_t argc, char **argv){
 
 	/* Set up signal handler */
 	signal(SIGTERM, _signal_handler);
-	signal(SIGHUP, _signal_handler);
+
+	/* Reloading isn't safe inside a handler, block SIGHUP before any
+	 * thread starts so it queues on a signalfd the loop checks each tick */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGHUP);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+	hup_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (hup_fd < 0){
+		syslog(LOG_ERR, ERROR_FORMAT, strerror(errno));
+	}
+
+	/* READY=1 and the watchdog go to a service manager that asked for them */
+	if (notify_init() != NOTIFY_OK){
+		syslog(LOG_ERR, "Bad NOTIFY_SOCKET, not notifying the service manager\n");
+	}
 
 
 	/* main work loop */
@@ -181,90 +303,716 @@ int main(uint32_t argc, char **argv){
  *  Time code adopted from https://stackoverflow.com/questions/7411301/how-to-introduce-date-and-time-in-log-file
  */
 static void _loop(void){
-	/* Either holds "on" or "off" */
-	char heater_status[4];
-	double read_temp;
+	/* Reused for every GET so steady state doesn't allocate */
+	static net_buffer_t response;
+	sampler_t **samplers;
 	FILE *logFP;
+	uint32_t i;
+	/* what the sampler thread would have taken in one control period */
+	uint32_t replay_samples = (uint32_t)(cfg->sample_rate * cfg->control_period + 0.5);
+	double now, last_stats;
+	/* when each periodic job is next due, in ticker ns so a job whose
+	 * period is a whole number of ticks lands exactly on one */
+	uint64_t now_ns, next_poll = 0, next_post = 0, next_metrics = 0, next_watchdog = 0;
+	/* pinged at half the watchdog period, only from completed ticks */
+	double watchdog = notify_watchdog_period();
+	char ready[64];
+	uint64_t start, log_usec, tick_start;
+	uint64_t last_wakeups = 0, last_switches = 0, switches;
+	struct rusage usage;
+	/* power needs a restart, it decides which threads run, a replay
+	 * only takes the skipped ticks from it */
+	bool skip_idle = cfg->power == POWER_LOW;
+	bool low_power = skip_idle && replaying == NULL;
+	/* a replay would overwrite the running daemon's metrics file */
+	bool dump_metrics = strlen(cfg->metrics_file) && replaying == NULL;
+	double poll_interval = cfg->poll_min;
+	uint32_t version, last_version = 0;
+	bool fetched;
+	ctl_command_t cmd;
+
+	if (net_init() != NET_OK){
+		syslog(LOG_ERR, "Couldn't initialize curl\n");
+		closelog();
+		exit(1);
+	}
+	net_set_limits(cfg->connect_timeout, cfg->request_timeout, cfg->max_response);
+	net_set_tls(cfg->tls_ca, cfg->tls_verify);
+	net_set_compression(cfg->compress_threshold);
+	net_set_dns_ttl(cfg->dns_ttl);
+	net_set_client(cfg->http_client == HTTP_CLIENT_BUILTIN);
+
+	samplers = malloc(configs.nzones * sizeof(sampler_t *));
+	if (samplers == NULL){
+		closelog();
+		exit(1);
+	}
+	for (i = 0; i < configs.nzones; i++){
+		start_zone(&configs.zones[i]);
+		samplers[i] = &configs.zones[i].sampler;
+	}
+
+	/* Low power has no thread waking at the sample rate, each tick takes
+	 * its own burst instead, and the kernel may push wakeups back by
+	 * timer_slack to batch them with others */
+	if (low_power && prctl(PR_SET_TIMERSLACK, (unsigned long)(cfg->timer_slack * 1e9), 0, 0, 0) < 0){
+		syslog(LOG_INFO, "Couldn't set timer slack: %s\n", strerror(errno));
+	}
+
+	/* One thread acquires every zone at the sample rate, the loop below only sees the filtered values */
+	if (replaying == NULL && !low_power && sampler_start(samplers, configs.nzones, cfg->sample_rate) != SAMPLER_OK){
+		closelog();
+		exit(1);
+	}
+
+	/* Optional snapshot for local readers, published every tick, the control socket answers from it too */
+	if (replaying == NULL && (strlen(cfg->telemetry_shm) || strlen(cfg->control_socket)) &&
+	    telemetry_open(&telemetry, cfg->telemetry_shm, configs.zones, configs.nzones) != TELEMETRY_OK){
+		closelog();
+		exit(1);
+	}
+
+	/* Control, polling and telemetry each run on their own period off one absolute deadline ticker */
+	ticker_init(&ticker, cfg->control_period);
+	/* a sleeping loop still answers SIGHUP and the control socket at once */
+	if (low_power){
+		ticker_watch(&ticker, hup_fd);
+	}
+	if (replaying == NULL && strlen(cfg->control_socket) &&
+	    ctl_start(&ctl, cfg->control_socket, telemetry.shm, low_power ? ticker_wake_fd(&ticker) : -1) != CTL_OK){
+		closelog();
+		exit(1);
+	}
+
+	/* MAINPID for managers that started the parent of a forked daemon */
+	snprintf(ready, sizeof(ready), "READY=1\nMAINPID=%d", (int) getpid());
+	notify_send(ready);
+
+	last_stats = ticker_now();
 	while(1){
-		/* GET any new setpoints from the server */
-		logFP = fopen(LOGFILE, "a");
+		ticker_wait(&ticker);
+		tick_start = metrics_start();
+		metrics_count(METRIC_WAKEUPS, 1);
+		/* periods count from deadlines, not wakeups, so jitter doesn't stretch them */
+		now = ticker.deadline;
+		now_ns = ticker.deadline_ns;
+		/* a replay feeds the samplers and scripts the server for this tick */
+		if (replaying != NULL && replay_advance(replaying, now, configs.zones, configs.nzones,
+				replay_samples ? replay_samples : 1) != REPLAY_OK){
+			break;
+		}
+
+		/* overrides, reloads and flushes from the control socket */
+		while (ctl_next(&ctl, &cmd)){
+			run_command(&cmd, &next_post);
+		}
+		if (hup_pending()){
+			reload_configs();
+		}
+
+		start = metrics_start();
+		logFP = fopen(replaying != NULL ? "/dev/null" : cfg->logfile, "a");
 		if (logFP == NULL){
-			syslog(LOG_INFO, "Couldn't open %s for writing\n", LOGFILE);
+			syslog(LOG_INFO, "Couldn't open %s for writing\n", cfg->logfile);
 			exit(1);
 		}
-		while (send_request(HTTP_ENDPOINT, GET, NULL) == REQ_ERR){
+		log_usec = (metrics_start() - start) / 1000;
+
+		/* GET any new setpoints from the server */
+		if (now_ns >= next_poll){
+			fetched = fetch_schedules(&response);
+			version = 0;
+			for (i = 0; i < configs.nzones; i++){
+				version += configs.zones[i].schedule.version;
+			}
+			/* a failed poll retries at the fastest rate */
+			poll_interval = fetched ? next_poll_interval(poll_interval, version != last_version) : cfg->poll_min;
+			last_version = version;
+			next_poll = now_ns + ticker_ns(poll_interval);
+		}
+
+		/* read temperatures and make adjustments */
+		for (i = 0; i < configs.nzones; i++){
+			if (low_power){
+				sampler_poll(samplers[i], cfg->filter_window);
+			}
+			zone_tick(&configs.zones[i], logFP);
+		}
+		if (replaying != NULL){
+			replay_observe(replaying, configs.zones, configs.nzones);
+		}
+
+		/* Post the updates to the server, one request for all zones */
+		if (now_ns >= next_post && update_server(configs.zones, configs.nzones, now)){
+			next_post = now_ns + ticker_ns(cfg->telemetry_period);
+		}
+
+		/* the buffered log lines hit the file here */
+		start = metrics_start();
+		fclose(logFP);
+		metrics_record(METRIC_LOG, log_usec + (metrics_start() - start) / 1000);
+
+		if (dump_metrics && now_ns >= next_metrics){
+			if (metrics_dump(cfg->metrics_file) != METRICS_OK){
+				syslog(LOG_INFO, "Couldn't write metrics to %s\n", cfg->metrics_file);
+			}
+			next_metrics = now_ns + ticker_ns(cfg->metrics_period);
+		}
+
+		/* a stuck GET or sensor read never gets here, so the manager restarts it */
+		if (watchdog > 0 && now_ns >= next_watchdog){
+			notify_send("WATCHDOG=1");
+			next_watchdog = now_ns + ticker_ns(watchdog / 2);
+		}
+
+		/* sleep through the deadlines where nothing can change */
+		if (skip_idle){
+			ticker_skip_until(&ticker, next_wakeup(now_ns, next_poll, next_post,
+				dump_metrics ? next_metrics : 0, watchdog > 0 ? next_watchdog : 0));
+		}
+
+		metrics_stop(METRIC_TICK, tick_start);
+		health.ticks = ticker.ticks;
+		health.overruns = ticker.overruns;
+		health.jitter_max_ms = ticker.jitter_max;
+		telemetry_publish(&telemetry, configs.zones, configs.nzones, &health);
+
+		if (replaying == NULL && now >= last_stats + STATS_LOG_PERIOD){
+			getrusage(RUSAGE_SELF, &usage);
+			switches = usage.ru_nvcsw + usage.ru_nivcsw;
+			syslog(LOG_INFO, "loop: %llu ticks, %llu overruns, jitter avg %.2f ms max %.2f ms\n",
+				(unsigned long long) ticker.ticks, (unsigned long long) ticker.overruns,
+				ticker.jitter_sum / ticker.ticks, ticker.jitter_max);
+			syslog(LOG_INFO, "power: %llu wakeups/hour (%llu early), %llu context switches/hour\n",
+				(unsigned long long)((metrics_counter(METRIC_WAKEUPS) - last_wakeups) * 3600 / (now - last_stats)),
+				(unsigned long long) ticker.early,
+				(unsigned long long)((switches - last_switches) * 3600 / (now - last_stats)));
+			last_wakeups = metrics_counter(METRIC_WAKEUPS);
+			last_switches = switches;
+			last_stats = now;
+			syslog(LOG_INFO, "net: %llu requests, %llu reused connections, %llu TLS handshakes, %.3f s CPU saved, "
+				"%llu/%llu bytes in, %llu/%llu bytes out on the wire\n",
+				(unsigned long long) metrics_counter(METRIC_REQUESTS),
+				(unsigned long long) metrics_counter(METRIC_CONNECTIONS_REUSED),
+				(unsigned long long) metrics_counter(METRIC_TLS_HANDSHAKES),
+				metrics_counter(METRIC_TLS_CPU_SAVED) / 1e6,
+				(unsigned long long) metrics_counter(METRIC_WIRE_BYTES_IN),
+				(unsigned long long) metrics_counter(METRIC_BYTES_IN),
+				(unsigned long long) metrics_counter(METRIC_WIRE_BYTES_OUT),
+				(unsigned long long) metrics_counter(METRIC_BYTES_OUT));
+			for (i = 0; i < endpoints.count; i++){
+				syslog(LOG_INFO, "endpoint %s: rtt %.1f ms, health %.2f, %llu requests, %llu errors\n",
+					endpoints.list[i].url, endpoints.list[i].rtt * 1000, endpoints.list[i].health,
+					(unsigned long long) endpoints.list[i].requests,
+					(unsigned long long) endpoints.list[i].errors);
+			}
+		}
+	}
+	free(samplers);
+}
+
+
+/**
+ *  Carries out a command queued on the control socket
+ */
+static void run_command(const ctl_command_t *cmd, uint64_t *next_post){
+	zone_t *zone;
+	uint32_t i;
+
+	switch (cmd->type){
+		case CTL_OVERRIDE:
+			for (i = 0; i < configs.nzones; i++){
+				zone = &configs.zones[i];
+				if (strlen(cmd->zone) && strcmp(cmd->zone, zone->name)){
+					continue;
+				}
+				zone->override = !cmd->clear;
+				zone->override_temp = cmd->temp;
+				zone->override_until = cmd->duration > 0 ? ticker_now() + cmd->duration : 0;
+				if (cmd->clear){
+					syslog(LOG_INFO, "zone %s back on its schedule\n", zone->name);
+				}
+				else{
+					syslog(LOG_INFO, "zone %s held at %.2lf for %.0lf s\n", zone->name, cmd->temp, cmd->duration);
+				}
+			}
+			break;
+
+		case CTL_RELOAD:
+			reload_configs();
+			break;
+
+		case CTL_FLUSH:
+			/* posts every zone from this tick, changed or not */
+			for (i = 0; i < configs.nzones; i++){
+				configs.zones[i].reported = false;
+			}
+			*next_post = 0;
+			break;
+	}
+}
+
+
+/**
+ *  Opens the zone's sensor, which stays open for the life of the daemon
+ */
+static void start_zone(zone_t *zone){
+	/* replays feed the sampler themselves */
+	if (replaying == NULL && sensor_open(&zone->sensor, zone->sensor_spec, zone->fahrenheit) != SENSOR_OK){
+		syslog(LOG_INFO, "Sensor %s for zone %s not available, start thermocouple service\n", zone->sensor_spec, zone->name);
+		closelog();
+		exit(1);
+	}
+	if (status_open(&zone->status, zone->status_path, cfg->status_fsync, cfg->status_heartbeat) != STATUS_OK){
+		closelog();
+		exit(1);
+	}
+	control_init(&zone->control, &cfg->control);
+	sampler_init(&zone->sampler, replaying == NULL ? &zone->sensor : NULL, cfg->sample_rate, cfg->filter_type, cfg->filter_window, cfg->filter_alpha);
+}
+
+
+/**
+ *  GETs the schedule for every zone, zones that share a URL share one
+ *  request and one parse
+ *  A zone whose server doesn't answer keeps its current schedule until
+ *  the next poll, returns false if any GET failed
+ */
+static bool fetch_schedules(net_buffer_t *response){
+	static setpoint_t points[MAX_SETPOINTS];
+	/* the last poll failed, so this one is a retry */
+	static bool failed;
+	zone_t *zones = configs.zones;
+	uint32_t i, j;
+	uint16_t count;
+	uint64_t start;
+	int ret;
+	bool ok = true;
+
+	if (failed){
+		metrics_count(METRIC_RETRIES, 1);
+	}
+
+	for (i = 0; i < configs.nzones; i++){
+		for (j = 0; j < i; j++){
+			if (!strcmp(zones[j].url, zones[i].url)){
+				break;
+			}
+		}
+		if (j < i){
+			/* already fetched for an earlier zone */
+			continue;
+		}
+
+		health.polls++;
+		/* failed round trips count too, a timeout is exactly the tail we want to see */
+		start = metrics_start();
+		if (strlen(zones[i].url)){
+			ret = send_request(zones[i].url, GET, NULL, response);
+		}
+		else{
+			ret = pool_request(GET, NULL, response);
+		}
+		metrics_stop(METRIC_GET, start);
+		if (ret != OK){
 			syslog(LOG_INFO, "Server not available, re-trying\n");
-			sleep(1);
+			health.poll_failures++;
+			ok = false;
+			continue;
 		}
-		
-		/* read temperature and make adjustments */
-		read_temp = read_temp_from_file();
-		fprintf(logFP, "temperature is %lf\n", read_temp);
-		//printf("temperature is %lf\n", read_temp);
-	
 
-		double set_temp = determine_set_point();
-		fprintf(logFP, "Set point is %lf\n", set_temp);
-		//printf("Set point is %lf\n", set_temp);
+		/* parse covers compiling the lookup tables too */
+		start = metrics_start();
+		count = parse_JSON(response->data, points);
+		if (count == 0){
+			metrics_stop(METRIC_PARSE, start);
+			continue;
+		}
+		for (j = i; j < configs.nzones; j++){
+			/* Only rebuilds the lookup table when the schedule actually changed */
+			if (!strcmp(zones[j].url, zones[i].url) &&
+			    schedule_compile(&zones[j].schedule, points, count) != SCHEDULE_OK){
+				syslog(LOG_INFO, "Couldn't compile schedule for zone %s\n", zones[j].name);
+			}
+		}
+		metrics_stop(METRIC_PARSE, start);
+	}
+	failed = !ok;
+	return ok;
+}
+
 
-		if (set_temp < read_temp){
-			strncpy(heater_status, "OFF", 3);
-			heater_status[3] ='\0';
+/**
+ *  Picks the wait before the next schedule poll: poll_min within
+ *  poll_window of a scheduled transition or right after the schedule
+ *  changed, otherwise backing off by doubling up to poll_max
+ */
+static double next_poll_interval(double current, bool changed){
+	uint32_t secs, until = SECS_PER_WEEK, t;
+	uint32_t i;
+	uint8_t wday;
+	double next;
+
+	tz_local(&configs.tz, ticker_time(), &wday, &secs);
+	for (i = 0; i < configs.nzones; i++){
+		t = schedule_next_transition(&configs.zones[i].schedule, wday, secs);
+		if (t < until){
+			until = t;
+		}
+	}
+
+	if (changed || until <= cfg->poll_window){
+		return cfg->poll_min;
+	}
+	next = current * 2;
+	if (next > cfg->poll_max){
+		next = cfg->poll_max;
+	}
+	/* don't back off past the start of the next fast window */
+	if (next > until - cfg->poll_window){
+		next = until - cfg->poll_window;
+	}
+	return next < cfg->poll_min ? cfg->poll_min : next;
+}
+
+
+/**
+ *  Low power mode's next tick: the soonest of the next poll, post,
+ *  metrics dump or watchdog ping, a schedule transition, an override running out, a
+ *  status heartbeat, and the time a zone's temperature could cross its
+ *  switching point at the rate it's moving (halved, for margin), capped
+ *  at idle_max. A zone that could switch now keeps the normal period.
+ *  With report=change the post only counts while posts are held back by
+ *  telemetry_period, and each zone adds its report heartbeat and the
+ *  time it could drift report_delta from what was last sent.
+ *  Times in and out are ticker ns.
+ */
+static uint64_t next_wakeup(uint64_t now_ns, uint64_t next_poll, uint64_t next_post, uint64_t next_metrics, uint64_t next_watchdog){
+	double now = now_ns / 1e9;
+	double next = now + cfg->idle_max;
+	double t, margin, rate, drift;
+	uint64_t wake;
+	uint32_t secs, until;
+	uint32_t i;
+	uint8_t wday;
+	zone_t *zone;
+
+	tz_local(&configs.tz, ticker_time(), &wday, &secs);
+	for (i = 0; i < configs.nzones; i++){
+		zone = &configs.zones[i];
+		if (!zone->valid){
+			return now_ns;
+		}
+		until = schedule_next_transition(&zone->schedule, wday, secs);
+		if (now + until < next){
+			next = now + until;
+		}
+		if (zone->override && zone->override_until > now && zone->override_until < next){
+			next = zone->override_until;
+		}
+		if (zone->status.heartbeat > 0){
+			t = zone->status.last_time + zone->status.heartbeat;
+			if (t < next){
+				next = t;
+			}
+		}
+		margin = control_margin(&zone->control, zone->setpoint, zone->temp);
+		if (margin <= 0){
+			return now_ns;
 		}
-		else if (set_temp > read_temp){
-			strncpy(heater_status, "ON", 2);
-			heater_status[2] ='\0';
+		rate = zone->rate < 0 ? -zone->rate : zone->rate;
+		rate = rate > RATE_MIN ? rate : RATE_MIN;
+		t = now + margin / rate / 2;
+		if (t < next){
+			next = t;
 		}
+		if (cfg->report == REPORT_CHANGE && zone->reported){
+			drift = zone->temp - zone->reported_temp;
+			drift = drift < 0 ? -drift : drift;
+			t = now + (cfg->report_delta - drift) / rate;
+			if (zone->reported_time + cfg->report_heartbeat < t){
+				t = zone->reported_time + cfg->report_heartbeat;
+			}
+			if (t < next){
+				next = t;
+			}
+		}
+	}
 
-		write_status_to_file(heater_status);
+	/* the periodic jobs are exact, the estimates above needn't be */
+	wake = ticker_ns(next);
+	if (next_poll < wake){
+		wake = next_poll;
+	}
+	/* report=change leaves it behind while there's nothing to post */
+	if (next_post > now_ns && next_post < wake){
+		wake = next_post;
+	}
+	if (next_metrics > 0 && next_metrics < wake){
+		wake = next_metrics;
+	}
+	if (next_watchdog > 0 && next_watchdog < wake){
+		wake = next_watchdog;
+	}
+	return wake;
+}
 
-		//printf("status is %s\n", heater_status);
-		/* Post the updates to the server */
-		update_server(read_temp, heater_status);
 
-		fclose(logFP);
+/**
+ *  Runs one control decision for a zone and publishes its status
+ */
+static void zone_tick(zone_t *zone, FILE *logFP){
+	/* named zones get their name in front of every log line */
+	const char *prefix = configs.nzones > 1 ? zone->name : "";
+	const char *sep = configs.nzones > 1 ? ": " : "";
+	uint64_t start;
+	double now = ticker_now();
+
+	if (sampler_get(&zone->sampler, &zone->temp) != SAMPLER_OK){
+		syslog(LOG_INFO, "Couldn't read sensor %s, skipping\n", zone->sensor_spec);
+		zone->valid = false;
+		return;
+	}
+	/* rate_time is 0 until the first reading */
+	if (zone->rate_time > 0 && now > zone->rate_time){
+		zone->rate += RATE_ALPHA * ((zone->temp - zone->rate_temp) / (now - zone->rate_time) - zone->rate);
+	}
+	zone->rate_temp = zone->temp;
+	zone->rate_time = now;
+	fprintf(logFP, "%s%stemperature is %lf\n", prefix, sep, zone->temp);
+
+	zone->setpoint = determine_set_point(zone);
+	fprintf(logFP, "%s%sSet point is %lf\n", prefix, sep, zone->setpoint);
+
+	start = metrics_start();
+	zone->heater_on = control_update(&zone->control, now, zone->setpoint, zone->temp);
+	metrics_stop(METRIC_CONTROL, start);
+	zone->valid = true;
+
+	/* only written on a change or at the heartbeat */
+	start = metrics_start();
+	status_publish(&zone->status, zone->heater_on, now);
+	metrics_stop(METRIC_STATUS, start);
+}
+
 
-		sleep(1);
+
+/**
+ *  Replays a recorded temperature trace through the configured controller
+ *  and prints cycle counts and overshoot, without daemonizing
+ */
+static int simulate(const char *tracefile){
+	FILE *traceFP = fopen(tracefile, "r");
+	int ret;
+	if (traceFP == NULL){
+		printf("Error opening trace file \"%s\"\n", tracefile);
+		return CLI_ERR;
 	}
+	ret = control_replay(&cfg->control, traceFP, stdout);
+	fclose(traceFP);
+	return ret == CONTROL_OK ? OK : CLI_ERR;
+}
 
+/**
+ *  Runs the daemon's loop against a replay trace on virtual time, as
+ *  fast as it goes, in the foreground. Heater decisions are printed as
+ *  they happen, then a summary and the real time each stage took.
+ *  Status files go to a scratch directory, the log to /dev/null and the
+ *  metrics file isn't written, so a replay can run next to the real daemon.
+ */
+static int replay(const char *tracefile){
+	char dir[] = "/tmp/thermd-replay.XXXXXX";
+	char path[ZONE_PATH_SIZE];
+	replay_t trace;
+	uint64_t start;
+	uint32_t i;
+
+	load_zones();
+	if (replay_open(&trace, tracefile, configs.zones, configs.nzones, stdout) != REPLAY_OK){
+		replay_close(&trace);
+		return CLI_ERR;
+	}
+	if (mkdtemp(dir) == NULL){
+		printf("Couldn't create %s\n", dir);
+		replay_close(&trace);
+		return CLI_ERR;
+	}
+	for (i = 0; i < configs.nzones; i++){
+		snprintf(configs.zones[i].status_path, ZONE_PATH_SIZE, "%s/%s", dir, configs.zones[i].name);
+	}
+
+	ticker_set_virtual(trace.start);
+	tz_init(&configs.tz, cfg->timezone);
+	replaying = &trace;
+	start = metrics_start();
+	_loop();
+	replay_report(&trace, configs.zones, configs.nzones, (metrics_start() - start) / 1e9);
+	replaying = NULL;
+
+	metrics_summary(stdout);
+
+	for (i = 0; i < configs.nzones; i++){
+		snprintf(path, sizeof(path), "%s/%s", dir, configs.zones[i].name);
+		unlink(path);
+	}
+	rmdir(dir);
+	replay_close(&trace);
+	return OK;
 }
 
+/**
+ *  Runs gateway mode in the foreground against the endpoint and prints
+ *  achieved ticks/sec and tick latency
+ */
+static int run_gateway(uint32_t devices){
+	gateway_params_t params = cfg->gateway;
+	int ret;
+
+	openlog(DAEMON_NAME, LOG_PID | LOG_NDELAY | LOG_NOWAIT, LOG_DAEMON);
+	tz_init(&params.tz, cfg->timezone);
+	if (net_init() != NET_OK){
+		printf("Couldn't initialize curl\n");
+		return INIT_ERR;
+	}
+	if (devices > 0){
+		params.devices = devices;
+	}
+	params.url = endpoints.list[0].url;
+	params.control = cfg->control;
+	params.parse = parse_JSON;
+
+	signal(SIGINT, _gateway_signal_handler);
+	signal(SIGTERM, _gateway_signal_handler);
+	ret = gateway_run(&params, stdout);
 
+	net_cleanup();
+	closelog();
+	return ret == GATEWAY_OK ? OK : INIT_ERR;
+}
 
+static void _gateway_signal_handler(const int signal){
+	gateway_stop();
+}
 
 /**
- *  Posts the last read temperature and status to the server
+ *  Builds the report for one zone
  */
-void update_server(double read_temp, const char *status){
+static cJSON *zone_report(zone_t *zone, bool named){
 	char buffer[20];
+	cJSON *item = cJSON_CreateObject();
 
-	snprintf(buffer, sizeof(buffer),  "%0.2lf", read_temp);
-	cJSON *root = cJSON_CreateObject();
-	
-	cJSON_AddItemToObject(root, "current_temp", cJSON_CreateString(buffer));
-	cJSON_AddItemToObject(root, "status", cJSON_CreateString(status));
+	snprintf(buffer, sizeof(buffer),  "%0.2lf", zone->temp);
+	if (named){
+		cJSON_AddItemToObject(item, "zone", cJSON_CreateString(zone->name));
+	}
+	cJSON_AddItemToObject(item, "current_temp", cJSON_CreateString(buffer));
+	cJSON_AddItemToObject(item, "status", cJSON_CreateString(zone->heater_on ? "ON" : "OFF"));
+	return item;
+}
 
-	
+/**
+ *  True if the zone's last tick should go to the server. report=change
+ *  leaves a zone out while its temperature is within report_delta of
+ *  what was last sent, its heater hasn't flipped and report_heartbeat
+ *  hasn't passed.
+ */
+static bool report_due(const zone_t *zone, double now){
+	double drift = zone->temp - zone->reported_temp;
 
-	send_request(HTTP_ENDPOINT, POST, cJSON_Print(root));
-	cJSON_Delete(root);
+	if (!zone->valid){
+		return false;
+	}
+	if (cfg->report == REPORT_ALWAYS || !zone->reported){
+		return true;
+	}
+	drift = drift < 0 ? -drift : drift;
+	return drift > cfg->report_delta || zone->heater_on != zone->reported_on ||
+		now - zone->reported_time >= cfg->report_heartbeat;
 }
 
 /**
- * Writes the heater status to the file
+ *  Posts the last read temperature and status to the server
+ *  A single unnamed zone posts the original {"current_temp", "status"}
+ *  object, otherwise all zones go up in one {"zones": [...]} batch.
+ *  With report=change only the zones report_due() picks go up, with a
+ *  "seq" that counts up by one per post so the server can tell a lost
+ *  post from a quiet zone. Returns false if there was nothing to post.
  */
-void write_status_to_file(const char *status){
-	FILE *statusFP = fopen(STATUSFILENAME, "w");
-	unsigned long timestamp = (unsigned long) time(NULL);	
-	fprintf(statusFP, "%s : %lu", status, timestamp);
-	fclose(statusFP);
+bool update_server(zone_t *zones, uint32_t count, double now){
+	/* from 1 at every start, so the server also sees restarts */
+	static uint64_t seq;
+	/* report=change only marks zones reported once the server took the
+	 * post, asking for the reply keeps the built-in client from writing
+	 * it behind and learning that a request later */
+	static net_buffer_t reply;
+	cJSON *root, *array;
+	char *body;
+	uint32_t i;
+	uint64_t start;
+	bool any = false;
+	int ret;
+
+	for (i = 0; i < count; i++){
+		if (zones[i].valid && !report_due(&zones[i], now)){
+			metrics_count(METRIC_REPORTS_SKIPPED, 1);
+		}
+	}
+	if (count == 1 && !strcmp(zones[0].name, DEFAULT_ZONE_NAME)){
+		if (!report_due(&zones[0], now)){
+			return false;
+		}
+		root = zone_report(&zones[0], false);
+	}
+	else{
+		root = cJSON_CreateObject();
+		array = cJSON_CreateArray();
+		for (i = 0; i < count; i++){
+			if (report_due(&zones[i], now)){
+				cJSON_AddItemToArray(array, zone_report(&zones[i], true));
+				any = true;
+			}
+		}
+		cJSON_AddItemToObject(root, "zones", array);
+		if (!any){
+			cJSON_Delete(root);
+			return false;
+		}
+	}
+	if (cfg->report == REPORT_CHANGE){
+		cJSON_AddNumberToObject(root, "seq", ++seq);
+	}
+
+	body = cJSON_PrintUnformatted(root);
+	health.posts++;
+	start = metrics_start();
+	ret = pool_request(POST, body, cfg->report == REPORT_CHANGE ? &reply : NULL);
+	if (ret != OK && ret != REQ_SENT){
+		/* still unreported, so they go again next period */
+		health.post_failures++;
+	}
+	else{
+		for (i = 0; i < count; i++){
+			if (report_due(&zones[i], now)){
+				zones[i].reported = true;
+				zones[i].reported_temp = zones[i].temp;
+				zones[i].reported_on = zones[i].heater_on;
+				zones[i].reported_time = now;
+			}
+		}
+	}
+	/* earlier posts whose responses came back as errors */
+	health.post_failures += net_deferred_failures();
+	metrics_stop(METRIC_POST, start);
+	free(body);
+	cJSON_Delete(root);
+	return true;
 }
 
 /**
  *   Takes a time string of the format "HH:MM:SS" to a time_t struct 
  */
 void string_to_time(char *timestr, my_time_t *t){
-	int hh, mm, ss;
+	int hh = 0, mm = 0, ss = 0;
 	sscanf(timestr, "%d:%d:%d", &hh, &mm, &ss);
 	t->hh = hh;
 	t->mm = mm;
@@ -272,186 +1020,197 @@ void string_to_time(char *timestr, my_time_t *t){
 }
 
 
-int32_t my_difftime( my_time_t *now, my_time_t *other){
-	uint32_t nowsecs= now->hh * 3600 + now->mm * 60 + now->ss;
-	uint32_t othersecs= other->hh * 3600 + other->mm * 60 + other->ss;
-	return nowsecs - othersecs;
-}
-
 /**
- * Looks at the setpoints and current time to figure out which one to use
+ * Looks at the zone's compiled schedule and current time to figure out which set point to use
  */
-double determine_set_point(void){
-	/* first sort the set points based on time of day */
-	int i, j;
-	my_time_t tmptime;
-	double tmptemp;
-		
-	/* bubble sort is ok since small number of setpoints */
-	for (i = 0; i < NUM_SETPOINTS; i++){
-		for (j = i; j < NUM_SETPOINTS; j++){
-			if (my_difftime(&configs.times[j], &configs.times[i]) < 0){
-				tmptime = configs.times[j];	
-				configs.times[j] = configs.times[i];
-				configs.times[i] = tmptime;
-
-				tmptemp = configs.temps[j];
-				configs.temps[j] = configs.temps[i];
-				configs.temps[i] = tmptemp;
-			}
-		}
-	}
-
-	/**
-	for(i = 0; i < NUM_SETPOINTS; i++){
-		syslog(LOG_INFO, "time %d is %d:%d:%d\n", i, configs.times[i].hh, configs.times[i].mm, configs.times[i].ss); 
-		//printf("time %d is %d:%d:%d\n", i, configs.times[i].hh, configs.times[i].mm, configs.times[i].ss); 
-	}	
-	//printf("time right now is %d:%d:%d\n",  configs.currenttime.hh, configs.currenttime.mm, configs.currenttime.ss); 
-	syslog(LOG_INFO, "time right now is %d:%d:%d\n",  configs.currenttime.hh, configs.currenttime.mm, configs.currenttime.ss); 
-	*/
+double determine_set_point(zone_t *zone){
+	uint32_t secs;
+	uint8_t wday;
 
-	/* now find the latest time that the current time is greater than by searching backwards */
-	for (i = NUM_SETPOINTS - 1; i >= 0; i--){
-		/* if diff time is positive, currenttime is later */
-
-		double diff = my_difftime( &configs.currenttime, &configs.times[i]);
-		if (diff > 0){
-			return configs.temps[i];
+	if (zone->override){
+		if (zone->override_until == 0 || ticker_now() < zone->override_until){
+			return zone->override_temp;
 		}
+		/* held long enough, back to the schedule */
+		zone->override = false;
 	}
-
-	/* else assume the first temp is the set point */
-	return configs.temps[0];
-
+	tz_local(&configs.tz, ticker_time(), &wday, &secs);
+	return schedule_lookup(&zone->schedule, wday, secs);
 }
 
 
-/** 
- *  Parses the JSON from the server and updates the configs accordingly
+/**
+ * Reads a setpoint temperature, the server sends them as strings but accept numbers too
  */
-void parse_JSON(char *strJson, size_t nmemb){
-	cJSON *root = cJSON_Parse(strJson);
-
-	/* Update the time settings based on JSON received */
-	char *time1str = cJSON_GetObjectItem(root, "time1")->valuestring;
-	char *time2str = cJSON_GetObjectItem(root, "time2")->valuestring;
-	char *time3str = cJSON_GetObjectItem(root, "time3")->valuestring;
-	string_to_time(time1str, &configs.times[0]);
-	string_to_time(time2str, &configs.times[1]);
-	string_to_time(time3str, &configs.times[2]);
-	//printf("Time1 is %s\n", ctime(&time1));
-	//printf("Time1 is %s\n", ctime(&time2));
-	//printf("Time1 is %s\n", ctime(&time3));
-
-
-	/* Update the temp settings based on JSON */
-	char *temp1str = cJSON_GetObjectItem(root, "temp1")->valuestring;
-	char *temp2str = cJSON_GetObjectItem(root, "temp2")->valuestring;
-	char *temp3str = cJSON_GetObjectItem(root, "temp3")->valuestring;
-	configs.temps[0] = atoi(temp1str);
-	configs.temps[1] = atoi(temp2str);
-	configs.temps[2] = atoi(temp3str);
-	//printf("temp1: %lf\n", configs.temp1);
-	//printf("temp2: %lf\n", configs.temp2);
-	//printf("temp3: %lf\n", configs.temp3);
-	
-	/* Get the current time */
-	update_current_TOD();
+static double json_temp(cJSON *item){
+	if (cJSON_IsNumber(item)){
+		return item->valuedouble;
+	}
+	return atof(item->valuestring);
+}
 
+/**
+ * Reads the days of an entry, either a mask (bit 0 is Sunday), a string
+ * like "mon,wed,fri" or "weekdays", or an array of day names
+ * Entries without days apply every day
+ */
+static uint8_t json_days(cJSON *item){
+	cJSON *day;
+	uint8_t mask = 0;
 
-	cJSON_Delete(root);
+	if (item == NULL){
+		return DAYS_ALL;
+	}
+	if (cJSON_IsNumber(item)){
+		return item->valueint & DAYS_ALL;
+	}
+	if (cJSON_IsString(item)){
+		return schedule_days_from_string(item->valuestring);
+	}
+	if (cJSON_IsArray(item)){
+		cJSON_ArrayForEach(day, item){
+			if (cJSON_IsString(day)){
+				mask |= schedule_days_from_string(day->valuestring);
+			}
+		}
+	}
+	return mask;
 }
 
+/**
+ * Reads the weekly "schedule" array of {"days", "time", "temp"} entries
+ */
+static uint16_t parse_schedule(cJSON *array, setpoint_t *points){
+	cJSON *entry, *timeItem, *tempItem;
+	my_time_t t;
+	uint16_t count = 0;
+
+	cJSON_ArrayForEach(entry, array){
+		if (count == MAX_SETPOINTS){
+			syslog(LOG_INFO, "Schedule has more than %d entries, ignoring the rest\n", MAX_SETPOINTS);
+			break;
+		}
+		timeItem = cJSON_GetObjectItem(entry, "time");
+		tempItem = cJSON_GetObjectItem(entry, "temp");
+		if (!cJSON_IsString(timeItem) || (!cJSON_IsString(tempItem) && !cJSON_IsNumber(tempItem))){
+			continue;
+		}
+		string_to_time(timeItem->valuestring, &t);
+		points[count].days = json_days(cJSON_GetObjectItem(entry, "days"));
+		points[count].secs = t.hh * 3600 + t.mm * 60 + t.ss;
+		points[count].temp = json_temp(tempItem);
+		if (points[count].days != 0){
+			count++;
+		}
+	}
+	return count;
+}
 
 /**
- * Updates vairable currenttime with the current time of day
+ * Reads the daily time1/temp1, time2/temp2, ... keys for as many as the server sends
  */
-void update_current_TOD(void){
-	struct tm * mytime;
-	time_t currenttime;
+static uint16_t parse_daily_setpoints(cJSON *root, setpoint_t *points){
+	char key[SETPOINT_KEY_SIZE];
+	cJSON *timeItem, *tempItem;
+	my_time_t t;
+	uint16_t count;
+
+	for (count = 0; count < MAX_SETPOINTS; count++){
+		snprintf(key, sizeof(key), "time%u", count + 1);
+		timeItem = cJSON_GetObjectItem(root, key);
+		snprintf(key, sizeof(key), "temp%u", count + 1);
+		tempItem = cJSON_GetObjectItem(root, key);
+		if (!cJSON_IsString(timeItem) || (!cJSON_IsString(tempItem) && !cJSON_IsNumber(tempItem))){
+			break;
+		}
+		string_to_time(timeItem->valuestring, &t);
+		points[count].days = DAYS_ALL;
+		points[count].secs = t.hh * 3600 + t.mm * 60 + t.ss;
+		points[count].temp = json_temp(tempItem);
+	}
+	return count;
+}
 
-	time ( &currenttime );
-	mytime = localtime ( &currenttime );
+/** 
+ *  Parses the JSON from the server into points, returns how many there are
+ *  A weekly "schedule" array takes precedence over the daily timeN/tempN keys
+ */
+uint16_t parse_JSON(const char *strJson, setpoint_t *points){
+	cJSON *root;
+	cJSON *array;
+	uint16_t count;
+
+	if (strJson == NULL || (root = cJSON_Parse(strJson)) == NULL){
+		syslog(LOG_INFO, "Couldn't parse schedule from server\n");
+		return 0;
+	}
 
-	configs.currenttime.hh = mytime->tm_hour;
-	/* If we're already past midnight, need to adjust */
-	if (configs.currenttime.hh <= 6){
-		configs.currenttime.hh += 24;
+	array = cJSON_GetObjectItem(root, "schedule");
+	if (cJSON_IsArray(array)){
+		count = parse_schedule(array, points);
+	}
+	else{
+		count = parse_daily_setpoints(root, points);
 	}
-	/* Offset for Mountain time zone */
-	configs.currenttime.hh -= 6;
-	configs.currenttime.mm = mytime->tm_min;
-	configs.currenttime.ss = mytime->tm_sec;
 
+	cJSON_Delete(root);
+	return count;
 }
 
+
 /**
- * curl GET callback
+ *  Sends a request to the best server in the endpoint pool, and on a
+ *  failure straight on to the next best, so a dead server costs one
+ *  connect timeout in a tick rather than a tick
  */
-size_t get_callback(void *ptr, size_t size, size_t nmemb, void *stream){
-	//printf("%s\n", (char *)ptr);
-
-	parse_JSON(ptr, nmemb); 
-	/* Must return number of bytes actually taken care of, otherwise we get an error */
-	return size * nmemb;
+static int pool_request(int8_t method, const char *body, net_buffer_t *response){
+	uint32_t tried = 0;
+	double start;
+	int i, ret = REQ_ERR;
+
+	while ((i = endpoint_pick(&endpoints, ticker_now(), tried)) >= 0){
+		if (tried != 0){
+			metrics_count(METRIC_FAILOVERS, 1);
+			syslog(LOG_INFO, "failing over to %s\n", endpoints.list[i].url);
+		}
+		tried |= 1u << i;
+		start = ticker_now();
+		ret = send_request(endpoints.list[i].url, method, body, response);
+		if (ret != REQ_SENT){
+			/* a write alone says nothing about the endpoint's latency */
+			endpoint_report(&endpoints, i, ret == OK, ticker_now() - start, ticker_now());
+		}
+		if (ret != REQ_ERR){
+			break;
+		}
+	}
+	return ret;
 }
 
 /**
- *  Sends an HTTP request 
+ *  Sends an HTTP request over the shared connection pool
  *  @params 
  *  URL: the url to send the request to
  *  METHOD: the HTTP method to send i.e. GET, POST, PUT, DELETE
  *  msg: the post parameters to send 
+ *  response: where to put the response body, NULL to discard it
  */
-int send_request(const char *URL, int8_t METHOD, const char *msg){
-	CURL 	*curl;
-	CURLcode res;
-	//char *s = malloc(1);
-	//*s = '\0';
-
-	curl = curl_easy_init();
-	if (curl){
-		curl_easy_setopt(curl, CURLOPT_URL, URL);
-		/* Setup based on the method */
-		switch (METHOD){
-			case DEL:
-				curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "DELETE");
-				// no break, we want delete to fall through and set post params too
-			case POST:
-    				curl_easy_setopt(curl, CURLOPT_POSTFIELDS,
-				    msg);	
-				break;
+int send_request(const char *URL, int8_t METHOD, const char *msg, net_buffer_t *response){
+	int ret = replaying != NULL ? replay_request(replaying, METHOD, msg, response) : net_request(URL, METHOD, msg, response);
 
-			case GET:
-				//curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
-				curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, get_callback);
-				//curl_easy_setopt(curl, CURLOPT_WRITEDATA, s);
-				break;
-			
-			case PUT:
-				curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "PUT");
-    				curl_easy_setopt(curl, CURLOPT_POSTFIELDS,
-				    msg);	
-				break;
-			default:
-				printf("Invalid Method\n");
-				return METHOD_ERR;
-		}
-
-		res = curl_easy_perform(curl);
-		
-		//printf("res is %d\n", res);
-		if (res != CURLE_OK){
-			syslog(LOG_INFO, "Could not connect - double check server and URL\n");
+	switch (ret){
+		case NET_OK:
+			return OK;
+		case NET_SENT:
+			return REQ_SENT;
+		case NET_METHOD_ERR:
+			syslog(LOG_INFO, "Invalid Method\n");
+			return METHOD_ERR;
+		case NET_REQ_ERR:
 			return REQ_ERR;
-		}
-		curl_easy_cleanup(curl);
-	}
-	else{
-		return INIT_ERR;
+		default:
+			return INIT_ERR;
 	}
-	return OK;
 }
 
 
@@ -466,101 +1225,110 @@ void show_help(void){
 		"Usage: thermd --config [configfile] 		 \n"
 		"                                                \n"
 		"-c, --config specify a config file              \n"
+		"-s, --simulate [tracefile] replay a recorded     \n"
+		"    temperature trace through the controller     \n"
+		"-r, --replay [tracefile] run the whole loop on   \n"
+		"    virtual time against scripted sensors and    \n"
+		"    server responses                             \n"
+		"-f, --foreground don't fork, for service         \n"
+		"    managers (systemd Type=notify)               \n"
+		"-g, --gateway [devices] drive simulated         \n"
+		"    thermostats against the endpoint             \n"
 		"-h, --help show this help menu                   \n"
 	);
 }
 
 
 /**
- * Adopted from https://stackoverflow.com/questions/4770985/how-to-check-if-a-string-starts-with-another-string-in-c 
+ * Builds the runtime zones from the config
  */
-bool string_starts_with(const char *string, const char *prefix){
-	while( *prefix){
-		if ( *prefix++ != *string++){
-			return 0;
-		}
+static void load_zones(void){
+	zone_t *zone;
+	uint32_t i;
+
+	configs.zones = calloc(cfg->nzones, sizeof(zone_t));
+	if (configs.zones == NULL){
+		printf("Out of memory reading zones\n");
+		exit(1);
+	}
+	configs.nzones = cfg->nzones;
+	for (i = 0; i < cfg->nzones; i++){
+		zone = &configs.zones[i];
+		strncpy(zone->name, cfg->zones[i].name, ZONE_NAME_SIZE - 1);
+		strncpy(zone->sensor_spec, cfg->zones[i].sensor, ZONE_PATH_SIZE - 1);
+		zone->fahrenheit = cfg->zones[i].fahrenheit;
+		strncpy(zone->status_path, cfg->zones[i].status, ZONE_PATH_SIZE - 1);
+		strncpy(zone->url, cfg->zones[i].url, ZONE_PATH_SIZE - 1);
 	}
-	return 1;
 }
 
-
-/** 
- * read the config file 
- * populates HTTP_ENDPOINT and LOGFILE with contents of logfile
+/**
+ * Re-reads the config file for the running daemon and swaps the new
+ * config in, a file that doesn't load leaves the running one alone
+ * Runs between ticks, so no request is in flight: the last tick's
+ * requests finished on the old endpoint and the next ones use the new.
+ * The endpoint, zone urls, log file, timezone, control tuning, periods
+ * and the status heartbeat change at once. Zones, sensors, sampling,
+ * power and timer_slack, and the shared memory/socket/metrics paths
+ * need a restart.
  */
-void read_configs(const char *configfile){
-	FILE *fp = fopen(configfile, "r");
-	char *equalsIdx;
-	char *line = NULL;
-	size_t len = 0;
-	ssize_t read;
-	if (fp == NULL){
-		printf("Error opening config file \"%s\"\n", configfile);
-		exit(1);
-	}
+static void reload_configs(void){
+	thermd_config_t *next = config_load(config_path, NULL);
+	const thermd_config_t *old = cfg;
+	zone_t *zones = configs.zones;
+	uint32_t i;
 
-	while((read = getline(&line, &len, fp)) != -1){
-		equalsIdx = strchr(line, '=');
-		equalsIdx++;
-		
-		if ((line + strlen(line)) - equalsIdx > BUFFER_SIZE){
-			printf("Config file contents too large...\n");
-			exit(1);		
-		}
-		
-		/* Parse the configs */
-		if(string_starts_with(line, "endpoint")){
-			strncpy(HTTP_ENDPOINT, equalsIdx, BUFFER_SIZE);
-			//printf("%s\n", HTTP_ENDPOINT);
-			/* Change last character to null instead of new line */
-			HTTP_ENDPOINT [ strlen(HTTP_ENDPOINT) - 1 ] = 0;
-		}
-		else if(string_starts_with(line, "logfile")){
-			strncpy(LOGFILE, equalsIdx, BUFFER_SIZE);
-			//printf("%s\n", LOGFILE);
-			/* Change last character to null instead of new line */
-			LOGFILE [ strlen(LOGFILE) - 1 ] = 0;
-		}
+	if (next == NULL){
+		syslog(LOG_ERR, "Couldn't reload %s, keeping the running config\n", config_path);
+		return;
 	}
 
-	/* If not set, use defaults */
-	if (strlen(HTTP_ENDPOINT) == 0){
-		strncpy(HTTP_ENDPOINT, DEFAULT_ENDPOINT, BUFFER_SIZE);
+	for (i = 0; i < configs.nzones && i < next->nzones && !strcmp(next->zones[i].name, zones[i].name); i++){
+		strncpy(zones[i].url, next->zones[i].url, ZONE_PATH_SIZE - 1);
+		control_set_params(&zones[i].control, &next->control);
+		zones[i].status.heartbeat = next->status_heartbeat;
+	}
+	if (i < configs.nzones || next->nzones != configs.nzones){
+		syslog(LOG_INFO, "zones changed in %s, restart thermd to apply\n", config_path);
+	}
+	if (strcmp(next->timezone, old->timezone)){
+		tz_init(&configs.tz, next->timezone);
+	}
+	net_set_limits(next->connect_timeout, next->request_timeout, next->max_response);
+	net_set_tls(next->tls_ca, next->tls_verify);
+	net_set_compression(next->compress_threshold);
+	net_set_dns_ttl(next->dns_ttl);
+	net_set_client(next->http_client == HTTP_CLIENT_BUILTIN);
+	if (strcmp(next->endpoint, old->endpoint)){
+		endpoint_pool_init(&endpoints, next->endpoint);
 	}
-	if (strlen(LOGFILE) == 0){
-		strncpy(LOGFILE, DEFAULT_LOGFILE, BUFFER_SIZE);
+	if (next->control_period != old->control_period){
+		ticker_set_period(&ticker, next->control_period);
 	}
 
-	free(line);
-	fclose(fp);
+	__atomic_store_n(&cfg, next, __ATOMIC_RELEASE);
+	config_free((thermd_config_t *) old);
+	syslog(LOG_INFO, "reloaded %s\n", config_path);
 }
 
-
-/** 
- * read the latest temperature from the TMPFILENAME
+/**
+ * True if a SIGHUP came in since the last check, several count as one
  */
-double read_temp_from_file(void){
-	FILE *tmpFP;
-	double temp;	
-	tmpFP = fopen(TMPFILENAME, "r");
-	if (tmpFP == NULL){
-		//printf("File %s does not exist, start thermocouple service\n", TMPFILENAME);
-		syslog(LOG_INFO, "File %s does not exist, start thermocouple service\n", TMPFILENAME);
-		closelog();
-		exit(1);
+static bool hup_pending(void){
+	struct signalfd_siginfo info;
+	bool pending = false;
+
+	while (hup_fd >= 0 && read(hup_fd, &info, sizeof(info)) == sizeof(info)){
+		pending = true;
 	}
-	fscanf(tmpFP, "%lf", &temp);
-	fclose(tmpFP);
-	return temp;
-	
+	return pending;
 }
 
+
 static void _signal_handler(const int signal){
 	switch (signal){
-		case SIGHUP:
-			break;
-
 		case SIGTERM:
+			notify_send("STOPPING=1");
 			syslog(LOG_INFO, "received SIGTERM, exiting.");
 			closelog();
 			exit(OK);
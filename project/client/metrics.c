@@ -0,0 +1,236 @@
+/*
+ *  Stage timing and counters for thermd
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "metrics.h"
+
+#define METRICS_TMP_SUFFIX ".tmp"
+/* Prometheus buckets, everything below each power of two from 16 us to
+ * 64 s, labelled with the largest whole us they hold since le is <= */
+#define METRICS_LE_MIN_BITS 4
+#define METRICS_LE_MAX_BITS 26
+
+static const char *stage_names[METRIC_STAGES] = {
+	"get", "parse", "sensor", "control", "status", "post", "log", "tls",
+	"compress", "tick",
+};
+
+static const struct {
+	const char *name;
+	const char *help;
+	/* counted in microseconds, reported in seconds */
+	bool usec;
+}counter_info[METRIC_COUNTERS] = {
+	{ "thermd_requests_total",	"HTTP requests sent", false },
+	{ "thermd_request_failures_total", "HTTP requests that failed", false },
+	{ "thermd_retries_total",	"Schedule polls retried after a failure", false },
+	{ "thermd_bytes_in_total",	"HTTP response body bytes received, decoded", false },
+	{ "thermd_bytes_out_total",	"HTTP request body bytes sent, before compression", false },
+	{ "thermd_allocations_total",	"Heap allocations for requests and JSON", false },
+	{ "thermd_tls_handshakes_total", "TLS handshakes, full or resumed", false },
+	{ "thermd_connections_reused_total", "Requests sent on an already open connection", false },
+	{ "thermd_tls_cpu_saved_seconds_total", "Estimated CPU not spent on handshakes thanks to reuse", true },
+	{ "thermd_wire_bytes_in_total",	"HTTP response body bytes as received", false },
+	{ "thermd_wire_bytes_out_total", "HTTP request body bytes as sent", false },
+	{ "thermd_failovers_total",	"Requests retried on another endpoint", false },
+	{ "thermd_wakeups_total",	"Control loop wakeups", false },
+	{ "thermd_reports_skipped_total", "Zone reports not posted because nothing changed", false },
+};
+
+static histogram_t stages[METRIC_STAGES];
+static uint64_t counters[METRIC_COUNTERS];
+
+static unsigned bits(uint64_t v){
+	return 63 - __builtin_clzll(v);
+}
+
+static uint32_t bucket_index(uint64_t v){
+	unsigned msb;
+
+	if (v < METRICS_SUB_BUCKETS){
+		return v;
+	}
+	msb = bits(v);
+	if (msb >= METRICS_MAX_BITS){
+		return METRICS_BUCKETS - 1;
+	}
+	/* the top METRICS_SUB_BITS bits after the leading one pick the sub-bucket */
+	return (msb - METRICS_SUB_BITS + 1) * METRICS_SUB_BUCKETS +
+		((v >> (msb - METRICS_SUB_BITS)) & (METRICS_SUB_BUCKETS - 1));
+}
+
+/**
+ *  Largest value that lands in bucket i
+ */
+static uint64_t bucket_upper(uint32_t i){
+	unsigned shift;
+
+	if (i < METRICS_SUB_BUCKETS){
+		return i;
+	}
+	shift = i / METRICS_SUB_BUCKETS - 1;
+	return ((uint64_t)(METRICS_SUB_BUCKETS + i % METRICS_SUB_BUCKETS + 1) << shift) - 1;
+}
+
+/**
+ *  Monotonic nanoseconds, pass to metrics_stop() when the stage is done
+ */
+uint64_t metrics_start(void){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+void metrics_stop(int stage, uint64_t start){
+	metrics_record(stage, (metrics_start() - start) / 1000);
+}
+
+void metrics_record(int stage, uint64_t usec){
+	histogram_t *h = &stages[stage];
+	uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+
+	__atomic_fetch_add(&h->counts[bucket_index(usec)], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->sum, usec, __ATOMIC_RELAXED);
+	while (usec > max && !__atomic_compare_exchange_n(&h->max, &max, usec, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+void metrics_count(int counter, uint64_t n){
+	__atomic_fetch_add(&counters[counter], n, __ATOMIC_RELAXED);
+}
+
+uint64_t metrics_counter(int counter){
+	return __atomic_load_n(&counters[counter], __ATOMIC_RELAXED);
+}
+
+/**
+ *  Value at quantile q (0..1) in microseconds, to the bucket's precision
+ */
+uint64_t metrics_quantile(const histogram_t *h, double q){
+	uint64_t count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+	uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+	uint64_t want, seen = 0, upper;
+	uint32_t i;
+
+	if (count == 0){
+		return 0;
+	}
+	want = (uint64_t)(q * count + 0.5);
+	if (want < 1){
+		want = 1;
+	}
+	for (i = 0; i < METRICS_BUCKETS; i++){
+		seen += __atomic_load_n(&h->counts[i], __ATOMIC_RELAXED);
+		if (seen >= want){
+			upper = bucket_upper(i);
+			return upper < max ? upper : max;
+		}
+	}
+	return max;
+}
+
+static void write_histogram(FILE *fp, const char *stage, const histogram_t *h){
+	uint64_t cumulative = 0;
+	uint32_t i = 0, end;
+	unsigned k;
+
+	for (k = METRICS_LE_MIN_BITS; k <= METRICS_LE_MAX_BITS; k++){
+		/* everything below 2^k us */
+		end = bucket_index(1ULL << k);
+		for (; i < end; i++){
+			cumulative += __atomic_load_n(&h->counts[i], __ATOMIC_RELAXED);
+		}
+		fprintf(fp, "thermd_stage_seconds_bucket{stage=\"%s\",le=\"%.6f\"} %llu\n",
+			stage, bucket_upper(end - 1) / 1e6, (unsigned long long) cumulative);
+	}
+	fprintf(fp, "thermd_stage_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n",
+		stage, (unsigned long long) __atomic_load_n(&h->count, __ATOMIC_RELAXED));
+	fprintf(fp, "thermd_stage_seconds_sum{stage=\"%s\"} %.6f\n",
+		stage, __atomic_load_n(&h->sum, __ATOMIC_RELAXED) / 1e6);
+	fprintf(fp, "thermd_stage_seconds_count{stage=\"%s\"} %llu\n",
+		stage, (unsigned long long) __atomic_load_n(&h->count, __ATOMIC_RELAXED));
+}
+
+/**
+ *  Writes every stage and counter in the Prometheus text format, the
+ *  histogram buckets are coarse powers of two so the quantiles from the
+ *  full resolution histogram go out as gauges alongside
+ */
+void metrics_write(FILE *fp){
+	static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999, 1 };
+	uint32_t i, j;
+
+	fprintf(fp, "# HELP thermd_stage_seconds Time spent in each stage of a tick\n");
+	fprintf(fp, "# TYPE thermd_stage_seconds histogram\n");
+	for (i = 0; i < METRIC_STAGES; i++){
+		write_histogram(fp, stage_names[i], &stages[i]);
+	}
+
+	fprintf(fp, "# HELP thermd_stage_quantile_seconds Stage latency quantiles, 1 is the max\n");
+	fprintf(fp, "# TYPE thermd_stage_quantile_seconds gauge\n");
+	for (i = 0; i < METRIC_STAGES; i++){
+		for (j = 0; j < sizeof(quantiles) / sizeof(quantiles[0]); j++){
+			fprintf(fp, "thermd_stage_quantile_seconds{stage=\"%s\",quantile=\"%g\"} %.6f\n",
+				stage_names[i], quantiles[j], metrics_quantile(&stages[i], quantiles[j]) / 1e6);
+		}
+	}
+
+	for (i = 0; i < METRIC_COUNTERS; i++){
+		fprintf(fp, "# HELP %s %s\n", counter_info[i].name, counter_info[i].help);
+		fprintf(fp, "# TYPE %s counter\n", counter_info[i].name);
+		if (counter_info[i].usec){
+			fprintf(fp, "%s %.6f\n", counter_info[i].name, metrics_counter(i) / 1e6);
+		}
+		else{
+			fprintf(fp, "%s %llu\n", counter_info[i].name, (unsigned long long) metrics_counter(i));
+		}
+	}
+}
+
+/**
+ *  A short table of the stages that ran, for people rather than scrapers
+ */
+void metrics_summary(FILE *fp){
+	uint32_t i;
+
+	fprintf(fp, "%-9s %9s %9s %9s %9s\n", "stage", "count", "p50 us", "p99 us", "max us");
+	for (i = 0; i < METRIC_STAGES; i++){
+		if (stages[i].count > 0){
+			fprintf(fp, "%-9s %9llu %9llu %9llu %9llu\n", stage_names[i],
+				(unsigned long long) stages[i].count,
+				(unsigned long long) metrics_quantile(&stages[i], 0.5),
+				(unsigned long long) metrics_quantile(&stages[i], 0.99),
+				(unsigned long long) stages[i].max);
+		}
+	}
+}
+
+/**
+ *  Writes the metrics to a temp file and renames it over path, so a
+ *  scraper (e.g. the node_exporter textfile collector) never sees half
+ */
+int metrics_dump(const char *path){
+	char tmp[256];
+	FILE *fp;
+
+	snprintf(tmp, sizeof(tmp), "%s" METRICS_TMP_SUFFIX, path);
+	fp = fopen(tmp, "w");
+	if (fp == NULL){
+		return METRICS_ERR;
+	}
+	/* readable by the scraper whatever the daemon's umask */
+	fchmod(fileno(fp), S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	metrics_write(fp);
+	if (fclose(fp) != 0 || rename(tmp, path) < 0){
+		unlink(tmp);
+		return METRICS_ERR;
+	}
+	return METRICS_OK;
+}
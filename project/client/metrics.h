@@ -0,0 +1,82 @@
+/*
+ *  Stage timing and counters for thermd
+ *
+ *  Every stage of a tick records its latency into a log-linear (HDR
+ *  style) histogram: exact below 16 us, then 16 sub-buckets per power
+ *  of two, so any value is kept to within about 6% from microseconds
+ *  up to hours in a fixed 4 KB per stage. Recording is a couple of
+ *  relaxed atomic adds, safe from any thread and never blocking.
+ *
+ *  metrics_write() renders everything as Prometheus text.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define METRICS_OK	0
+#define METRICS_ERR	1
+
+/* Stages */
+#define METRIC_GET	0
+#define METRIC_PARSE	1
+#define METRIC_SENSOR	2
+#define METRIC_CONTROL	3
+#define METRIC_STATUS	4
+#define METRIC_POST	5
+#define METRIC_LOG	6
+#define METRIC_TLS	7
+/* thread CPU of gzipping a request body */
+#define METRIC_COMPRESS	8
+/* all the work of one loop iteration, wakeup to telemetry */
+#define METRIC_TICK	9
+#define METRIC_STAGES	10
+
+/* Counters */
+#define METRIC_REQUESTS		0
+#define METRIC_FAILURES		1
+#define METRIC_RETRIES		2
+#define METRIC_BYTES_IN		3
+#define METRIC_BYTES_OUT	4
+#define METRIC_ALLOCATIONS	5
+#define METRIC_TLS_HANDSHAKES	6
+#define METRIC_CONNECTIONS_REUSED 7
+/* microseconds */
+#define METRIC_TLS_CPU_SAVED	8
+/* body bytes as sent/received, after compression */
+#define METRIC_WIRE_BYTES_IN	9
+#define METRIC_WIRE_BYTES_OUT	10
+#define METRIC_FAILOVERS	11
+#define METRIC_WAKEUPS		12
+/* zone reports left out of posts by report=change */
+#define METRIC_REPORTS_SKIPPED	13
+#define METRIC_COUNTERS		14
+
+#define METRICS_SUB_BITS 4
+#define METRICS_SUB_BUCKETS (1 << METRICS_SUB_BITS)
+/* values from 2^36 us (19 hours) up land in the last bucket */
+#define METRICS_MAX_BITS 36
+#define METRICS_BUCKETS ((METRICS_MAX_BITS - METRICS_SUB_BITS + 1) * METRICS_SUB_BUCKETS)
+
+typedef struct {
+	uint64_t counts[METRICS_BUCKETS];
+	uint64_t count;
+	/* microseconds */
+	uint64_t sum;
+	uint64_t max;
+}histogram_t;
+
+/* Function prototypes */
+uint64_t metrics_start(void);
+void metrics_stop(int stage, uint64_t start);
+void metrics_record(int stage, uint64_t usec);
+void metrics_count(int counter, uint64_t n);
+uint64_t metrics_counter(int counter);
+uint64_t metrics_quantile(const histogram_t *h, double q);
+void metrics_write(FILE *fp);
+void metrics_summary(FILE *fp);
+int metrics_dump(const char *path);
+
+#endif
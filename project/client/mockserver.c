@@ -0,0 +1,468 @@
+/*
+ *  Local stand-in for the thermd server
+ *
+ *  Serves the time1..3/temp1..3 schedule on GET and takes the status
+ *  posts, with optional latency and injected failures so thermd can be
+ *  tried against a slow or flaky server without the internet:
+ *
+ *  mockserver [-p port] [-l latency_ms] [-j jitter_ms] [-e error_pct]
+ *             [-d drop_pct] [-s schedule.json] [-o posts.log] [-i secs] [-c]
+ *             [-t cert_and_key.pem] [-n]
+ *
+ *  -e answers that share of requests with a 500, -d closes the
+ *  connection without answering, -c sends bodies chunked instead of
+ *  with a Content-Length, -n answers posts with a bare 204 (no
+ *  Content-Length, no body), -t speaks https with the certificate and
+ *  key in that PEM file. Throughput counters are printed every -i seconds
+ *  and GET /stats returns them as JSON, with full and resumed TLS
+ *  handshakes. Build with "make mockserver".
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <openssl/ssl.h>
+
+#define MOCK_OK		0
+#define MOCK_ERR	1
+
+#define MOCK_BUF_SIZE 65536
+#define MOCK_BODY_MAX (MOCK_BUF_SIZE / 2)
+
+static const char default_schedule[] =
+	"{\"time1\":\"06:00:00\",\"temp1\":\"70\","
+	"\"time2\":\"12:00:00\",\"temp2\":\"68\","
+	"\"time3\":\"22:00:00\",\"temp3\":\"60\"}";
+
+typedef struct {
+	uint64_t connections;
+	uint64_t requests;
+	uint64_t gets;
+	uint64_t posts;
+	uint64_t errors;
+	uint64_t drops;
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	uint64_t handshakes;
+	uint64_t resumed;
+}mock_stats_t;
+
+/* from the command line */
+static uint16_t port = 9000;
+static uint32_t latency_ms;
+static uint32_t jitter_ms;
+static uint32_t error_pct;
+static uint32_t drop_pct;
+static double stats_secs = 1;
+static bool chunked;
+static bool no_content;
+static SSL_CTX *tls;
+/* the serving thread's TLS connection, NULL for plain http */
+static __thread SSL *conn_tls;
+static char *schedule;
+static size_t schedule_len;
+static FILE *posts_fp;
+static pthread_mutex_t posts_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static mock_stats_t stats;
+
+static void count(uint64_t *counter, uint64_t n){
+	__atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+static uint64_t load(uint64_t *counter){
+	return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static double now(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int write_all(int fd, const char *data, size_t len){
+	ssize_t n;
+
+	while (len > 0){
+		n = conn_tls != NULL ? SSL_write(conn_tls, data, len) : send(fd, data, len, MSG_NOSIGNAL);
+		if (n <= 0){
+			return MOCK_ERR;
+		}
+		count(&stats.bytes_out, n);
+		data += n;
+		len -= n;
+	}
+	return MOCK_OK;
+}
+
+static ssize_t receive(int fd, char *buf, size_t len){
+	if (conn_tls != NULL){
+		return SSL_read(conn_tls, buf, len);
+	}
+	return recv(fd, buf, len, 0);
+}
+
+static int respond(int fd, int code, const char *reason, const char *body, size_t len, bool close_after){
+	char head[256];
+	size_t half = len / 2;
+	int n;
+
+	if (chunked && len > 0){
+		/* two chunks, so a client has to join them */
+		n = snprintf(head, sizeof(head),
+			"HTTP/1.1 %d %s\r\n"
+			"Content-Type: application/json\r\n"
+			"Transfer-Encoding: chunked\r\n"
+			"%s"
+			"\r\n%zx\r\n", code, reason, close_after ? "Connection: close\r\n" : "", half);
+		if (write_all(fd, head, n) != MOCK_OK || write_all(fd, body, half) != MOCK_OK){
+			return MOCK_ERR;
+		}
+		n = snprintf(head, sizeof(head), "\r\n%zx\r\n", len - half);
+		if (write_all(fd, head, n) != MOCK_OK || write_all(fd, body + half, len - half) != MOCK_OK){
+			return MOCK_ERR;
+		}
+		return write_all(fd, "\r\n0\r\n\r\n", strlen("\r\n0\r\n\r\n"));
+	}
+	n = snprintf(head, sizeof(head),
+		"HTTP/1.1 %d %s\r\n"
+		"Content-Type: application/json\r\n"
+		"Content-Length: %zu\r\n"
+		"%s"
+		"\r\n", code, reason, len, close_after ? "Connection: close\r\n" : "");
+	if (write_all(fd, head, n) != MOCK_OK){
+		return MOCK_ERR;
+	}
+	return write_all(fd, body, len);
+}
+
+static int respond_stats(int fd, bool close_after){
+	char body[512];
+	int n;
+
+	n = snprintf(body, sizeof(body),
+		"{\"connections\":%llu,\"requests\":%llu,\"gets\":%llu,\"posts\":%llu,"
+		"\"errors\":%llu,\"drops\":%llu,\"bytes_in\":%llu,\"bytes_out\":%llu,"
+		"\"handshakes\":%llu,\"resumed\":%llu}",
+		(unsigned long long) load(&stats.connections), (unsigned long long) load(&stats.requests),
+		(unsigned long long) load(&stats.gets), (unsigned long long) load(&stats.posts),
+		(unsigned long long) load(&stats.errors), (unsigned long long) load(&stats.drops),
+		(unsigned long long) load(&stats.bytes_in), (unsigned long long) load(&stats.bytes_out),
+		(unsigned long long) load(&stats.handshakes), (unsigned long long) load(&stats.resumed));
+	return respond(fd, 200, "OK", body, n, close_after);
+}
+
+/**
+ *  Value of a header in a NUL terminated request head, NULL if missing
+ */
+static const char *header(const char *head, const char *name){
+	size_t len = strlen(name);
+	const char *line = strstr(head, "\r\n");
+
+	while (line != NULL && line[2] != '\r'){
+		line += 2;
+		if (!strncasecmp(line, name, len) && line[len] == ':'){
+			line += len + 1;
+			while (*line == ' '){
+				line++;
+			}
+			return line;
+		}
+		line = strstr(line, "\r\n");
+	}
+	return NULL;
+}
+
+static void log_post(const char *body, size_t len){
+	if (posts_fp == NULL){
+		return;
+	}
+	pthread_mutex_lock(&posts_lock);
+	fwrite(body, 1, len, posts_fp);
+	fputc('\n', posts_fp);
+	fflush(posts_fp);
+	pthread_mutex_unlock(&posts_lock);
+}
+
+/**
+ *  Serves one keep-alive connection, requests may arrive pipelined
+ */
+static void *serve(void *arg){
+	int fd = (int)(intptr_t) arg;
+	/* a reconnect often gets the same fd, so seed from the connection count */
+	unsigned int seed = (unsigned int) time(NULL) * 2654435761u + (unsigned int) __atomic_add_fetch(&stats.connections, 1, __ATOMIC_RELAXED);
+	char *buf = malloc(MOCK_BUF_SIZE);
+	size_t have = 0, head_len, body_len, total;
+	const char *value;
+	char *end;
+	bool close_after, get;
+	ssize_t n;
+	uint32_t roll;
+
+	if (tls != NULL){
+		conn_tls = SSL_new(tls);
+		if (conn_tls == NULL || !SSL_set_fd(conn_tls, fd) || SSL_accept(conn_tls) <= 0){
+			goto done;
+		}
+		count(&stats.handshakes, 1);
+		if (SSL_session_reused(conn_tls)){
+			count(&stats.resumed, 1);
+		}
+	}
+
+	while (buf != NULL){
+		/* wait for a whole request head */
+		buf[have] = '\0';
+		while ((end = strstr(buf, "\r\n\r\n")) == NULL){
+			if (have == MOCK_BUF_SIZE - 1){
+				goto done;
+			}
+			n = receive(fd, buf + have, MOCK_BUF_SIZE - 1 - have);
+			if (n <= 0){
+				goto done;
+			}
+			count(&stats.bytes_in, n);
+			have += n;
+			buf[have] = '\0';
+		}
+		head_len = end - buf + 4;
+		*end = '\0';
+
+		value = header(buf, "Content-Length");
+		body_len = value != NULL ? strtoul(value, NULL, 10) : 0;
+		if (body_len > MOCK_BODY_MAX){
+			respond(fd, 413, "Payload Too Large", "", 0, true);
+			goto done;
+		}
+		total = head_len + body_len;
+		while (have < total){
+			n = receive(fd, buf + have, MOCK_BUF_SIZE - 1 - have);
+			if (n <= 0){
+				goto done;
+			}
+			count(&stats.bytes_in, n);
+			have += n;
+		}
+
+		value = header(buf, "Connection");
+		close_after = value != NULL && !strncasecmp(value, "close", strlen("close"));
+		get = !strncmp(buf, "GET ", 4);
+		count(&stats.requests, 1);
+
+		if (latency_ms > 0 || jitter_ms > 0){
+			usleep((latency_ms + (jitter_ms > 0 ? rand_r(&seed) % (jitter_ms + 1) : 0)) * 1000);
+		}
+
+		/* /stats is how a test reads the counters, it never fails */
+		roll = rand_r(&seed) % 100;
+		if (get && !strncmp(buf + 4, "/stats ", strlen("/stats "))){
+			if (respond_stats(fd, close_after) != MOCK_OK){
+				goto done;
+			}
+		}
+		else if (roll < drop_pct){
+			count(&stats.drops, 1);
+			goto done;
+		}
+		else if (roll < drop_pct + error_pct){
+			count(&stats.errors, 1);
+			if (respond(fd, 500, "Internal Server Error", "{}", 2, close_after) != MOCK_OK){
+				goto done;
+			}
+		}
+		else if (get){
+			count(&stats.gets, 1);
+			if (respond(fd, 200, "OK", schedule, schedule_len, close_after) != MOCK_OK){
+				goto done;
+			}
+		}
+		else{
+			count(&stats.posts, 1);
+			log_post(buf + head_len, body_len);
+			if (no_content){
+				if (write_all(fd, "HTTP/1.1 204 No Content\r\n\r\n", strlen("HTTP/1.1 204 No Content\r\n\r\n")) != MOCK_OK){
+					goto done;
+				}
+			}
+			else if (respond(fd, 200, "OK", "", 0, close_after) != MOCK_OK){
+				goto done;
+			}
+		}
+		if (close_after){
+			goto done;
+		}
+
+		/* keep whatever of the next request already arrived */
+		memmove(buf, buf + total, have - total);
+		have -= total;
+	}
+done:
+	if (conn_tls != NULL){
+		SSL_free(conn_tls);
+		conn_tls = NULL;
+	}
+	free(buf);
+	close(fd);
+	return NULL;
+}
+
+/**
+ *  Prints throughput every stats_secs seconds
+ */
+static void *report(void *arg){
+	uint64_t last = 0, requests;
+	double start = now(), t, last_t = start;
+
+	for (;;){
+		usleep((useconds_t)(stats_secs * 1e6));
+		t = now();
+		requests = load(&stats.requests);
+		printf("%.0f s: %.1f req/s, %llu gets, %llu posts, %llu errors, %llu drops, %llu bytes in, %llu bytes out\n",
+			t - start, (requests - last) / (t - last_t),
+			(unsigned long long) load(&stats.gets), (unsigned long long) load(&stats.posts),
+			(unsigned long long) load(&stats.errors), (unsigned long long) load(&stats.drops),
+			(unsigned long long) load(&stats.bytes_in), (unsigned long long) load(&stats.bytes_out));
+		fflush(stdout);
+		last = requests;
+		last_t = t;
+	}
+	return NULL;
+}
+
+static int load_schedule(const char *path){
+	FILE *fp = fopen(path, "r");
+	long len;
+
+	if (fp == NULL || fseek(fp, 0, SEEK_END) != 0 || (len = ftell(fp)) <= 0){
+		if (fp != NULL){
+			fclose(fp);
+		}
+		return MOCK_ERR;
+	}
+	rewind(fp);
+	schedule = malloc(len);
+	if (schedule == NULL || fread(schedule, 1, len, fp) != (size_t) len){
+		fclose(fp);
+		return MOCK_ERR;
+	}
+	schedule_len = len;
+	fclose(fp);
+	return MOCK_OK;
+}
+
+static void usage(void){
+	printf("Usage: mockserver [-p port] [-l latency_ms] [-j jitter_ms] [-e error_pct]\n"
+		"                  [-d drop_pct] [-s schedule.json] [-o posts.log] [-i secs] [-c]\n"
+		"                  [-t cert_and_key.pem] [-n]\n");
+}
+
+int main(int argc, char **argv){
+	struct sockaddr_in addr;
+	pthread_t thread;
+	int opt, fd, client, one = 1;
+
+	schedule = (char *) default_schedule;
+	schedule_len = strlen(default_schedule);
+
+	while ((opt = getopt(argc, argv, "p:l:j:e:d:s:o:i:ct:nh")) != -1){
+		switch (opt){
+			case 'p':
+				port = atoi(optarg);
+				break;
+			case 'l':
+				latency_ms = atoi(optarg);
+				break;
+			case 'j':
+				jitter_ms = atoi(optarg);
+				break;
+			case 'e':
+				error_pct = atoi(optarg);
+				break;
+			case 'd':
+				drop_pct = atoi(optarg);
+				break;
+			case 's':
+				if (load_schedule(optarg) != MOCK_OK){
+					printf("Couldn't read schedule %s\n", optarg);
+					return MOCK_ERR;
+				}
+				break;
+			case 'o':
+				posts_fp = fopen(optarg, "a");
+				if (posts_fp == NULL){
+					printf("Couldn't open %s\n", optarg);
+					return MOCK_ERR;
+				}
+				break;
+			case 'i':
+				stats_secs = atof(optarg);
+				break;
+			case 'c':
+				chunked = true;
+				break;
+			case 'n':
+				no_content = true;
+				break;
+			case 't':
+				tls = SSL_CTX_new(TLS_server_method());
+				if (tls == NULL || SSL_CTX_use_certificate_chain_file(tls, optarg) != 1 ||
+				    SSL_CTX_use_PrivateKey_file(tls, optarg, SSL_FILETYPE_PEM) != 1){
+					printf("Couldn't load a certificate and key from %s\n", optarg);
+					return MOCK_ERR;
+				}
+				break;
+			default:
+				usage();
+				return opt == 'h' ? MOCK_OK : MOCK_ERR;
+		}
+	}
+	if (error_pct + drop_pct > 100 || stats_secs <= 0){
+		usage();
+		return MOCK_ERR;
+	}
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0){
+		perror("socket");
+		return MOCK_ERR;
+	}
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, 128) < 0){
+		perror("bind");
+		return MOCK_ERR;
+	}
+	signal(SIGPIPE, SIG_IGN);
+	pthread_create(&thread, NULL, report, NULL);
+	pthread_detach(thread);
+	printf("mockserver on %s://127.0.0.1:%u, latency %u+%u ms, %u%% errors, %u%% drops\n",
+		tls != NULL ? "https" : "http", port, latency_ms, jitter_ms, error_pct, drop_pct);
+	fflush(stdout);
+
+	for (;;){
+		client = accept(fd, NULL, NULL);
+		if (client < 0){
+			continue;
+		}
+		setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		if (pthread_create(&thread, NULL, serve, (void *)(intptr_t) client) != 0){
+			close(client);
+			continue;
+		}
+		pthread_detach(thread);
+	}
+	return MOCK_OK;
+}
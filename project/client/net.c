@@ -0,0 +1,488 @@
+/*
+ *  HTTP transport for thermd
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <pthread.h>
+#include <syslog.h>
+#include "net.h"
+#include "metrics.h"
+#include "http.h"
+#ifndef THERMD_NO_CURL
+#include <zlib.h>
+#endif
+
+#define NET_BUFFER_INITIAL 4096
+
+/* 0 leaves the transport's defaults */
+static long connect_timeout_ms;
+static long timeout_ms;
+static size_t max_response;
+/* TLS, empty ca_file uses the system CA bundle */
+static char tls_ca[NET_PATH_SIZE];
+static bool tls_verify = true;
+/* bodies at least this long go out gzipped, 0 never compresses */
+static size_t compress_threshold;
+/* seconds resolved names stay in the shared DNS cache */
+static long dns_ttl = 60;
+#ifndef THERMD_NO_CURL
+/* plain http requests go through http.c rather than curl */
+static bool builtin;
+#endif
+
+/**
+ *  Appends n bytes to buf, growing it by doubling and keeping it NUL terminated
+ */
+int net_buffer_append(net_buffer_t *buf, const void *ptr, size_t n){
+	size_t want;
+	char *data;
+
+	if (buf->len + n + 1 > buf->size){
+		want = buf->size ? buf->size : NET_BUFFER_INITIAL;
+		while (want < buf->len + n + 1){
+			want *= 2;
+		}
+		data = realloc(buf->data, want);
+		if (data == NULL){
+			return NET_REQ_ERR;
+		}
+		metrics_count(METRIC_ALLOCATIONS, 1);
+		buf->data = data;
+		buf->size = want;
+	}
+	memcpy(buf->data + buf->len, ptr, n);
+	buf->len += n;
+	buf->data[buf->len] = '\0';
+	return NET_OK;
+}
+
+/**
+ *  Bounds every request so a stuck server can't hold up the control
+ *  loop, timeouts in seconds, max_response caps a kept response body
+ */
+void net_set_limits(double connect_timeout, double timeout, size_t max){
+	connect_timeout_ms = (long)(connect_timeout * 1000);
+	timeout_ms = (long)(timeout * 1000);
+	max_response = max;
+}
+
+/**
+ *  Sets the CA bundle for https:// endpoints, verify off accepts any
+ *  certificate, only for test servers with self-signed ones
+ */
+void net_set_tls(const char *ca_file, bool verify){
+	strncpy(tls_ca, ca_file != NULL ? ca_file : "", NET_PATH_SIZE - 1);
+	tls_verify = verify;
+}
+
+/**
+ *  Request bodies of at least threshold bytes are sent with
+ *  Content-Encoding: gzip, the server has to accept that, 0 turns it off
+ */
+void net_set_compression(size_t threshold){
+	compress_threshold = threshold;
+}
+
+/**
+ *  How long a resolved host name is reused, the cache lives in the share
+ *  handle so it outlives connections and covers every handle in the process
+ */
+void net_set_dns_ttl(double ttl){
+	dns_ttl = (long) ttl;
+}
+
+/**
+ *  Picks the built-in client for plain http:// requests, anything it
+ *  can't do (https, compressed bodies) still goes through curl. The
+ *  tiny build has no curl and always uses it.
+ */
+void net_set_client(bool use_builtin){
+#ifndef THERMD_NO_CURL
+	if (builtin && !use_builtin){
+		/* close its connection rather than leave it to time out */
+		http_cleanup();
+	}
+	builtin = use_builtin;
+#endif
+}
+
+/**
+ *  Sent requests whose responses turned out to be failures since the
+ *  last call, only the built-in client sends without waiting
+ */
+uint32_t net_deferred_failures(void){
+	return http_take_failures();
+}
+
+void net_buffer_free(net_buffer_t *buf){
+	free(buf->data);
+	buf->data = NULL;
+	buf->len = 0;
+	buf->size = 0;
+}
+
+
+/**
+ *  Sends an HTTP request with the built-in client, bodies go out as they
+ *  are and responses must not be encoded. A POST, PUT or DELETE whose
+ *  response nobody wants is only written, see http_send().
+ */
+static int builtin_request(const char *url, int8_t method, const char *body, net_buffer_t *response){
+	static const char *methods[] = { "POST", "GET", "PUT", "DELETE" };
+	int ret;
+
+	if (method != GET){
+		metrics_count(METRIC_BYTES_OUT, strlen(body));
+		metrics_count(METRIC_WIRE_BYTES_OUT, strlen(body));
+	}
+	metrics_count(METRIC_REQUESTS, 1);
+	http_set_limits(connect_timeout_ms / 1000.0, timeout_ms / 1000.0, max_response);
+	if (method != GET && response == NULL){
+		ret = http_send(url, methods[method], body);
+		if (ret == HTTP_OK){
+			return NET_SENT;
+		}
+	}
+	else{
+		ret = http_request(url, methods[method], method != GET ? body : NULL, response);
+	}
+	if (ret != HTTP_OK){
+		metrics_count(METRIC_FAILURES, 1);
+		syslog(LOG_INFO, "Could not connect - double check server and URL (%s)\n", http_strerror(ret));
+		return NET_REQ_ERR;
+	}
+	return NET_OK;
+}
+
+#ifdef THERMD_NO_CURL
+
+/**
+ *  Nothing to set up for the built-in client
+ */
+int net_init(void){
+	return NET_OK;
+}
+
+void net_cleanup(void){
+	http_cleanup();
+}
+
+#else
+
+static CURLSH *share;
+static CURL *handle;
+/* thread CPU of requests that did a handshake, to price the ones that didn't */
+static uint64_t handshake_cpu_ns;
+static uint64_t handshake_requests;
+static net_buffer_t compressed;
+static struct curl_slist *gzip_headers;
+static pthread_mutex_t share_locks[CURL_LOCK_DATA_LAST];
+
+static void share_lock(CURL *curl, curl_lock_data data, curl_lock_access access, void *userptr){
+	pthread_mutex_lock(&share_locks[data]);
+}
+
+static void share_unlock(CURL *curl, curl_lock_data data, void *userptr){
+	pthread_mutex_unlock(&share_locks[data]);
+}
+
+/**
+ *  Appends a chunk of the response, curl may deliver a body in several calls
+ */
+static size_t write_callback(void *ptr, size_t size, size_t nmemb, void *userdata){
+	net_buffer_t *buf = userdata;
+	size_t n = size * nmemb;
+
+	if (max_response > 0 && buf->len + n > max_response){
+		/* not a schedule, don't let it eat the heap */
+		return 0;
+	}
+	if (net_buffer_append(buf, ptr, n) != NET_OK){
+		/* returning short makes curl fail the transfer */
+		return 0;
+	}
+	metrics_count(METRIC_BYTES_IN, n);
+	return n;
+}
+
+/**
+ *  Throws away response bodies nobody asked for instead of letting curl print them
+ */
+static size_t discard_callback(void *ptr, size_t size, size_t nmemb, void *userdata){
+	metrics_count(METRIC_BYTES_IN, size * nmemb);
+	return size * nmemb;
+}
+
+/**
+ *  Sets up curl and the shared connection pool, call once before any thread starts
+ */
+int net_init(void){
+	int i;
+
+	if (curl_global_init(CURL_GLOBAL_ALL) != CURLE_OK){
+		return NET_INIT_ERR;
+	}
+	for (i = 0; i < CURL_LOCK_DATA_LAST; i++){
+		pthread_mutex_init(&share_locks[i], NULL);
+	}
+
+	share = curl_share_init();
+	if (share == NULL){
+		return NET_INIT_ERR;
+	}
+	curl_share_setopt(share, CURLSHOPT_LOCKFUNC, share_lock);
+	curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, share_unlock);
+	curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	/* TLS session tickets/IDs, so a reconnect resumes instead of a full handshake */
+	curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+	curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+
+	handle = curl_easy_init();
+	if (handle == NULL){
+		return NET_INIT_ERR;
+	}
+	gzip_headers = curl_slist_append(NULL, "Content-Encoding: gzip");
+	if (gzip_headers == NULL){
+		return NET_INIT_ERR;
+	}
+	return NET_OK;
+}
+
+static uint64_t thread_cpu_ns(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ *  Counts handshakes and reused connections for the request that just
+ *  finished, and estimates the CPU each reuse saved as the average CPU
+ *  of a handshaking request minus what this one took
+ */
+static void account_connection(bool tls, uint64_t cpu_ns){
+	curl_off_t connect = 0, appconnect = 0;
+	long connects = 0;
+
+	curl_easy_getinfo(handle, CURLINFO_NUM_CONNECTS, &connects);
+	if (connects == 0){
+		metrics_count(METRIC_CONNECTIONS_REUSED, 1);
+		if (tls && handshake_requests > 0 && handshake_cpu_ns / handshake_requests > cpu_ns){
+			metrics_count(METRIC_TLS_CPU_SAVED, (handshake_cpu_ns / handshake_requests - cpu_ns) / 1000);
+		}
+		return;
+	}
+	if (!tls){
+		return;
+	}
+	curl_easy_getinfo(handle, CURLINFO_CONNECT_TIME_T, &connect);
+	curl_easy_getinfo(handle, CURLINFO_APPCONNECT_TIME_T, &appconnect);
+	if (appconnect > 0){
+		metrics_count(METRIC_TLS_HANDSHAKES, 1);
+		metrics_record(METRIC_TLS, appconnect - connect);
+		handshake_cpu_ns += cpu_ns;
+		handshake_requests++;
+	}
+}
+
+/**
+ *  Gzips body into the reused compressed buffer, fails when it doesn't
+ *  shrink so the caller sends it as is
+ */
+static int gzip_body(const char *body, size_t len){
+	z_stream z;
+	size_t want = deflateBound(NULL, len) + 32;
+	char *data;
+	int ret;
+
+	if (want > compressed.size){
+		data = realloc(compressed.data, want);
+		if (data == NULL){
+			return NET_REQ_ERR;
+		}
+		metrics_count(METRIC_ALLOCATIONS, 1);
+		compressed.data = data;
+		compressed.size = want;
+	}
+
+	memset(&z, 0, sizeof(z));
+	/* 15 + 16 asks for a gzip header rather than a zlib one */
+	if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK){
+		return NET_REQ_ERR;
+	}
+	z.next_in = (Bytef *) body;
+	z.avail_in = len;
+	z.next_out = (Bytef *) compressed.data;
+	z.avail_out = compressed.size;
+	ret = deflate(&z, Z_FINISH);
+	compressed.len = z.total_out;
+	deflateEnd(&z);
+	if (ret != Z_STREAM_END || compressed.len >= len){
+		return NET_REQ_ERR;
+	}
+	return NET_OK;
+}
+
+/**
+ *  Sets a POST/PUT body, compressed when it is long enough to be worth it
+ */
+static void set_body(const char *body){
+	size_t len = strlen(body);
+	uint64_t cpu;
+
+	metrics_count(METRIC_BYTES_OUT, len);
+	if (compress_threshold > 0 && len >= compress_threshold){
+		cpu = thread_cpu_ns();
+		if (gzip_body(body, len) == NET_OK){
+			metrics_record(METRIC_COMPRESS, (thread_cpu_ns() - cpu) / 1000);
+			curl_easy_setopt(handle, CURLOPT_HTTPHEADER, gzip_headers);
+			curl_easy_setopt(handle, CURLOPT_POSTFIELDSIZE, (long) compressed.len);
+			curl_easy_setopt(handle, CURLOPT_POSTFIELDS, compressed.data);
+			metrics_count(METRIC_WIRE_BYTES_OUT, compressed.len);
+			return;
+		}
+	}
+	curl_easy_setopt(handle, CURLOPT_POSTFIELDS, body);
+	metrics_count(METRIC_WIRE_BYTES_OUT, len);
+}
+
+/**
+ *  The share handle, for anything else that opens its own curl handles
+ */
+CURLSH *net_share(void){
+	return share;
+}
+
+/**
+ *  Sends an HTTP request on the persistent curl handle
+ */
+static int curl_request(const char *url, int8_t method, const char *body, net_buffer_t *response){
+	bool tls = !strncasecmp(url, "https://", strlen("https://"));
+	curl_off_t wire;
+	uint64_t cpu;
+	CURLcode res;
+
+	if (handle == NULL){
+		return NET_INIT_ERR;
+	}
+
+	/* reset options but keep the handle's live connections */
+	curl_easy_reset(handle);
+	curl_easy_setopt(handle, CURLOPT_SHARE, share);
+	curl_easy_setopt(handle, CURLOPT_URL, url);
+	curl_easy_setopt(handle, CURLOPT_NOSIGNAL, 1L);
+	/* a 4xx/5xx is a failed request, not a schedule */
+	curl_easy_setopt(handle, CURLOPT_FAILONERROR, 1L);
+	curl_easy_setopt(handle, CURLOPT_CONNECTTIMEOUT_MS, connect_timeout_ms);
+	curl_easy_setopt(handle, CURLOPT_TIMEOUT_MS, timeout_ms);
+	curl_easy_setopt(handle, CURLOPT_DNS_CACHE_TIMEOUT, dns_ttl);
+	if (tls){
+		if (strlen(tls_ca)){
+			curl_easy_setopt(handle, CURLOPT_CAINFO, tls_ca);
+		}
+		curl_easy_setopt(handle, CURLOPT_SSL_VERIFYPEER, tls_verify ? 1L : 0L);
+		curl_easy_setopt(handle, CURLOPT_SSL_VERIFYHOST, tls_verify ? 2L : 0L);
+	}
+
+	/* Setup based on the method */
+	switch (method){
+		case DEL:
+			curl_easy_setopt(handle, CURLOPT_CUSTOMREQUEST, "DELETE");
+			// no break, we want delete to fall through and set post params too
+		case POST:
+			set_body(body);
+			break;
+
+		case GET:
+			break;
+
+		case PUT:
+			curl_easy_setopt(handle, CURLOPT_CUSTOMREQUEST, "PUT");
+			set_body(body);
+			break;
+		default:
+			return NET_METHOD_ERR;
+	}
+
+	if (response != NULL){
+		response->len = 0;
+		if (response->data != NULL){
+			response->data[0] = '\0';
+		}
+		curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, write_callback);
+		curl_easy_setopt(handle, CURLOPT_WRITEDATA, response);
+		/* "" offers every encoding curl was built with, max_response still caps the decoded size */
+		curl_easy_setopt(handle, CURLOPT_ACCEPT_ENCODING, "");
+	}
+	else{
+		curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, discard_callback);
+	}
+
+	metrics_count(METRIC_REQUESTS, 1);
+	cpu = thread_cpu_ns();
+	res = curl_easy_perform(handle);
+	account_connection(tls, thread_cpu_ns() - cpu);
+	/* counts the body before content decoding */
+	if (curl_easy_getinfo(handle, CURLINFO_SIZE_DOWNLOAD_T, &wire) == CURLE_OK){
+		metrics_count(METRIC_WIRE_BYTES_IN, wire);
+	}
+	if (res != CURLE_OK){
+		metrics_count(METRIC_FAILURES, 1);
+		syslog(LOG_INFO, "Could not connect - double check server and URL (%s)\n", curl_easy_strerror(res));
+		return NET_REQ_ERR;
+	}
+	return NET_OK;
+}
+
+void net_cleanup(void){
+	http_cleanup();
+	if (handle != NULL){
+		curl_easy_cleanup(handle);
+		handle = NULL;
+	}
+	curl_slist_free_all(gzip_headers);
+	gzip_headers = NULL;
+	net_buffer_free(&compressed);
+	if (share != NULL){
+		curl_share_cleanup(share);
+		share = NULL;
+	}
+	curl_global_cleanup();
+}
+
+#endif
+
+/**
+ *  Sends an HTTP request, through the built-in client when it's selected
+ *  and can handle it and through curl otherwise
+ *  @params
+ *  url: the url to send the request to
+ *  method: the HTTP method to send i.e. GET, POST, PUT, DELETE
+ *  body: the post parameters to send
+ *  response: where to put the response body, NULL to discard it
+ *  returns NET_SENT instead of NET_OK when the request was only written
+ *  and its response will be read later, see net_deferred_failures()
+ */
+int net_request(const char *url, int8_t method, const char *body, net_buffer_t *response){
+	http_url_t u;
+
+	if (method < POST || method > DEL){
+		return NET_METHOD_ERR;
+	}
+#ifdef THERMD_NO_CURL
+	if (http_parse_url(url, &u) != HTTP_OK){
+		metrics_count(METRIC_FAILURES, 1);
+		syslog(LOG_INFO, "Can't send to %s, this build only speaks plain http\n", url);
+		return NET_REQ_ERR;
+	}
+	return builtin_request(url, method, body, response);
+#else
+	if (builtin && http_parse_url(url, &u) == HTTP_OK &&
+	    (method == GET || compress_threshold == 0 || strlen(body) < compress_threshold)){
+		return builtin_request(url, method, body, response);
+	}
+	return curl_request(url, method, body, response);
+#endif
+}
@@ -0,0 +1,67 @@
+/*
+ *  HTTP transport for thermd
+ *
+ *  All requests go through one persistent curl handle whose connections,
+ *  DNS cache and TLS sessions live in a share handle, so every zone and
+ *  every tick reuses the same keep-alive connection to the server. For
+ *  an https:// endpoint that means one TLS handshake per connection
+ *  rather than per request, and a resumed one from the cached session
+ *  when the server does drop the connection.
+ *
+ *  With http_client=builtin plain http:// requests go through the
+ *  built-in client in http.c instead, which keeps its own connection and
+ *  writes the status post without waiting for its response. https and
+ *  bodies long enough to compress still go through curl. Built with
+ *  THERMD_NO_CURL (make thermd-tiny) there is only the built-in client:
+ *  plain http only, and the TLS, compression and DNS cache settings are
+ *  ignored.
+ */
+
+#ifndef NET_H
+#define NET_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#ifndef THERMD_NO_CURL
+#include <curl/curl.h>
+#endif
+
+#define NET_OK		0
+#define NET_INIT_ERR	1
+#define NET_REQ_ERR	2
+#define NET_METHOD_ERR	3
+/* written, the response is read with a later request */
+#define NET_SENT	4
+
+#define POST 0
+#define GET 1
+#define PUT 2
+#define DEL 3
+
+#define NET_PATH_SIZE 256
+
+/* Response body, reused between requests, always NUL terminated */
+typedef struct {
+	char *data;
+	size_t len;
+	size_t size;
+}net_buffer_t;
+
+/* Function prototypes */
+int net_init(void);
+void net_set_limits(double connect_timeout, double timeout, size_t max_response);
+void net_set_tls(const char *ca_file, bool verify);
+void net_set_compression(size_t threshold);
+void net_set_dns_ttl(double ttl);
+void net_set_client(bool builtin);
+uint32_t net_deferred_failures(void);
+#ifndef THERMD_NO_CURL
+CURLSH *net_share(void);
+#endif
+int net_request(const char *url, int8_t method, const char *body, net_buffer_t *response);
+int net_buffer_append(net_buffer_t *buf, const void *ptr, size_t n);
+void net_buffer_free(net_buffer_t *buf);
+void net_cleanup(void);
+
+#endif
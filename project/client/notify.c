@@ -0,0 +1,81 @@
+/*
+ *  Service manager notifications for thermd
+ */
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "notify.h"
+
+static int notify_fd = -1;
+static struct sockaddr_un notify_addr;
+static socklen_t notify_len;
+/* seconds, 0 without a watchdog */
+static double watchdog_period;
+
+/**
+ *  Reads NOTIFY_SOCKET and WATCHDOG_USEC from the environment, call once
+ *  in the process that runs the loop, after any fork
+ */
+int notify_init(void){
+	const char *path = getenv("NOTIFY_SOCKET");
+	const char *usec = getenv("WATCHDOG_USEC");
+	const char *pid = getenv("WATCHDOG_PID");
+	size_t len;
+
+	if (usec != NULL && (pid == NULL || (pid_t) atol(pid) == getpid())){
+		watchdog_period = strtoull(usec, NULL, 10) / 1e6;
+	}
+
+	if (path == NULL || (path[0] != '/' && path[0] != '@')){
+		return NOTIFY_OK;
+	}
+	len = strlen(path);
+	if (len < 2 || len >= sizeof(notify_addr.sun_path)){
+		return NOTIFY_ERR;
+	}
+	memset(&notify_addr, 0, sizeof(notify_addr));
+	notify_addr.sun_family = AF_UNIX;
+	memcpy(notify_addr.sun_path, path, len);
+	/* abstract sockets start with a NUL and aren't NUL terminated */
+	if (path[0] == '@'){
+		notify_addr.sun_path[0] = '\0';
+	}
+	notify_len = offsetof(struct sockaddr_un, sun_path) + len + (path[0] == '/');
+
+	notify_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	return notify_fd < 0 ? NOTIFY_ERR : NOTIFY_OK;
+}
+
+/**
+ *  Sends newline separated KEY=value lines in one datagram, safe to call
+ *  from a signal handler
+ */
+int notify_send(const char *state){
+	if (notify_fd < 0){
+		return NOTIFY_OK;
+	}
+	if (sendto(notify_fd, state, strlen(state), MSG_NOSIGNAL,
+			(struct sockaddr *) &notify_addr, notify_len) < 0){
+		return NOTIFY_ERR;
+	}
+	return NOTIFY_OK;
+}
+
+/**
+ *  How often the service manager expects WATCHDOG=1, 0 for never
+ */
+double notify_watchdog_period(void){
+	return watchdog_period;
+}
+
+void notify_close(void){
+	if (notify_fd >= 0){
+		close(notify_fd);
+		notify_fd = -1;
+	}
+}
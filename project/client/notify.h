@@ -0,0 +1,27 @@
+/*
+ *  Service manager notifications for thermd
+ *
+ *  Speaks the sd_notify datagram protocol directly, without libsystemd:
+ *  when the service manager sets NOTIFY_SOCKET, state lines such as
+ *  READY=1, WATCHDOG=1 and STOPPING=1 are sent to it as one datagram.
+ *  A path starting with @ is an abstract socket. Without NOTIFY_SOCKET
+ *  every call is a no-op, so thermd runs the same outside systemd.
+ *
+ *  WATCHDOG_USEC (and WATCHDOG_PID, when it names this process) turns
+ *  on the watchdog, the loop then has to send WATCHDOG=1 at least that
+ *  often or the service manager restarts it.
+ */
+
+#ifndef NOTIFY_H
+#define NOTIFY_H
+
+#define NOTIFY_OK	0
+#define NOTIFY_ERR	1
+
+/* Function prototypes */
+int notify_init(void);
+int notify_send(const char *state);
+double notify_watchdog_period(void);
+void notify_close(void);
+
+#endif
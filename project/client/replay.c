@@ -0,0 +1,333 @@
+/*
+ *  Deterministic replay of the whole control loop for thermd
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "replay.h"
+
+#define REPLAY_LINE_SIZE 4096
+
+static int add_point(replay_zone_t *z, double t, double temp){
+	replay_point_t *points;
+
+	if (z->count > 0 && t < z->points[z->count - 1].t){
+		return REPLAY_ERR;
+	}
+	/* grows on powers of two */
+	if ((z->count & (z->count - 1)) == 0){
+		points = realloc(z->points, (z->count ? z->count * 2 : 1) * sizeof(*points));
+		if (points == NULL){
+			return REPLAY_ERR;
+		}
+		z->points = points;
+	}
+	z->points[z->count].t = t;
+	z->points[z->count].temp = temp;
+	z->count++;
+	return REPLAY_OK;
+}
+
+static int add_server(replay_t *r, double t, bool up, const char *schedule){
+	replay_server_t *server;
+	replay_server_t *s;
+
+	if (r->nserver > 0 && t < r->server[r->nserver - 1].t){
+		return REPLAY_ERR;
+	}
+	if ((r->nserver & (r->nserver - 1)) == 0){
+		server = realloc(r->server, (r->nserver ? r->nserver * 2 : 1) * sizeof(*server));
+		if (server == NULL){
+			return REPLAY_ERR;
+		}
+		r->server = server;
+	}
+	s = &r->server[r->nserver];
+	s->t = t;
+	s->up = up;
+	s->schedule = NULL;
+	if (schedule != NULL && (s->schedule = strdup(schedule)) == NULL){
+		return REPLAY_ERR;
+	}
+	r->nserver++;
+	return REPLAY_OK;
+}
+
+/**
+ *  Parses one "<t> <event> ..." line, zones are matched by name
+ */
+static int parse_event(replay_t *r, char *line, const zone_t *zones, uint32_t nzones){
+	char *p, *event, *arg, *zone;
+	double t, temp;
+	uint32_t i;
+	bool any = false;
+
+	t = strtod(line, &p);
+	if (p == line || t < 0){
+		return REPLAY_ERR;
+	}
+	event = strtok_r(p, " \t", &p);
+	if (event == NULL){
+		return REPLAY_ERR;
+	}
+	if (!strcmp(event, "schedule")){
+		while (*p == ' ' || *p == '\t'){
+			p++;
+		}
+		return strlen(p) ? add_server(r, t, true, p) : REPLAY_ERR;
+	}
+	arg = strtok_r(NULL, " \t", &p);
+	if (arg == NULL){
+		return REPLAY_ERR;
+	}
+	if (!strcmp(event, "server")){
+		if (strcmp(arg, "up") && strcmp(arg, "down")){
+			return REPLAY_ERR;
+		}
+		return add_server(r, t, !strcmp(arg, "up"), NULL);
+	}
+	if (strcmp(event, "temp")){
+		return REPLAY_ERR;
+	}
+	temp = strtod(arg, &p);
+	if (p == arg){
+		return REPLAY_ERR;
+	}
+	zone = strtok_r(NULL, " \t", &p);
+	for (i = 0; i < nzones; i++){
+		if (zone == NULL || !strcmp(zone, zones[i].name)){
+			if (add_point(&r->zones[i], t, temp) != REPLAY_OK){
+				return REPLAY_ERR;
+			}
+			any = true;
+		}
+	}
+	return any ? REPLAY_OK : REPLAY_ERR;
+}
+
+/**
+ *  Reads a trace for the given zones, parse errors go to out with the line number
+ */
+int replay_open(replay_t *r, const char *path, const zone_t *zones, uint32_t nzones, FILE *out){
+	FILE *fp = fopen(path, "r");
+	char line[REPLAY_LINE_SIZE];
+	uint32_t lineno = 0, i;
+	double last = 0;
+	size_t len;
+	int ret = REPLAY_OK;
+
+	memset(r, 0, sizeof(*r));
+	r->out = out;
+	r->end = -1;
+	r->up = true;
+	if (fp == NULL){
+		fprintf(out, "can't open %s\n", path);
+		return REPLAY_ERR;
+	}
+	r->zones = calloc(nzones, sizeof(replay_zone_t));
+	if (r->zones == NULL){
+		fclose(fp);
+		return REPLAY_ERR;
+	}
+	r->nzones = nzones;
+
+	while (ret == REPLAY_OK && fgets(line, sizeof(line), fp) != NULL){
+		lineno++;
+		len = strlen(line);
+		while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')){
+			line[--len] = '\0';
+		}
+		if (len == 0 || line[0] == '#'){
+			continue;
+		}
+		if (!strncmp(line, "start ", strlen("start "))){
+			r->start = (time_t) strtoll(line + strlen("start "), NULL, 10);
+		}
+		else if (!strncmp(line, "end ", strlen("end "))){
+			r->end = strtod(line + strlen("end "), NULL);
+		}
+		else if (parse_event(r, line, zones, nzones) != REPLAY_OK){
+			fprintf(out, "%s:%u: bad or out of order event\n", path, lineno);
+			ret = REPLAY_ERR;
+		}
+	}
+	fclose(fp);
+	if (ret != REPLAY_OK){
+		return ret;
+	}
+
+	for (i = 0; i < nzones; i++){
+		if (r->zones[i].count == 0){
+			fprintf(out, "%s: no temp for zone %s\n", path, zones[i].name);
+			return REPLAY_ERR;
+		}
+		if (r->zones[i].points[r->zones[i].count - 1].t > last){
+			last = r->zones[i].points[r->zones[i].count - 1].t;
+		}
+	}
+	if (r->nserver > 0 && r->server[r->nserver - 1].t > last){
+		last = r->server[r->nserver - 1].t;
+	}
+	if (r->end < 0){
+		r->end = last;
+	}
+	return REPLAY_OK;
+}
+
+/**
+ *  Sensor value at t, linear between trace points and held past the ends
+ */
+static double interpolate(replay_zone_t *z, double t){
+	replay_point_t *a, *b;
+
+	while (z->cur + 1 < z->count && z->points[z->cur + 1].t <= t){
+		z->cur++;
+	}
+	a = &z->points[z->cur];
+	if (z->cur + 1 == z->count || t <= a->t){
+		return a->temp;
+	}
+	b = &z->points[z->cur + 1];
+	return a->temp + (b->temp - a->temp) * (t - a->t) / (b->t - a->t);
+}
+
+/**
+ *  Moves the scripted world on to now: applies server events and feeds
+ *  each zone's sampler, returns REPLAY_END once the trace is over
+ */
+int replay_advance(replay_t *r, double now, zone_t *zones, uint32_t nzones, uint32_t samples_per_tick){
+	uint32_t i, j;
+	double temp;
+
+	if (now > r->end){
+		return REPLAY_END;
+	}
+	r->now = now;
+	r->wakeups++;
+	r->samples_per_tick = samples_per_tick;
+	while (r->cur < r->nserver && r->server[r->cur].t <= now){
+		r->up = r->server[r->cur].up;
+		if (r->server[r->cur].schedule != NULL){
+			r->schedule = r->server[r->cur].schedule;
+		}
+		r->cur++;
+	}
+	for (i = 0; i < nzones; i++){
+		temp = interpolate(&r->zones[i], now);
+		for (j = 0; j < samples_per_tick; j++){
+			sampler_push(&zones[i].sampler, temp);
+		}
+	}
+	return REPLAY_OK;
+}
+
+/**
+ *  Prints heater flips and accumulates the summary, call after each tick
+ */
+void replay_observe(replay_t *r, const zone_t *zones, uint32_t nzones){
+	replay_zone_t *z;
+	uint32_t i;
+	double error;
+
+	for (i = 0; i < nzones; i++){
+		z = &r->zones[i];
+		if (!zones[i].valid){
+			continue;
+		}
+		/* the state held since the last tick, which may be many periods back */
+		if (z->ticks > 0){
+			if (z->on){
+				z->on_time += r->now - z->changed_at;
+			}
+			z->error_sum += z->error * (r->now - z->changed_at);
+		}
+		z->changed_at = r->now;
+		if (zones[i].heater_on != z->on || z->ticks == 0){
+			fprintf(r->out, "%10.0f %s%s%s %s temp %.2f setpoint %.2f\n", r->now,
+				nzones > 1 ? "zone " : "", nzones > 1 ? zones[i].name : "", nzones > 1 ? ":" : "",
+				zones[i].heater_on ? "ON " : "OFF", zones[i].temp, zones[i].setpoint);
+			if (zones[i].heater_on && z->ticks > 0){
+				z->cycles++;
+			}
+		}
+		z->on = zones[i].heater_on;
+		error = zones[i].temp - zones[i].setpoint;
+		z->error = error < 0 ? -error : error;
+		if (error > z->overshoot){
+			z->overshoot = error;
+		}
+		if (-error > z->undershoot){
+			z->undershoot = -error;
+		}
+		z->ticks++;
+	}
+}
+
+/**
+ *  Stands in for the server, GETs get the scripted schedule
+ */
+int replay_request(replay_t *r, int8_t method, const char *body, net_buffer_t *response){
+	if (!r->up){
+		r->failures++;
+		return NET_REQ_ERR;
+	}
+	if (method == GET){
+		r->gets++;
+		if (response != NULL){
+			response->len = 0;
+			if (r->schedule == NULL){
+				/* no schedule yet, an empty object parses to no setpoints */
+				return net_buffer_append(response, "{}", 2);
+			}
+			return net_buffer_append(response, r->schedule, strlen(r->schedule));
+		}
+		return NET_OK;
+	}
+	r->posts++;
+	if (body != NULL){
+		r->bytes_out += strlen(body);
+	}
+	return NET_OK;
+}
+
+/**
+ *  Summary per zone, elapsed is the real time the replay took
+ */
+void replay_report(replay_t *r, const zone_t *zones, uint32_t nzones, double elapsed){
+	replay_zone_t *z;
+	uint32_t i;
+
+	fprintf(r->out, "simulated: %.0f s in %.2f s (%.0fx)\n", r->now, elapsed,
+		elapsed > 0 ? r->now / elapsed : 0);
+	fprintf(r->out, "requests: %llu gets, %llu posts, %llu failed, %llu bytes posted\n",
+		(unsigned long long) r->gets, (unsigned long long) r->posts,
+		(unsigned long long) r->failures, (unsigned long long) r->bytes_out);
+	if (r->now > 0){
+		fprintf(r->out, "wakeups: %llu, %.1f per hour\n", (unsigned long long) r->wakeups,
+			r->wakeups * 3600.0 / r->now);
+	}
+	for (i = 0; i < nzones; i++){
+		z = &r->zones[i];
+		fprintf(r->out, "zone %s: %llu ticks, %llu cycles", zones[i].name,
+			(unsigned long long) z->ticks, (unsigned long long) z->cycles);
+		if (r->now > 0 && z->ticks > 0){
+			fprintf(r->out, ", %.2f cycles per hour, heater on %.1f%%, mean error %.2f",
+				z->cycles * 3600.0 / r->now, 100.0 * z->on_time / r->now, z->error_sum / r->now);
+		}
+		fprintf(r->out, ", max overshoot %.2f, max undershoot %.2f\n", z->overshoot, z->undershoot);
+	}
+}
+
+void replay_close(replay_t *r){
+	uint32_t i;
+
+	for (i = 0; i < r->nzones; i++){
+		free(r->zones[i].points);
+	}
+	for (i = 0; i < r->nserver; i++){
+		free(r->server[i].schedule);
+	}
+	free(r->zones);
+	free(r->server);
+	memset(r, 0, sizeof(*r));
+}
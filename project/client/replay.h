@@ -0,0 +1,94 @@
+/*
+ *  Deterministic replay of the whole control loop for thermd
+ *
+ *  A replay trace scripts the sensors and the server on a virtual clock,
+ *  one event per line, times in seconds from the start of the replay:
+ *
+ *  start 1700000000                 wall clock (unix time) at t=0, default 0
+ *  end 2592000                      stop after this long, default the last event
+ *  0 temp 66.5 [zone]               sensor reading, interpolated between lines,
+ *                                   without a zone it applies to every zone
+ *  0 schedule {"time1":...}         what the server answers GETs with from then on
+ *  3600 server down|up              the server stops/starts answering
+ *
+ *  The daemon's loop runs tick by tick against it as fast as it can, the
+ *  heater decisions are printed as they happen and a summary at the end.
+ */
+
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include "zone.h"
+#include "net.h"
+
+#define REPLAY_OK	0
+#define REPLAY_ERR	1
+#define REPLAY_END	2
+
+typedef struct {
+	double t;
+	double temp;
+}replay_point_t;
+
+/* one zone's sensor trace and what the loop did with it */
+typedef struct {
+	replay_point_t *points;
+	uint32_t count;
+	uint32_t cur;
+	/* results */
+	bool on;
+	double changed_at;
+	uint64_t cycles;
+	double on_time;
+	/* |temp - setpoint| at the last tick, and its integral over time */
+	double error;
+	double error_sum;
+	uint64_t ticks;
+	double overshoot;
+	double undershoot;
+}replay_zone_t;
+
+typedef struct {
+	double t;
+	bool up;
+	/* NULL keeps the schedule already being served */
+	char *schedule;
+}replay_server_t;
+
+typedef struct {
+	FILE *out;
+	time_t start;
+	double end;
+	replay_zone_t *zones;
+	uint32_t nzones;
+	replay_server_t *server;
+	uint32_t nserver;
+	uint32_t cur;
+	/* samples fed to each zone per tick, like the sampler thread would */
+	uint32_t samples_per_tick;
+	/* server state at the current tick */
+	bool up;
+	const char *schedule;
+	double now;
+	/* ticks the loop woke for, fewer than control_period allows with power=low */
+	uint64_t wakeups;
+	/* requests the loop made */
+	uint64_t gets;
+	uint64_t posts;
+	uint64_t failures;
+	uint64_t bytes_out;
+}replay_t;
+
+/* Function prototypes */
+int replay_open(replay_t *r, const char *path, const zone_t *zones, uint32_t nzones, FILE *out);
+int replay_advance(replay_t *r, double now, zone_t *zones, uint32_t nzones, uint32_t samples_per_tick);
+void replay_observe(replay_t *r, const zone_t *zones, uint32_t nzones);
+int replay_request(replay_t *r, int8_t method, const char *body, net_buffer_t *response);
+void replay_report(replay_t *r, const zone_t *zones, uint32_t nzones, double elapsed);
+void replay_close(replay_t *r);
+
+#endif
@@ -0,0 +1,159 @@
+/*
+ *  Background sensor acquisition for thermd
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <syslog.h>
+#include "sampler.h"
+#include "metrics.h"
+#include "ticker.h"
+
+#define NSEC_PER_SEC 1000000000L
+
+/* a filtered value older than this many sample periods (or 2s) is stale */
+#define SAMPLER_STALE_PERIODS 5
+
+typedef struct {
+	sampler_t **samplers;
+	uint32_t count;
+	uint32_t rate_hz;
+	pthread_t thread;
+}sampler_group_t;
+
+static sampler_group_t group;
+
+static void take_sample(sampler_t *s){
+	double temp;
+	uint64_t start = metrics_start();
+	int ret = sensor_read(s->sensor, &temp);
+
+	metrics_stop(METRIC_SENSOR, start);
+
+	pthread_mutex_lock(&s->lock);
+	if (ret == SENSOR_OK){
+		filter_push(&s->filter, temp);
+		s->samples++;
+		s->last_sample = ticker_now();
+	}
+	else{
+		s->errors++;
+	}
+	pthread_mutex_unlock(&s->lock);
+}
+
+/**
+ *  Samples every sensor on absolute deadlines so the rate doesn't drift with read time
+ */
+static void *sampler_thread(void *arg){
+	sampler_group_t *g = arg;
+	struct timespec next;
+	long period = NSEC_PER_SEC / g->rate_hz;
+	uint32_t i;
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	while (1){
+		for (i = 0; i < g->count; i++){
+			take_sample(g->samplers[i]);
+		}
+
+		next.tv_nsec += period;
+		while (next.tv_nsec >= NSEC_PER_SEC){
+			next.tv_nsec -= NSEC_PER_SEC;
+			next.tv_sec++;
+		}
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR);
+	}
+	return NULL;
+}
+
+static uint32_t clamp_rate(uint32_t rate_hz){
+	if (rate_hz == 0){
+		return 1;
+	}
+	return rate_hz > SAMPLER_MAX_RATE ? SAMPLER_MAX_RATE : rate_hz;
+}
+
+/**
+ *  Sets up a sampler and takes a first sample synchronously, so the
+ *  control loop has a value straight away. Without a sensor it only
+ *  gets what sampler_push() feeds it.
+ */
+void sampler_init(sampler_t *s, sensor_t *sensor, uint32_t rate_hz, uint8_t filter_type, uint32_t window, double alpha){
+	memset(s, 0, sizeof(*s));
+	s->sensor = sensor;
+	s->rate_hz = clamp_rate(rate_hz);
+	filter_init(&s->filter, filter_type, window, alpha);
+	pthread_mutex_init(&s->lock, NULL);
+	if (sensor != NULL){
+		take_sample(s);
+	}
+}
+
+/**
+ *  Starts the one acquisition thread shared by all samplers
+ */
+int sampler_start(sampler_t **samplers, uint32_t count, uint32_t rate_hz){
+	group.samplers = samplers;
+	group.count = count;
+	group.rate_hz = clamp_rate(rate_hz);
+	if (pthread_create(&group.thread, NULL, sampler_thread, &group) != 0){
+		syslog(LOG_ERR, "Couldn't start sampler thread\n");
+		return SAMPLER_ERR;
+	}
+	return SAMPLER_OK;
+}
+
+/**
+ *  Gets the decimated value for this control tick
+ *  Fails if the sensor hasn't produced a sample recently, so a dead
+ *  sensor doesn't keep driving the heater from a stale average
+ */
+int sampler_get(sampler_t *s, double *value){
+	double stale = (double) SAMPLER_STALE_PERIODS / s->rate_hz;
+	int ret;
+
+	if (stale < 2.0){
+		stale = 2.0;
+	}
+	pthread_mutex_lock(&s->lock);
+	ret = filter_value(&s->filter, value);
+	if (ticker_now() - s->last_sample > stale){
+		ret = FILTER_EMPTY;
+	}
+	pthread_mutex_unlock(&s->lock);
+	return ret == FILTER_OK ? SAMPLER_OK : SAMPLER_ERR;
+}
+
+/**
+ *  Takes n samples right now on the calling thread, for low power mode
+ *  where no sampler thread wakes up between ticks
+ */
+void sampler_poll(sampler_t *s, uint32_t n){
+	while (n-- > 0){
+		take_sample(s);
+	}
+}
+
+/**
+ *  Feeds a value in as if the sensor had read it, replays use this
+ *  instead of starting the sampler thread
+ */
+void sampler_push(sampler_t *s, double value){
+	pthread_mutex_lock(&s->lock);
+	filter_push(&s->filter, value);
+	s->samples++;
+	s->last_sample = ticker_now();
+	pthread_mutex_unlock(&s->lock);
+}
+
+/**
+ *  Copies the sample counters
+ */
+void sampler_stats(sampler_t *s, uint64_t *samples, uint64_t *errors){
+	pthread_mutex_lock(&s->lock);
+	*samples = s->samples;
+	*errors = s->errors;
+	pthread_mutex_unlock(&s->lock);
+}
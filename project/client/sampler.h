@@ -0,0 +1,41 @@
+/*
+ *  Background sensor acquisition for thermd
+ *
+ *  One sampler thread reads every zone's sensor at a fixed rate into that
+ *  zone's filter, the control loop takes the filtered value once per tick.
+ */
+
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "sensor.h"
+#include "filter.h"
+
+#define SAMPLER_OK	0
+#define SAMPLER_ERR	1
+
+#define SAMPLER_MAX_RATE 1000
+
+typedef struct {
+	sensor_t *sensor;
+	filter_t filter;
+	uint32_t rate_hz;
+	pthread_mutex_t lock;
+	/* counters, protected by lock */
+	uint64_t samples;
+	uint64_t errors;
+	/* ticker_now() time of the last good sample */
+	double last_sample;
+}sampler_t;
+
+/* Function prototypes */
+void sampler_init(sampler_t *s, sensor_t *sensor, uint32_t rate_hz, uint8_t filter_type, uint32_t window, double alpha);
+int sampler_start(sampler_t **samplers, uint32_t count, uint32_t rate_hz);
+int sampler_get(sampler_t *s, double *value);
+void sampler_push(sampler_t *s, double value);
+void sampler_poll(sampler_t *s, uint32_t n);
+void sampler_stats(sampler_t *s, uint64_t *samples, uint64_t *errors);
+
+#endif
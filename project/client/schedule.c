@@ -0,0 +1,197 @@
+/*
+ *  Setpoint schedule for thermd
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "schedule.h"
+
+static const char *day_names[DAYS_PER_WEEK] = {
+	"sun", "mon", "tue", "wed", "thu", "fri", "sat"
+};
+
+static int compare_transitions(const void *a, const void *b){
+	const transition_t *x = a;
+	const transition_t *y = b;
+	if (x->secs != y->secs){
+		return (x->secs > y->secs) - (x->secs < y->secs);
+	}
+	/* later entries win when two land on the same second */
+	return (x->entry > y->entry) - (x->entry < y->entry);
+}
+
+static bool same_entries(const schedule_t *sched, const setpoint_t *entries, uint16_t count){
+	uint16_t i;
+	if (sched->count != count){
+		return false;
+	}
+	for (i = 0; i < count; i++){
+		if (sched->entries[i].days != entries[i].days ||
+		    sched->entries[i].secs != entries[i].secs ||
+		    sched->entries[i].temp != entries[i].temp){
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ *  Expands the entries into transitions over the week, sorts them and
+ *  builds the bucket index. Does nothing if the entries match the
+ *  schedule already compiled, since the server resends it on every poll.
+ *  Before the first transition of the week the last one is still in effect.
+ */
+int schedule_compile(schedule_t *sched, const setpoint_t *entries, uint16_t count){
+	setpoint_t *copy;
+	transition_t *transitions;
+	uint32_t bucket, n = 0;
+	uint16_t i, current, next;
+	uint8_t day;
+
+	if (count == 0){
+		return SCHEDULE_ERR;
+	}
+	if (same_entries(sched, entries, count)){
+		return SCHEDULE_OK;
+	}
+
+	copy = malloc(count * sizeof(setpoint_t));
+	transitions = malloc(count * DAYS_PER_WEEK * sizeof(transition_t));
+	if (copy == NULL || transitions == NULL){
+		free(copy);
+		free(transitions);
+		return SCHEDULE_ERR;
+	}
+	memcpy(copy, entries, count * sizeof(setpoint_t));
+
+	for (i = 0; i < count; i++){
+		for (day = 0; day < DAYS_PER_WEEK; day++){
+			if (entries[i].days & (1 << day)){
+				transitions[n].secs = day * SECS_PER_DAY + entries[i].secs % SECS_PER_DAY;
+				transitions[n].entry = i;
+				n++;
+			}
+		}
+	}
+	if (n == 0 || n > UINT16_MAX){
+		free(copy);
+		free(transitions);
+		return SCHEDULE_ERR;
+	}
+	qsort(transitions, n, sizeof(transition_t), compare_transitions);
+
+	/* walk the week once, picking up each transition as its bucket starts */
+	current = n - 1;
+	next = 0;
+	for (bucket = 0; bucket < SCHEDULE_BUCKETS; bucket++){
+		while (next < n && transitions[next].secs <= bucket * SCHEDULE_BUCKET_SECS){
+			current = next++;
+		}
+		sched->bucket_index[bucket] = current;
+	}
+
+	free(sched->entries);
+	free(sched->transitions);
+	sched->entries = copy;
+	sched->count = count;
+	sched->transitions = transitions;
+	sched->ntransitions = n;
+	sched->version++;
+	return SCHEDULE_OK;
+}
+
+/**
+ *  Gets the setpoint in effect on day wday (0 is Sunday) at secs past midnight
+ *  The bucket index gives the transition at the start of the bucket, only
+ *  transitions later within that same bucket need checking.
+ */
+double schedule_lookup(const schedule_t *sched, uint8_t wday, uint32_t secs){
+	uint32_t now, start;
+	uint16_t i, next;
+
+	if (sched->ntransitions == 0){
+		return 0;
+	}
+	now = (wday % DAYS_PER_WEEK) * SECS_PER_DAY + secs % SECS_PER_DAY;
+	start = now - now % SCHEDULE_BUCKET_SECS;
+	i = sched->bucket_index[now / SCHEDULE_BUCKET_SECS];
+
+	/* wrapped from the previous week, the first transition is next */
+	next = sched->transitions[i].secs > start ? 0 : i + 1;
+	while (next < sched->ntransitions && sched->transitions[next].secs <= now){
+		i = next++;
+	}
+	return sched->entries[sched->transitions[i].entry].temp;
+}
+
+/**
+ *  Seconds from wday/secs until the next transition, SECS_PER_WEEK if the
+ *  schedule is empty
+ */
+uint32_t schedule_next_transition(const schedule_t *sched, uint8_t wday, uint32_t secs){
+	uint32_t now, start;
+	uint16_t i, next;
+
+	if (sched->ntransitions == 0){
+		return SECS_PER_WEEK;
+	}
+	now = (wday % DAYS_PER_WEEK) * SECS_PER_DAY + secs % SECS_PER_DAY;
+	start = now - now % SCHEDULE_BUCKET_SECS;
+	i = sched->bucket_index[now / SCHEDULE_BUCKET_SECS];
+
+	next = sched->transitions[i].secs > start ? 0 : i + 1;
+	while (next < sched->ntransitions && sched->transitions[next].secs <= now){
+		next++;
+	}
+	if (next == sched->ntransitions){
+		/* the next one is the first transition of next week */
+		return SECS_PER_WEEK - now + sched->transitions[0].secs;
+	}
+	return sched->transitions[next].secs - now;
+}
+
+void schedule_free(schedule_t *sched){
+	free(sched->entries);
+	free(sched->transitions);
+	sched->entries = NULL;
+	sched->transitions = NULL;
+	sched->count = 0;
+	sched->ntransitions = 0;
+}
+
+/**
+ *  Parses a day list such as "mon,wed,fri", "weekdays", "weekend" or
+ *  "all" into a day mask, returns 0 if nothing was recognised
+ */
+uint8_t schedule_days_from_string(const char *days){
+	uint8_t mask = 0;
+	uint8_t day;
+	const char *p = days;
+
+	while (*p){
+		while (*p == ',' || *p == ' '){
+			p++;
+		}
+		if (!strncasecmp(p, "weekdays", 8)){
+			mask |= DAYS_WEEKDAYS;
+		}
+		else if (!strncasecmp(p, "weekend", 7)){
+			mask |= DAYS_WEEKEND;
+		}
+		else if (!strncasecmp(p, "all", 3) || !strncasecmp(p, "daily", 5)){
+			mask |= DAYS_ALL;
+		}
+		else{
+			for (day = 0; day < DAYS_PER_WEEK; day++){
+				if (!strncasecmp(p, day_names[day], 3)){
+					mask |= 1 << day;
+				}
+			}
+		}
+		while (*p && *p != ','){
+			p++;
+		}
+	}
+	return mask;
+}
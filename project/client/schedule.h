@@ -0,0 +1,71 @@
+/*
+ *  Setpoint schedule for thermd
+ *
+ *  A schedule is a list of (days of week, time of day, temperature)
+ *  entries. It is compiled once when the server sends a new one into a
+ *  sorted table of transitions over the week plus a coarse bucket index,
+ *  so resolving the setpoint on every tick is a table lookup.
+ */
+
+#ifndef SCHEDULE_H
+#define SCHEDULE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define SCHEDULE_OK	0
+#define SCHEDULE_ERR	1
+
+#define SECS_PER_DAY 86400
+#define DAYS_PER_WEEK 7
+#define SECS_PER_WEEK (SECS_PER_DAY * DAYS_PER_WEEK)
+
+/* Day of week mask, bit 0 is Sunday to match tm_wday */
+#define DAY_SUN (1 << 0)
+#define DAY_MON (1 << 1)
+#define DAY_TUE (1 << 2)
+#define DAY_WED (1 << 3)
+#define DAY_THU (1 << 4)
+#define DAY_FRI (1 << 5)
+#define DAY_SAT (1 << 6)
+#define DAYS_WEEKDAYS (DAY_MON | DAY_TUE | DAY_WED | DAY_THU | DAY_FRI)
+#define DAYS_WEEKEND (DAY_SAT | DAY_SUN)
+#define DAYS_ALL (DAYS_WEEKDAYS | DAYS_WEEKEND)
+
+/* Granularity of the lookup index, 672 buckets over the week */
+#define SCHEDULE_BUCKET_SECS 900
+#define SCHEDULE_BUCKETS (SECS_PER_WEEK / SCHEDULE_BUCKET_SECS)
+
+typedef struct {
+	uint8_t days;
+	/* seconds since midnight */
+	uint32_t secs;
+	double temp;
+}setpoint_t;
+
+typedef struct {
+	/* seconds since Sunday midnight */
+	uint32_t secs;
+	/* index into the schedule's entries */
+	uint16_t entry;
+}transition_t;
+
+typedef struct {
+	setpoint_t *entries;
+	uint16_t count;
+	transition_t *transitions;
+	uint16_t ntransitions;
+	/* index into transitions of the one in effect at the start of each bucket */
+	uint16_t bucket_index[SCHEDULE_BUCKETS];
+	/* bumped every time a different schedule is compiled */
+	uint32_t version;
+}schedule_t;
+
+/* Function prototypes */
+int schedule_compile(schedule_t *sched, const setpoint_t *entries, uint16_t count);
+double schedule_lookup(const schedule_t *sched, uint8_t wday, uint32_t secs);
+uint32_t schedule_next_transition(const schedule_t *sched, uint8_t wday, uint32_t secs);
+void schedule_free(schedule_t *sched);
+uint8_t schedule_days_from_string(const char *days);
+
+#endif
@@ -0,0 +1,270 @@
+/*
+ *  Temperature sensor backends for thermd
+ *
+ *  Supported specs (see sensor.h):
+ *  file:/tmp/temp                                 text written by the thermocouple service
+ *  hwmon:/sys/class/hwmon/hwmon0/temp1_input      millidegrees Celsius
+ *  iio:/sys/bus/iio/devices/iio:device0/in_temp_raw  raw counts, scaled by in_temp_scale/offset
+ *  w1:/sys/bus/w1/devices/28-xxxx/w1_slave        DS18B20 style 1-wire output
+ *  fake:/path/to/trace                            one value per line, replayed in a loop
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <sys/stat.h>
+#include "sensor.h"
+
+#define SENSOR_BUF_SIZE 128
+
+/* DS18B20 power-on reset value, millidegrees */
+#define W1_POWER_ON 85000
+
+/**
+ *  Reads the whole (small) sysfs/text node from offset 0 into buf
+ *  sysfs regenerates the contents on every read at offset 0, so the fd can stay open
+ */
+static int read_node(int fd, char *buf, size_t size){
+	ssize_t n = pread(fd, buf, size - 1, 0);
+	if (n <= 0){
+		return SENSOR_ERR;
+	}
+	buf[n] = '\0';
+	return SENSOR_OK;
+}
+
+/**
+ *  Reads a single number out of a small file, used for IIO scale/offset attributes
+ */
+static int read_attribute(const char *path, double *value){
+	char buf[SENSOR_BUF_SIZE];
+	int fd = open(path, O_RDONLY);
+	int ret;
+	if (fd < 0){
+		return SENSOR_ERR;
+	}
+	ret = read_node(fd, buf, sizeof(buf));
+	close(fd);
+	if (ret != SENSOR_OK){
+		return ret;
+	}
+	*value = strtod(buf, NULL);
+	return SENSOR_OK;
+}
+
+static bool ends_with(const char *string, const char *suffix){
+	size_t slen = strlen(string);
+	size_t xlen = strlen(suffix);
+	return slen >= xlen && !strcmp(string + slen - xlen, suffix);
+}
+
+static int open_node(sensor_t *s){
+	s->fd = open(s->path, O_RDONLY);
+	if (s->fd < 0){
+		return SENSOR_ERR;
+	}
+	return SENSOR_OK;
+}
+
+static void close_node(sensor_t *s){
+	if (s->fd >= 0){
+		close(s->fd);
+	}
+	s->fd = -1;
+}
+
+/**
+ *  Plain text value, already in the units the setpoints use
+ */
+static int file_open(sensor_t *s){
+	s->offset = 0;
+	s->scale = 1;
+	return open_node(s);
+}
+
+static int file_read(sensor_t *s, double *temp){
+	char buf[SENSOR_BUF_SIZE];
+	char *end;
+	struct stat st;
+	/* a writer that renames a new file into place leaves the old one
+	 * unlinked but still readable through the fd, with a stale value */
+	if (fstat(s->fd, &st) < 0 || st.st_nlink == 0 || read_node(s->fd, buf, sizeof(buf)) != SENSOR_OK){
+		/* the writer may have replaced the file, re-open it once */
+		close_node(s);
+		if (open_node(s) != SENSOR_OK || read_node(s->fd, buf, sizeof(buf)) != SENSOR_OK){
+			return SENSOR_ERR;
+		}
+	}
+	*temp = strtod(buf, &end);
+	return end == buf ? SENSOR_ERR : SENSOR_OK;
+}
+
+/**
+ *  hwmon temp*_input nodes report millidegrees Celsius
+ */
+static int hwmon_open(sensor_t *s){
+	s->offset = 0;
+	s->scale = 0.001;
+	return open_node(s);
+}
+
+static int integer_read(sensor_t *s, double *temp){
+	char buf[SENSOR_BUF_SIZE];
+	char *end;
+	if (read_node(s->fd, buf, sizeof(buf)) != SENSOR_OK){
+		return SENSOR_ERR;
+	}
+	*temp = strtod(buf, &end);
+	return end == buf ? SENSOR_ERR : SENSOR_OK;
+}
+
+/**
+ *  IIO channels are either processed (*_input, millidegrees) or raw
+ *  counts that need the channel's scale and offset applied
+ */
+static int iio_open(sensor_t *s){
+	char attr[SENSOR_PATH_SIZE];
+	size_t base;
+
+	s->offset = 0;
+	s->scale = 0.001;
+	if (ends_with(s->path, "_raw")){
+		base = strlen(s->path) - strlen("_raw");
+		snprintf(attr, sizeof(attr), "%.*s_scale", (int) base, s->path);
+		if (read_attribute(attr, &s->scale) == SENSOR_OK){
+			/* IIO scale yields millidegrees */
+			s->scale /= 1000.0;
+		}
+		snprintf(attr, sizeof(attr), "%.*s_offset", (int) base, s->path);
+		read_attribute(attr, &s->offset);
+	}
+	return open_node(s);
+}
+
+/**
+ *  w1_slave holds the scratchpad with a CRC verdict on the first line
+ *  and "t=<millidegrees>" on the second, the newer "temperature" node
+ *  is just the millidegree value
+ */
+static int w1_open(sensor_t *s){
+	s->offset = 0;
+	s->scale = 0.001;
+	return open_node(s);
+}
+
+static int w1_read(sensor_t *s, double *temp){
+	char buf[SENSOR_BUF_SIZE];
+	char *t, *end;
+	if (read_node(s->fd, buf, sizeof(buf)) != SENSOR_OK){
+		return SENSOR_ERR;
+	}
+	if (strstr(buf, "crc=") == NULL){
+		t = buf;
+	}
+	else if (strstr(buf, "YES") == NULL || (t = strstr(buf, "t=")) == NULL){
+		return SENSOR_ERR;
+	}
+	else{
+		t += 2;
+	}
+	*temp = strtod(t, &end);
+	/* 85 C is what the scratchpad holds before the first conversion,
+	 * and it passes the CRC */
+	return end == t || *temp == W1_POWER_ON ? SENSOR_ERR : SENSOR_OK;
+}
+
+/**
+ *  Replays a file of values, one per line, wrapping around at the end
+ */
+static int fake_open(sensor_t *s){
+	s->offset = 0;
+	s->scale = 1;
+	s->pos = 0;
+	return open_node(s);
+}
+
+static int fake_read(sensor_t *s, double *temp){
+	char buf[SENSOR_BUF_SIZE];
+	char *end;
+	ssize_t n;
+	int tries;
+
+	for (tries = 0; tries < 2; tries++){
+		n = pread(s->fd, buf, sizeof(buf) - 1, s->pos);
+		if (n <= 0){
+			/* end of trace, start over */
+			s->pos = 0;
+			continue;
+		}
+		buf[n] = '\0';
+		end = strchr(buf, '\n');
+		s->pos += end ? (end - buf) + 1 : n;
+		*temp = strtod(buf, &end);
+		return end == buf ? SENSOR_ERR : SENSOR_OK;
+	}
+	return SENSOR_ERR;
+}
+
+static const sensor_backend_t backends[] = {
+	{ "file",	false,	file_open,	file_read,	close_node },
+	{ "hwmon",	true,	hwmon_open,	integer_read,	close_node },
+	{ "iio",	true,	iio_open,	integer_read,	close_node },
+	{ "w1",		true,	w1_open,	w1_read,	close_node },
+	{ "fake",	false,	fake_open,	fake_read,	close_node },
+};
+
+/**
+ *  Opens a sensor from a "backend:path" spec, a spec without a known
+ *  backend prefix is treated as a plain file path
+ */
+int sensor_open(sensor_t *s, const char *spec, bool fahrenheit){
+	const char *colon = strchr(spec, ':');
+	size_t i;
+
+	memset(s, 0, sizeof(*s));
+	s->fd = -1;
+	s->backend = &backends[0];
+	s->fahrenheit = fahrenheit;
+	strncpy(s->path, spec, SENSOR_PATH_SIZE - 1);
+
+	if (colon != NULL){
+		for (i = 0; i < sizeof(backends) / sizeof(backends[0]); i++){
+			if (strlen(backends[i].name) == (size_t)(colon - spec) &&
+			    !strncmp(spec, backends[i].name, colon - spec)){
+				s->backend = &backends[i];
+				strncpy(s->path, colon + 1, SENSOR_PATH_SIZE - 1);
+				break;
+			}
+		}
+	}
+
+	if (s->backend->open(s) != SENSOR_OK){
+		syslog(LOG_ERR, "Couldn't open %s sensor %s\n", s->backend->name, s->path);
+		return SENSOR_ERR;
+	}
+	return SENSOR_OK;
+}
+
+/**
+ *  Takes one sample, scaled to degrees
+ */
+int sensor_read(sensor_t *s, double *temp){
+	double raw;
+	if (s->backend->read(s, &raw) != SENSOR_OK){
+		return SENSOR_ERR;
+	}
+	*temp = (raw + s->offset) * s->scale;
+	if (s->fahrenheit && s->backend->celsius){
+		*temp = *temp * 9.0 / 5.0 + 32.0;
+	}
+	return SENSOR_OK;
+}
+
+void sensor_close(sensor_t *s){
+	if (s->backend != NULL){
+		s->backend->close(s);
+	}
+}
@@ -0,0 +1,49 @@
+/*
+ *  Temperature sensor backends for thermd
+ *
+ *  A sensor is opened once from a "backend:path" spec and then read on
+ *  every sample through a held-open file descriptor, so a sample costs a
+ *  single pread() instead of an open/parse/close of a text file. file:
+ *  sensors also fstat() the fd to notice a file renamed over theirs.
+ */
+
+#ifndef SENSOR_H
+#define SENSOR_H
+
+#include <stdbool.h>
+
+#define SENSOR_OK	0
+#define SENSOR_ERR	1
+
+#define SENSOR_PATH_SIZE 256
+
+typedef struct sensor sensor_t;
+
+typedef struct {
+	const char *name;
+	/* reports degrees Celsius rather than the setpoint units */
+	bool celsius;
+	int (*open)(sensor_t *s);
+	int (*read)(sensor_t *s, double *temp);
+	void (*close)(sensor_t *s);
+}sensor_backend_t;
+
+struct sensor {
+	const sensor_backend_t *backend;
+	char path[SENSOR_PATH_SIZE];
+	int fd;
+	/* temp = (raw + offset) * scale, filled in by the backend on open */
+	double offset;
+	double scale;
+	/* replay position for the fake backend */
+	long pos;
+	/* convert Celsius readings to Fahrenheit */
+	bool fahrenheit;
+};
+
+/* Function prototypes */
+int sensor_open(sensor_t *s, const char *spec, bool fahrenheit);
+int sensor_read(sensor_t *s, double *temp);
+void sensor_close(sensor_t *s);
+
+#endif
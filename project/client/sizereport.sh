@@ -0,0 +1,82 @@
+#!/bin/bash
+#
+#  Footprint report for thermd builds
+#
+#  For each binary: file size, text/data/bss, the shared libraries it
+#  pulls in (what they add to flash), the time from exec to the first
+#  completed tick, and memory after running against the local mockserver
+#  for a few seconds.
+#
+#  ./sizereport.sh ./thermd ./thermd-tiny
+#  SECS=10 PORT=19100 ./sizereport.sh ...
+#
+
+SECS=${SECS:-5}
+PORT=${PORT:-19100}
+DIR=$(cd "$(dirname "$0")" && pwd)
+WORK=$(mktemp -d /tmp/thermd-size.XXXXXX)
+
+cleanup(){
+	[ -n "$MOCK_PID" ] && kill "$MOCK_PID" 2>/dev/null
+	[ -n "$THERMD_PID" ] && kill "$THERMD_PID" 2>/dev/null
+	rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+printf '68\n69\n70\n71\n72\n71\n70\n69\n' > "$WORK/trace"
+cat > "$WORK/thermd.conf" <<EOF
+endpoint=127.0.0.1:$PORT
+logfile=$WORK/thermd.log
+sensor=fake:$WORK/trace
+timezone=UTC
+control_period=0.1
+telemetry_period=0.1
+poll_min=0.1
+poll_max=0.1
+status=$WORK/status
+EOF
+
+"$DIR/mockserver" -p "$PORT" > /dev/null &
+MOCK_PID=$!
+sleep 0.3
+
+# kB of a /proc/PID/status or smaps_rollup field
+field(){
+	awk -v name="$2:" '$1 == name { print $2 }' "$1" 2>/dev/null
+}
+
+printf "%-14s %9s %9s %7s %7s %5s %9s %9s %8s %8s %8s\n" \
+	binary bytes text data bss libs "libs kB" "start ms" "RSS kB" "peak kB" "PSS kB"
+for bin in "$@"; do
+	read -r text data bss _ < <(size "$bin" | tail -1)
+	libs=0
+	libs_kb=0
+	for lib in $(ldd "$bin" 2>/dev/null | awk '/=> \// { print $3 } /^\t\// { print $1 }'); do
+		libs=$((libs + 1))
+		libs_kb=$((libs_kb + $(stat -L -c %s "$lib") / 1024))
+	done
+
+	rm -f "$WORK/status"
+	start=$(date +%s%N)
+	"$bin" -f -c "$WORK/thermd.conf" 2>/dev/null &
+	THERMD_PID=$!
+	# the status file is written by the first tick
+	until [ -s "$WORK/status" ]; do
+		if ! kill -0 "$THERMD_PID" 2>/dev/null; then
+			echo "$bin exited before its first tick"
+			exit 1
+		fi
+	done
+	ready=$(( ($(date +%s%N) - start) / 1000000 ))
+	sleep "$SECS"
+	rss=$(field /proc/$THERMD_PID/status VmRSS)
+	peak=$(field /proc/$THERMD_PID/status VmHWM)
+	pss=$(field /proc/$THERMD_PID/smaps_rollup Pss)
+	kill "$THERMD_PID"
+	wait "$THERMD_PID" 2>/dev/null
+	THERMD_PID=
+
+	printf "%-14s %9d %9d %7d %7d %5d %9d %9d %8s %8s %8s\n" "$(basename "$bin")" \
+		"$(stat -L -c %s "$bin")" "$text" "$data" "$bss" "$libs" "$libs_kb" "$ready" \
+		"${rss:--}" "${peak:--}" "${pss:--}"
+done
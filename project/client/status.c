@@ -0,0 +1,132 @@
+/*
+ *  Heater status publisher for thermd
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "status.h"
+#include "ticker.h"
+
+#define STATUS_SHM_PREFIX "shm:"
+
+static int open_shm(status_t *st){
+	int fd = shm_open(st->path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (fd < 0){
+		return STATUS_ERR;
+	}
+	if (ftruncate(fd, sizeof(thermd_shm_t)) < 0){
+		close(fd);
+		return STATUS_ERR;
+	}
+	st->shm = mmap(NULL, sizeof(thermd_shm_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	/* the mapping stays valid without the fd */
+	close(fd);
+	if (st->shm == MAP_FAILED){
+		st->shm = NULL;
+		return STATUS_ERR;
+	}
+	/* a writer that died mid-update left it odd, readers would wait forever */
+	__atomic_store_n(&st->shm->seq, 0, __ATOMIC_RELEASE);
+	thermd_seqlock_write_begin(&st->shm->seq);
+	st->shm->magic = THERMD_SHM_MAGIC;
+	st->shm->version = THERMD_SHM_VERSION;
+	thermd_seqlock_write_end(&st->shm->seq);
+	return STATUS_OK;
+}
+
+/**
+ *  Sets up a publisher from a status spec, a plain path for the text
+ *  file or "shm:/name" for a shared memory segment
+ */
+int status_open(status_t *st, const char *spec, bool fsync, double heartbeat){
+	memset(st, 0, sizeof(*st));
+	st->fsync = fsync;
+	st->heartbeat = heartbeat;
+
+	if (!strncmp(spec, STATUS_SHM_PREFIX, strlen(STATUS_SHM_PREFIX))){
+		st->mode = STATUS_SHM;
+		strncpy(st->path, spec + strlen(STATUS_SHM_PREFIX), STATUS_PATH_SIZE - 1);
+		if (open_shm(st) != STATUS_OK){
+			syslog(LOG_ERR, "Couldn't create shared memory %s\n", st->path);
+			return STATUS_ERR;
+		}
+		return STATUS_OK;
+	}
+
+	st->mode = STATUS_FILE;
+	strncpy(st->path, spec, STATUS_PATH_SIZE - 1);
+	/* the temp file sits next to the real one so rename() stays on one filesystem */
+	snprintf(st->tmp_path, sizeof(st->tmp_path), "%s.tmp", st->path);
+	return STATUS_OK;
+}
+
+/**
+ *  Writes "ON : <timestamp>" to a temp file and renames it over the
+ *  status file, so readers only ever see a complete file
+ */
+static int write_file(status_t *st, bool heater_on, unsigned long timestamp){
+	FILE *statusFP = fopen(st->tmp_path, "w");
+	if (statusFP == NULL){
+		syslog(LOG_INFO, "Couldn't open %s for writing\n", st->tmp_path);
+		return STATUS_ERR;
+	}
+	fprintf(statusFP, "%s : %lu", heater_on ? "ON" : "OFF", timestamp);
+	if (fflush(statusFP) != 0 || (st->fsync && fsync(fileno(statusFP)) < 0)){
+		fclose(statusFP);
+		unlink(st->tmp_path);
+		return STATUS_ERR;
+	}
+	fclose(statusFP);
+	if (rename(st->tmp_path, st->path) < 0){
+		unlink(st->tmp_path);
+		return STATUS_ERR;
+	}
+	return STATUS_OK;
+}
+
+static void write_shm(status_t *st, bool heater_on, unsigned long timestamp){
+	thermd_seqlock_write_begin(&st->shm->seq);
+	st->shm->heater_on = heater_on;
+	st->shm->timestamp = timestamp;
+	thermd_seqlock_write_end(&st->shm->seq);
+}
+
+/**
+ *  Publishes the heater state if it changed or the heartbeat is due
+ *  now is CLOCK_MONOTONIC seconds, the published timestamp is wall clock
+ */
+void status_publish(status_t *st, bool heater_on, double now){
+	unsigned long timestamp = (unsigned long) ticker_time();
+
+	if (st->published && st->heater_on == heater_on && now - st->last_time < st->heartbeat){
+		st->skipped++;
+		return;
+	}
+
+	if (st->mode == STATUS_SHM){
+		write_shm(st, heater_on, timestamp);
+	}
+	else if (write_file(st, heater_on, timestamp) != STATUS_OK){
+		/* try again next tick */
+		st->errors++;
+		return;
+	}
+	st->writes++;
+	st->published = true;
+	st->heater_on = heater_on;
+	st->last_time = now;
+}
+
+void status_close(status_t *st){
+	if (st->shm != NULL){
+		munmap(st->shm, sizeof(thermd_shm_t));
+		st->shm = NULL;
+	}
+}
@@ -0,0 +1,49 @@
+/*
+ *  Heater status publisher for thermd
+ *
+ *  Publishes a zone's heater state either as a text file, replaced
+ *  atomically with write-to-temp + rename, or as a shared memory segment
+ *  (see thermd_shm.h). Either way it only writes when the state changes
+ *  or the heartbeat interval has passed.
+ */
+
+#ifndef STATUS_H
+#define STATUS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "thermd_shm.h"
+
+#define STATUS_OK	0
+#define STATUS_ERR	1
+
+#define STATUS_FILE	0
+#define STATUS_SHM	1
+
+#define STATUS_PATH_SIZE 108
+
+typedef struct {
+	uint8_t mode;
+	char path[STATUS_PATH_SIZE];
+	char tmp_path[STATUS_PATH_SIZE + 4];
+	bool fsync;
+	/* seconds between writes when nothing changed */
+	double heartbeat;
+	/* last publish */
+	bool published;
+	bool heater_on;
+	double last_time;
+	/* shared memory mode */
+	thermd_shm_t *shm;
+	/* stats */
+	uint64_t writes;
+	uint64_t skipped;
+	uint64_t errors;
+}status_t;
+
+/* Function prototypes */
+int status_open(status_t *st, const char *spec, bool fsync, double heartbeat);
+void status_publish(status_t *st, bool heater_on, double now);
+void status_close(status_t *st);
+
+#endif
@@ -0,0 +1,132 @@
+/*
+ *  Shared memory telemetry snapshot for thermd
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "telemetry.h"
+#include "ticker.h"
+
+static int map_shared(telemetry_t *t){
+	int fd = shm_open(t->name, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (fd < 0){
+		syslog(LOG_ERR, "Couldn't create shared memory %s\n", t->name);
+		return TELEMETRY_ERR;
+	}
+	if (ftruncate(fd, t->size) < 0){
+		syslog(LOG_ERR, "Couldn't size shared memory %s\n", t->name);
+		close(fd);
+		return TELEMETRY_ERR;
+	}
+	t->shm = mmap(NULL, t->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	/* the mapping stays valid without the fd */
+	close(fd);
+	if (t->shm == MAP_FAILED){
+		syslog(LOG_ERR, "Couldn't map shared memory %s\n", t->name);
+		t->shm = NULL;
+		return TELEMETRY_ERR;
+	}
+	/* the segment may outlive a thermd that crashed mid-publish with seq odd */
+	__atomic_store_n(&t->shm->seq, 0, __ATOMIC_RELEASE);
+	return TELEMETRY_OK;
+}
+
+/**
+ *  Creates the snapshot sized for nzones zones, the zone names are
+ *  filled in once here since they never change
+ *  An empty name keeps the snapshot private to thermd, for the control
+ *  socket, instead of creating a shared memory segment
+ */
+int telemetry_open(telemetry_t *t, const char *name, zone_t *zones, uint32_t nzones){
+	uint32_t i;
+
+	memset(t, 0, sizeof(*t));
+	strncpy(t->name, name, TELEMETRY_NAME_SIZE - 1);
+	t->size = THERMD_TELEMETRY_SIZE(nzones);
+
+	if (strlen(t->name)){
+		if (map_shared(t) != TELEMETRY_OK){
+			return TELEMETRY_ERR;
+		}
+	}
+	else{
+		t->shm = mmap(NULL, t->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (t->shm == MAP_FAILED){
+			t->shm = NULL;
+			return TELEMETRY_ERR;
+		}
+	}
+
+	t->next = calloc(1, t->size);
+	if (t->next == NULL){
+		telemetry_close(t);
+		return TELEMETRY_ERR;
+	}
+	t->next->magic = THERMD_TELEMETRY_MAGIC;
+	t->next->version = THERMD_TELEMETRY_VERSION;
+	t->next->nzones = nzones;
+	for (i = 0; i < nzones; i++){
+		strncpy(t->next->zones[i].name, zones[i].name, THERMD_ZONE_NAME_SIZE - 1);
+	}
+
+	thermd_seqlock_write_begin(&t->shm->seq);
+	t->shm->magic = t->next->magic;
+	t->shm->version = t->next->version;
+	memcpy(&t->shm->nzones, &t->next->nzones, t->size - offsetof(thermd_telemetry_t, nzones));
+	thermd_seqlock_write_end(&t->shm->seq);
+	return TELEMETRY_OK;
+}
+
+/**
+ *  Writes the result of the tick that just ran
+ *  The snapshot is built first, taking the sampler locks on the way, so
+ *  the seqlock is only held for a single copy and readers never see one
+ *  zone from this tick next to another from the last
+ */
+void telemetry_publish(telemetry_t *t, zone_t *zones, uint32_t nzones, const thermd_health_t *health){
+	thermd_zone_snapshot_t *snap;
+	uint32_t i;
+
+	if (t->shm == NULL){
+		return;
+	}
+	if (nzones > t->next->nzones){
+		nzones = t->next->nzones;
+	}
+
+	t->next->timestamp = (uint64_t) ticker_time();
+	t->next->health = *health;
+	for (i = 0; i < nzones; i++){
+		snap = &t->next->zones[i];
+		snap->temp = zones[i].temp;
+		snap->setpoint = zones[i].setpoint;
+		snap->heater_on = zones[i].heater_on;
+		snap->valid = zones[i].valid;
+		snap->schedule_version = zones[i].schedule.version;
+		snap->flags = zones[i].override ? THERMD_ZONE_OVERRIDE : 0;
+		snap->heater_cycles = zones[i].control.cycles;
+		sampler_stats(&zones[i].sampler, &snap->sensor_samples, &snap->sensor_errors);
+	}
+
+	/* everything after the seq field */
+	thermd_seqlock_write_begin(&t->shm->seq);
+	memcpy(&t->shm->nzones, &t->next->nzones, t->size - offsetof(thermd_telemetry_t, nzones));
+	thermd_seqlock_write_end(&t->shm->seq);
+	t->publishes++;
+}
+
+void telemetry_close(telemetry_t *t){
+	if (t->shm != NULL){
+		munmap(t->shm, t->size);
+		t->shm = NULL;
+	}
+	free(t->next);
+	t->next = NULL;
+}
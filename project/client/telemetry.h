@@ -0,0 +1,37 @@
+/*
+ *  Shared memory telemetry snapshot for thermd
+ *
+ *  Publishes every zone's latest reading and the daemon's health
+ *  counters into one seqlock protected segment (layout in thermd_shm.h)
+ *  once per control tick. Local tools map it and read consistent
+ *  snapshots without talking to thermd at all.
+ */
+
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "thermd_shm.h"
+#include "zone.h"
+
+#define TELEMETRY_OK	0
+#define TELEMETRY_ERR	1
+
+#define TELEMETRY_NAME_SIZE 100
+
+typedef struct {
+	char name[TELEMETRY_NAME_SIZE];
+	thermd_telemetry_t *shm;
+	size_t size;
+	/* the next snapshot, built before the seqlock is taken */
+	thermd_telemetry_t *next;
+	uint64_t publishes;
+}telemetry_t;
+
+/* Function prototypes */
+int telemetry_open(telemetry_t *t, const char *name, zone_t *zones, uint32_t nzones);
+void telemetry_publish(telemetry_t *t, zone_t *zones, uint32_t nzones, const thermd_health_t *health);
+void telemetry_close(telemetry_t *t);
+
+#endif
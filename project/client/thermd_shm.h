@@ -0,0 +1,123 @@
+/*
+ *  Shared memory published by thermd
+ *
+ *  Two kinds of segment, both seqlock protected:
+ *  - per-zone heater status, when a zone has status=shm:/name
+ *  - one telemetry snapshot for the whole daemon, telemetry_shm=/name,
+ *    holding every zone's temperature, setpoint, status and schedule
+ *    version plus the daemon's health counters
+ *
+ *  Consumers shm_open() a segment read only, mmap it once and then call
+ *  the read functions below for a consistent copy. Reads take no locks
+ *  and no system calls, a write in progress just makes the reader retry.
+ */
+
+#ifndef THERMD_SHM_H
+#define THERMD_SHM_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define THERMD_SHM_MAGIC 0x54484d44		/* "THMD" */
+#define THERMD_SHM_VERSION 1
+#define THERMD_TELEMETRY_MAGIC 0x54484d54	/* "THMT" */
+#define THERMD_TELEMETRY_VERSION 1
+
+#define THERMD_ZONE_NAME_SIZE 32
+
+/* zone snapshot flags */
+#define THERMD_ZONE_OVERRIDE	0x1
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	/* seqlock, odd while thermd is writing */
+	uint32_t seq;
+	uint32_t heater_on;
+	/* wall clock time of the last publish */
+	uint64_t timestamp;
+}thermd_shm_t;
+
+typedef struct {
+	/* control loop */
+	uint64_t ticks;
+	uint64_t overruns;
+	double jitter_max_ms;
+	/* server traffic */
+	uint64_t polls;
+	uint64_t poll_failures;
+	uint64_t posts;
+	uint64_t post_failures;
+}thermd_health_t;
+
+typedef struct {
+	char name[THERMD_ZONE_NAME_SIZE];
+	double temp;
+	double setpoint;
+	uint32_t heater_on;
+	/* 0 if the last tick had no sensor reading */
+	uint32_t valid;
+	uint32_t schedule_version;
+	uint32_t flags;
+	uint64_t sensor_samples;
+	uint64_t sensor_errors;
+	uint64_t heater_cycles;
+}thermd_zone_snapshot_t;
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	/* seqlock, covers everything after it */
+	uint32_t seq;
+	uint32_t nzones;
+	/* wall clock time of the last publish */
+	uint64_t timestamp;
+	thermd_health_t health;
+	thermd_zone_snapshot_t zones[];
+}thermd_telemetry_t;
+
+#define THERMD_TELEMETRY_SIZE(nzones) (sizeof(thermd_telemetry_t) + (nzones) * sizeof(thermd_zone_snapshot_t))
+
+/**
+ *  Copies len bytes out of a seqlock protected segment
+ */
+static inline void thermd_seqlock_read(const uint32_t *seq, void *dst, const void *src, size_t len){
+	uint32_t start;
+	do {
+		while ((start = __atomic_load_n(seq, __ATOMIC_ACQUIRE)) & 1);
+		memcpy(dst, src, len);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (__atomic_load_n(seq, __ATOMIC_RELAXED) != start);
+}
+
+/**
+ *  Copies a zone status segment
+ */
+static inline void thermd_shm_read(const thermd_shm_t *shm, thermd_shm_t *out){
+	thermd_seqlock_read(&shm->seq, out, shm, sizeof(*out));
+}
+
+/**
+ *  Copies the telemetry snapshot, out must have room for max_zones zones
+ *  (THERMD_TELEMETRY_SIZE(max_zones) bytes), returns the zones copied
+ */
+static inline uint32_t thermd_telemetry_read(const thermd_telemetry_t *shm, thermd_telemetry_t *out, uint32_t max_zones){
+	/* the zone count is fixed when thermd creates the segment */
+	uint32_t nzones = shm->nzones < max_zones ? shm->nzones : max_zones;
+	thermd_seqlock_read(&shm->seq, out, shm, THERMD_TELEMETRY_SIZE(nzones));
+	return nzones;
+}
+
+/**
+ *  Writer side, used by thermd
+ */
+static inline void thermd_seqlock_write_begin(uint32_t *seq){
+	__atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void thermd_seqlock_write_end(uint32_t *seq){
+	__atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+}
+
+#endif
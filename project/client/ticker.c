@@ -0,0 +1,225 @@
+/*
+ *  Absolute deadline ticker for thermd
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "ticker.h"
+
+#define NSEC_PER_SEC 1000000000ULL
+
+/* replays run on a clock that only moves with the ticks, starting at 0 */
+static bool virtual_clock;
+static double virtual_now;
+/* wall clock time at virtual 0 */
+static time_t virtual_epoch;
+
+static uint64_t to_ns(const struct timespec *ts){
+	return (uint64_t) ts->tv_sec * NSEC_PER_SEC + ts->tv_nsec;
+}
+
+static void from_ns(struct timespec *ts, uint64_t ns){
+	ts->tv_sec = ns / NSEC_PER_SEC;
+	ts->tv_nsec = ns % NSEC_PER_SEC;
+}
+
+/**
+ *  Seconds as ns, rounded the way periods are, so a deadline plus
+ *  ticker_ns(period) lands exactly on the tick that period away
+ */
+uint64_t ticker_ns(double secs){
+	return secs > 0 ? (uint64_t)(secs * NSEC_PER_SEC) : 0;
+}
+
+/**
+ *  Seconds on CLOCK_MONOTONIC
+ */
+double ticker_now(void){
+	struct timespec now;
+	if (virtual_clock){
+		return virtual_now;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/**
+ *  Wall clock seconds, like time(NULL)
+ */
+time_t ticker_time(void){
+	if (virtual_clock){
+		return virtual_epoch + (time_t) virtual_now;
+	}
+	return time(NULL);
+}
+
+/**
+ *  Switches every ticker to virtual time, epoch is the wall clock at the
+ *  first tick, call before ticker_init
+ */
+void ticker_set_virtual(time_t epoch){
+	virtual_clock = true;
+	virtual_now = 0;
+	virtual_epoch = epoch;
+}
+
+/**
+ *  Sets up a ticker with period in seconds, the first tick is immediate
+ */
+void ticker_init(ticker_t *t, double period){
+	struct timespec now;
+
+	ticker_set_period(t, period);
+	t->ticks = 0;
+	t->overruns = 0;
+	t->jitter_sum = 0;
+	t->jitter_max = 0;
+	t->nfds = 0;
+	t->wake_fd = -1;
+	t->early = 0;
+	if (virtual_clock){
+		from_ns(&t->next, (uint64_t)(virtual_now * NSEC_PER_SEC));
+		return;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	t->next = now;
+}
+
+/**
+ *  Changes the period from the next deadline on, keeping the stats
+ */
+void ticker_set_period(ticker_t *t, double period){
+	if (period <= 0){
+		period = 1;
+	}
+	t->period_ns = ticker_ns(period);
+}
+
+/**
+ *  Moves the next deadline on to the first one at or after when_ns (ns
+ *  on the ticker's clock), the deadlines in between aren't overruns
+ */
+void ticker_skip_until(ticker_t *t, uint64_t when_ns){
+	uint64_t next_ns = to_ns(&t->next);
+
+	if (when_ns > next_ns){
+		next_ns += (when_ns - next_ns + t->period_ns - 1) / t->period_ns * t->period_ns;
+		from_ns(&t->next, next_ns);
+	}
+}
+
+/**
+ *  Ends waits early whenever fd is readable, the caller drains it
+ */
+int ticker_watch(ticker_t *t, int fd){
+	if (fd < 0 || t->nfds == TICKER_MAX_FDS){
+		return -1;
+	}
+	t->fds[t->nfds++] = fd;
+	return 0;
+}
+
+/**
+ *  An eventfd other threads write to to end a wait early, made on first use
+ */
+int ticker_wake_fd(ticker_t *t){
+	if (t->wake_fd < 0){
+		t->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (t->wake_fd >= 0 && ticker_watch(t, t->wake_fd) < 0){
+			close(t->wake_fd);
+			t->wake_fd = -1;
+		}
+	}
+	return t->wake_fd;
+}
+
+/**
+ *  Sleeps in ppoll() on the watched fds until the deadline, ppoll takes
+ *  the thread's timer slack where a timerfd wouldn't, so the kernel can
+ *  batch the wakeup with others. Returns true if an fd ended it early.
+ */
+static bool poll_until(ticker_t *t, uint64_t deadline_ns){
+	struct pollfd fds[TICKER_MAX_FDS];
+	struct timespec now, left;
+	uint64_t now_ns, count;
+	uint32_t i;
+	int n;
+
+	for (i = 0; i < t->nfds; i++){
+		fds[i].fd = t->fds[i];
+		fds[i].events = POLLIN;
+	}
+	while (1){
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		now_ns = to_ns(&now);
+		if (now_ns >= deadline_ns){
+			return false;
+		}
+		from_ns(&left, deadline_ns - now_ns);
+		n = ppoll(fds, t->nfds, &left, NULL);
+		if (n > 0){
+			if (t->wake_fd >= 0){
+				/* EAGAIN when it was one of the other fds */
+				n = read(t->wake_fd, &count, sizeof(count));
+			}
+			return true;
+		}
+	}
+}
+
+/**
+ *  Sleeps until the next deadline and moves the deadline on by one period
+ *  If the last tick ran past one or more deadlines they are skipped and
+ *  counted as overruns instead of firing back to back.
+ */
+void ticker_wait(ticker_t *t){
+	struct timespec now;
+	uint64_t next_ns, now_ns, missed;
+	double late;
+
+	if (virtual_clock){
+		/* nothing else runs in a replay, so every deadline is met exactly */
+		t->deadline_ns = to_ns(&t->next);
+		t->deadline = t->deadline_ns / 1e9;
+		virtual_now = t->deadline;
+		t->ticks++;
+		from_ns(&t->next, to_ns(&t->next) + t->period_ns);
+		return;
+	}
+
+	if (t->nfds > 0 && poll_until(t, to_ns(&t->next))){
+		/* woken for a command, tick now and count the period from here */
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		t->deadline_ns = to_ns(&now);
+		t->deadline = t->deadline_ns / 1e9;
+		t->ticks++;
+		t->early++;
+		from_ns(&t->next, to_ns(&now) + t->period_ns);
+		return;
+	}
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t->next, NULL) == EINTR);
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	next_ns = to_ns(&t->next);
+	now_ns = to_ns(&now);
+
+	t->deadline_ns = next_ns;
+	t->deadline = next_ns / 1e9;
+	late = now_ns > next_ns ? (now_ns - next_ns) / 1e6 : 0;
+	t->ticks++;
+	t->jitter_sum += late;
+	if (late > t->jitter_max){
+		t->jitter_max = late;
+	}
+
+	next_ns += t->period_ns;
+	if (next_ns <= now_ns){
+		missed = (now_ns - next_ns) / t->period_ns + 1;
+		t->overruns += missed;
+		next_ns += missed * t->period_ns;
+	}
+	from_ns(&t->next, next_ns);
+}
@@ -0,0 +1,60 @@
+/*
+ *  Absolute deadline ticker for thermd
+ *
+ *  Sleeps with clock_nanosleep(TIMER_ABSTIME) to fixed deadlines on
+ *  CLOCK_MONOTONIC, so the loop period doesn't drift with however long
+ *  the work in a tick took, and records how late each wakeup was.
+ *
+ *  For low power, ticker_skip_until() sleeps through deadlines nothing
+ *  needs, and a watched fd (see ticker_watch/ticker_wake_fd) ends a
+ *  sleep early so commands and signals don't wait for the next deadline.
+ *
+ *  ticker_set_virtual() swaps in a virtual clock for replays: waits
+ *  return at once, and ticker_now()/ticker_time() only move as the
+ *  ticks do.
+ */
+
+#ifndef TICKER_H
+#define TICKER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+#define TICKER_MAX_FDS 4
+
+typedef struct {
+	struct timespec next;
+	uint64_t period_ns;
+	/* nominal time of the tick in progress, seconds on CLOCK_MONOTONIC,
+	 * and the same in whole ns for deadlines that must land on a tick */
+	double deadline;
+	uint64_t deadline_ns;
+	/* stats */
+	uint64_t ticks;
+	/* deadlines missed because a tick ran longer than the period */
+	uint64_t overruns;
+	/* wakeup lateness in ms */
+	double jitter_sum;
+	double jitter_max;
+	/* readable fds end a wait early, wake_fd is the ticker's own eventfd */
+	int fds[TICKER_MAX_FDS];
+	uint32_t nfds;
+	int wake_fd;
+	/* waits ended early by a watched fd */
+	uint64_t early;
+}ticker_t;
+
+/* Function prototypes */
+void ticker_init(ticker_t *t, double period);
+void ticker_set_period(ticker_t *t, double period);
+void ticker_wait(ticker_t *t);
+void ticker_skip_until(ticker_t *t, uint64_t when_ns);
+int ticker_watch(ticker_t *t, int fd);
+int ticker_wake_fd(ticker_t *t);
+uint64_t ticker_ns(double secs);
+double ticker_now(void);
+time_t ticker_time(void);
+void ticker_set_virtual(time_t epoch);
+
+#endif
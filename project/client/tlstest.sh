@@ -0,0 +1,110 @@
+#!/bin/bash
+#
+#  TLS connection reuse check for thermd
+#
+#  Runs ./thermd against ./mockserver -t with a throwaway self-signed
+#  certificate (trusted through tls_ca, so verification stays on) and
+#  checks the handshake counters on both ends:
+#
+#  - on a steady keep-alive connection every request after the first
+#    reuses it, so thermd and the server each count one handshake
+#  - with the server dropping connections, the reconnects resume the
+#    cached session instead of doing full handshakes
+#
+#  ./tlstest.sh
+#  SECS=5 PORT=19102 ./tlstest.sh
+#
+#  Needs the openssl command line tool. Exits 1 if a check fails.
+#
+
+SECS=${SECS:-3}
+PORT=${PORT:-19102}
+DIR=$(cd "$(dirname "$0")" && pwd)
+WORK=$(mktemp -d /tmp/thermd-tls.XXXXXX)
+FAILED=0
+
+cleanup(){
+	[ -n "$MOCK_PID" ] && kill "$MOCK_PID" 2>/dev/null
+	[ -n "$THERMD_PID" ] && kill "$THERMD_PID" 2>/dev/null
+	rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+if ! openssl req -x509 -newkey rsa:2048 -nodes -days 1 -subj /CN=127.0.0.1 \
+		-addext subjectAltName=IP:127.0.0.1 -keyout "$WORK/key.pem" -out "$WORK/cert.pem" 2>/dev/null; then
+	echo "couldn't make a test certificate"
+	exit 1
+fi
+cat "$WORK/cert.pem" "$WORK/key.pem" > "$WORK/server.pem"
+
+printf '68\n69\n70\n71\n72\n71\n70\n69\n' > "$WORK/trace"
+cat > "$WORK/thermd.conf" <<EOF
+endpoint=https://127.0.0.1:$PORT
+tls_ca=$WORK/cert.pem
+logfile=$WORK/thermd.log
+sensor=fake:$WORK/trace
+timezone=UTC
+control_period=0.1
+telemetry_period=0.1
+poll_min=0.1
+poll_max=0.1
+status=$WORK/status
+metrics_file=$WORK/metrics
+metrics_period=0.5
+EOF
+
+metric(){
+	awk -v name="$1" '$1 == name { print $2 }' "$WORK/metrics"
+}
+
+# a counter from the server's /stats, taken over its own connection
+server(){
+	curl -s --cacert "$WORK/cert.pem" "https://127.0.0.1:$PORT/stats" | sed "s/.*\"$1\":\([0-9]*\).*/\1/"
+}
+
+check(){
+	if [ "$2" ]; then
+		echo "ok   $1"
+	else
+		echo "FAIL $1"
+		FAILED=1
+	fi
+}
+
+# runs thermd for SECS against a mockserver started with $@
+run(){
+	"$DIR/mockserver" -p "$PORT" -i 3600 -t "$WORK/server.pem" "$@" > /dev/null &
+	MOCK_PID=$!
+	sleep 0.3
+	rm -f "$WORK/metrics"
+	"$DIR/thermd" -f -c "$WORK/thermd.conf" 2>/dev/null &
+	THERMD_PID=$!
+	sleep "$SECS"
+	kill "$THERMD_PID"
+	wait "$THERMD_PID" 2>/dev/null
+	THERMD_PID=
+	requests=$(metric thermd_requests_total)
+	failures=$(metric thermd_request_failures_total)
+	handshakes=$(metric thermd_tls_handshakes_total)
+	reused=$(metric thermd_connections_reused_total)
+	# less the handshake of the /stats request asking
+	server_handshakes=$(($(server handshakes) - 1))
+	server_resumed=$(server resumed)
+	kill "$MOCK_PID"
+	wait "$MOCK_PID" 2>/dev/null
+	MOCK_PID=
+	echo "$requests requests, $failures failed, $handshakes handshakes, $reused reused;" \
+		"server: $server_handshakes handshakes, $server_resumed resumed"
+}
+
+run
+check "requests went through" "$([ "${requests:-0}" -gt 10 ] && [ "$failures" -eq 0 ] && echo y)"
+check "one handshake in thermd" "$([ "$handshakes" -eq 1 ] && echo y)"
+check "every other request reused it" "$([ "$reused" -eq $((requests - 1)) ] && echo y)"
+check "one handshake at the server" "$([ "$server_handshakes" -eq 1 ] && echo y)"
+
+run -d 20
+check "reconnected after drops" "$([ "${handshakes:-0}" -gt 1 ] && echo y)"
+check "reconnects resumed the session" "$([ "${server_resumed:-0}" -gt 0 ] && echo y)"
+
+exit $FAILED
@@ -0,0 +1,160 @@
+/*
+ *  Local time of day for thermd
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <syslog.h>
+#include "tz.h"
+
+#define SECS_PER_DAY 86400
+/* how far ahead to look for the next transition before giving up */
+#define TZ_HORIZON_DAYS 400
+/* 1970-01-01 was a Thursday */
+#define EPOCH_WDAY 4
+/* where tzset() looks for zone files unless TZDIR says otherwise */
+#define TZ_DIR "/usr/share/zoneinfo"
+#define TZ_PATH_SIZE 512
+
+static long offset_at(time_t t){
+	struct tm tm;
+	localtime_r(&t, &tm);
+	return tm.tm_gmtoff;
+}
+
+/**
+ *  Caches the offset at now and finds when it next changes, stepping a
+ *  day at a time and then bisecting down to the second
+ *  Runs once per transition, so twice a year in most zones
+ */
+static void find_transition(tz_t *tz, time_t now){
+	time_t lo = now, hi;
+	time_t mid;
+	uint32_t day;
+
+	tz->offset = offset_at(now);
+	tz->valid_from = now;
+	tz->next_transition = now + (time_t) TZ_HORIZON_DAYS * SECS_PER_DAY;
+
+	for (day = 1; day <= TZ_HORIZON_DAYS; day++){
+		hi = now + (time_t) day * SECS_PER_DAY;
+		if (offset_at(hi) != tz->offset){
+			/* the offset changes somewhere in (lo, hi] */
+			while (hi - lo > 1){
+				mid = lo + (hi - lo) / 2;
+				if (offset_at(mid) == tz->offset){
+					lo = mid;
+				}
+				else{
+					hi = mid;
+				}
+			}
+			tz->next_transition = hi;
+			break;
+		}
+		lo = hi;
+	}
+	tz->loaded = true;
+}
+
+/**
+ *  True for a POSIX TZ string, a zone abbreviation (3+ letters or <...>)
+ *  followed by its UTC offset, e.g. "MST7MDT,M3.2.0,M11.1.0" or "<+03>-3"
+ */
+static bool posix_zone(const char *zone){
+	size_t n;
+
+	if (zone[0] == '<'){
+		n = strcspn(zone, ">");
+		if (zone[n] != '>'){
+			return false;
+		}
+		n++;
+	}
+	else{
+		for (n = 0; isalpha((unsigned char) zone[n]); n++);
+		if (n < 3){
+			return false;
+		}
+	}
+	if (zone[n] == '+' || zone[n] == '-'){
+		n++;
+	}
+	return isdigit((unsigned char) zone[n]);
+}
+
+/**
+ *  Checks that tzset() will resolve zone rather than quietly fall back to
+ *  UTC: a POSIX TZ string, or a tzdata name with a file under TZDIR
+ *  (/usr/share/zoneinfo). Empty is the system zone and always passes.
+ */
+int tz_check(const char *zone){
+	char path[TZ_PATH_SIZE];
+	const char *dir = getenv("TZDIR");
+
+	if (zone == NULL || strlen(zone) == 0 || posix_zone(zone)){
+		return TZ_OK;
+	}
+	if (zone[0] == ':'){
+		zone++;
+	}
+	if (zone[0] == '/'){
+		snprintf(path, sizeof(path), "%s", zone);
+	}
+	else{
+		snprintf(path, sizeof(path), "%s/%s", dir != NULL ? dir : TZ_DIR, zone);
+	}
+	return access(path, R_OK) == 0 ? TZ_OK : TZ_ERR;
+}
+
+/**
+ *  Loads the zone rules, zone is a tzdata name ("America/Denver") or a
+ *  POSIX TZ string ("MST7MDT,M3.2.0,M11.1.0"), empty uses the system zone
+ *  A zone tz_check() rejects leaves the zone in effect alone.
+ *  Changes TZ in the environment, which isn't safe against localtime()
+ *  or syslog() running on another thread at the same moment. thermd
+ *  calls it before any thread starts, except on a reload, where a
+ *  sampler or the control socket thread could be logging as it runs.
+ */
+int tz_init(tz_t *tz, const char *zone){
+	if (tz_check(zone) != TZ_OK){
+		return TZ_ERR;
+	}
+	memset(tz, 0, sizeof(*tz));
+	if (zone != NULL && strlen(zone) > 0){
+		if (setenv("TZ", zone, 1) != 0){
+			return TZ_ERR;
+		}
+	}
+	else{
+		/* back to the system zone, not whatever zone was set last */
+		unsetenv("TZ");
+	}
+	tzset();
+	find_transition(tz, time(NULL));
+	syslog(LOG_INFO, "timezone %s, UTC offset %ld s, next change at %ld\n",
+		(zone != NULL && strlen(zone) > 0) ? zone : "system", tz->offset, (long) tz->next_transition);
+	return TZ_OK;
+}
+
+/**
+ *  Gets the local day of week (0 is Sunday) and seconds since local midnight
+ */
+void tz_local(tz_t *tz, time_t now, uint8_t *wday, uint32_t *secs){
+	long long local, days;
+
+	if (!tz->loaded || now >= tz->next_transition || now < tz->valid_from){
+		find_transition(tz, now);
+	}
+
+	local = (long long) now + tz->offset;
+	days = local / SECS_PER_DAY;
+	if (local % SECS_PER_DAY < 0){
+		days--;
+	}
+	*secs = (uint32_t)(local - days * SECS_PER_DAY);
+	*wday = (uint8_t)(((days + EPOCH_WDAY) % 7 + 7) % 7);
+}
@@ -0,0 +1,33 @@
+/*
+ *  Local time of day for thermd
+ *
+ *  The zone rules are loaded once, the UTC offset in effect and the time
+ *  of the next offset change (DST transition) are cached, and local time
+ *  of day is plain arithmetic on time() until that transition comes up.
+ */
+
+#ifndef TZ_H
+#define TZ_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+#define TZ_OK	0
+#define TZ_ERR	1
+
+typedef struct {
+	/* seconds east of UTC */
+	long offset;
+	/* the cached offset is valid for valid_from <= t < next_transition */
+	time_t valid_from;
+	time_t next_transition;
+	bool loaded;
+}tz_t;
+
+/* Function prototypes */
+int tz_check(const char *zone);
+int tz_init(tz_t *tz, const char *zone);
+void tz_local(tz_t *tz, time_t now, uint8_t *wday, uint32_t *secs);
+
+#endif
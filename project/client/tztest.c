@@ -0,0 +1,152 @@
+/*
+ *  DST checks for tz.c and schedule.c
+ *
+ *  Steps through the hours around the 2026 America/Denver transitions
+ *  (spring forward 2026-03-08 02:00 MST, fall back 2026-11-01 02:00 MDT)
+ *  and checks that tz_local() agrees with localtime_r() to the second,
+ *  walking forwards and backwards so the cached offset is crossed both
+ *  ways, and that the schedule picks the setpoint the local wall clock
+ *  says it should in the skipped and repeated hours. Run with
+ *  "make test", exits 1 if any check fails.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include "tz.h"
+#include "schedule.h"
+
+#define TZTEST_OK	0
+#define TZTEST_ERR	1
+
+#define HOUR 3600
+/* 2026-03-08 09:00 UTC and 2026-11-01 08:00 UTC */
+#define SPRING_FORWARD	1772960400
+#define FALL_BACK	1793520000
+
+/* every day: 01:30 in the repeated hour, 02:30 in the skipped one */
+static const setpoint_t entries[] = {
+	{ DAYS_ALL, 1 * HOUR + 1800, 61 },
+	{ DAYS_ALL, 2 * HOUR + 1800, 62 },
+	{ DAYS_ALL, 3 * HOUR + 1800, 63 },
+	{ DAYS_ALL, 22 * HOUR, 60 },
+};
+#define NENTRIES (sizeof(entries) / sizeof(entries[0]))
+
+static tz_t tz;
+static schedule_t sched;
+static uint32_t checks;
+
+/**
+ *  The setpoint a person reading the wall clock expects: the last entry
+ *  at or before the local time of day, or yesterday's last one
+ */
+static double expected_setpoint(uint32_t secs){
+	double temp = entries[NENTRIES - 1].temp;
+	uint32_t i;
+
+	for (i = 0; i < NENTRIES; i++){
+		if (entries[i].secs <= secs){
+			temp = entries[i].temp;
+		}
+	}
+	return temp;
+}
+
+static int check(time_t t){
+	struct tm tm;
+	uint32_t secs, want_secs;
+	uint8_t wday;
+	double temp;
+
+	tz_local(&tz, t, &wday, &secs);
+	localtime_r(&t, &tm);
+	want_secs = tm.tm_hour * HOUR + tm.tm_min * 60 + tm.tm_sec;
+	checks++;
+	if (wday != tm.tm_wday || secs != want_secs){
+		printf("FAIL %ld: tz_local day %u %u s, localtime_r day %d %u s\n",
+			(long) t, wday, secs, tm.tm_wday, want_secs);
+		return TZTEST_ERR;
+	}
+	temp = schedule_lookup(&sched, wday, secs);
+	if (temp != expected_setpoint(secs)){
+		printf("FAIL %ld: %02u:%02u:%02u local gets setpoint %.0f, expected %.0f\n",
+			(long) t, secs / HOUR, secs / 60 % 60, secs % 60, temp, expected_setpoint(secs));
+		return TZTEST_ERR;
+	}
+	return TZTEST_OK;
+}
+
+/**
+ *  Every second within a minute of the transition and every minute for
+ *  three hours either side, in the direction of step
+ */
+static int walk(time_t transition, int step){
+	time_t t, from = transition - 3 * HOUR, to = transition + 3 * HOUR;
+
+	for (t = step > 0 ? from : to; t >= from && t <= to; t += step){
+		if (check(t) != TZTEST_OK){
+			return TZTEST_ERR;
+		}
+		if (t > transition - 60 && t < transition + 60){
+			continue;
+		}
+		t += step * 59;
+	}
+	return TZTEST_OK;
+}
+
+/**
+ *  Checks the wall clock and setpoint at one instant against what's known
+ *  about the transition, independent of localtime_r()
+ */
+static int expect(time_t t, uint32_t local, double setpoint){
+	uint32_t secs;
+	uint8_t wday;
+
+	tz_local(&tz, t, &wday, &secs);
+	checks++;
+	if (secs != local || schedule_lookup(&sched, wday, secs) != setpoint){
+		printf("FAIL %ld: %02u:%02u local, setpoint %.0f, expected %02u:%02u and %.0f\n",
+			(long) t, secs / HOUR, secs / 60 % 60, schedule_lookup(&sched, wday, secs),
+			local / HOUR, local / 60 % 60, setpoint);
+		return TZTEST_ERR;
+	}
+	return TZTEST_OK;
+}
+
+int main(void){
+	int ret = TZTEST_OK;
+
+	if (tz_init(&tz, "America/Denver") != TZ_OK || schedule_compile(&sched, entries, NENTRIES) != SCHEDULE_OK){
+		printf("FAIL setup\n");
+		return TZTEST_ERR;
+	}
+
+	/* 01:59:59 MST, then 03:00 MDT: 02:30 never happens on the clock,
+	 * its setpoint takes over at the jump */
+	ret |= expect(SPRING_FORWARD - 1, 2 * HOUR - 1, 61);
+	ret |= expect(SPRING_FORWARD, 3 * HOUR, 62);
+	ret |= expect(SPRING_FORWARD + 1800, 3 * HOUR + 1800, 63);
+	/* 01:30 MDT, 01:59:59 MDT, then 01:00 MST: the repeated hour runs
+	 * the 01:30 setpoint twice */
+	ret |= expect(FALL_BACK - 1800, HOUR + 1800, 61);
+	ret |= expect(FALL_BACK - 1, 2 * HOUR - 1, 61);
+	ret |= expect(FALL_BACK, HOUR, 60);
+	ret |= expect(FALL_BACK + 1800, HOUR + 1800, 61);
+	ret |= expect(FALL_BACK + HOUR, 2 * HOUR, 61);
+
+	ret |= walk(SPRING_FORWARD, 1);
+	ret |= walk(SPRING_FORWARD, -1);
+	ret |= walk(FALL_BACK, 1);
+	ret |= walk(FALL_BACK, -1);
+
+	schedule_free(&sched);
+	if (ret != TZTEST_OK){
+		return TZTEST_ERR;
+	}
+	printf("tztest: %u checks passed\n", checks);
+	return TZTEST_OK;
+}
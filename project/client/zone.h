@@ -0,0 +1,60 @@
+/*
+ *  Per-zone state for thermd
+ *
+ *  One thermd process drives any number of zones, each with its own
+ *  sensor, schedule, controller and status file. Everything else (the
+ *  sampler thread, the connection pool, the uploader) is shared.
+ */
+
+#ifndef ZONE_H
+#define ZONE_H
+
+#include <stdbool.h>
+#include "sensor.h"
+#include "sampler.h"
+#include "control.h"
+#include "schedule.h"
+#include "status.h"
+
+#define ZONE_NAME_SIZE 32
+#define ZONE_PATH_SIZE 100
+
+/* Name of the zone made from the top level keys when no [zone] sections exist */
+#define DEFAULT_ZONE_NAME "default"
+
+typedef struct {
+	char name[ZONE_NAME_SIZE];
+	/* from the config */
+	char sensor_spec[ZONE_PATH_SIZE];
+	bool fahrenheit;
+	char status_path[ZONE_PATH_SIZE];
+	/* empty GETs from the endpoint pool */
+	char url[ZONE_PATH_SIZE];
+	/* runtime */
+	sensor_t sensor;
+	sampler_t sampler;
+	control_t control;
+	schedule_t schedule;
+	status_t status;
+	/* setpoint held from the control socket instead of the schedule */
+	bool override;
+	double override_temp;
+	/* CLOCK_MONOTONIC seconds, 0 holds until cleared */
+	double override_until;
+	/* degrees per second, smoothed over ticks, low power mode sleeps by it */
+	double rate;
+	double rate_temp;
+	double rate_time;
+	/* what the server was last sent, report=change posts again once it's stale */
+	bool reported;
+	double reported_temp;
+	bool reported_on;
+	double reported_time;
+	/* result of the last tick */
+	bool valid;
+	double temp;
+	double setpoint;
+	bool heater_on;
+}zone_t;
+
+#endif